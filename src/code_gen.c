@@ -21,6 +21,7 @@
 #include "code_text.h"
 #include "iq_render.h"
 #include "sample.h"
+#include "tx_shm.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -77,10 +78,42 @@ static void usage(int exitcode)
             "\t[-t code_text] parse given code text\n"
             "\t[-S rand_seed] set random seed for reproducible output\n"
             "\t[-M full_scale] limit the output full scale, e.g. use -F 2048 with CS16\n"
-            "\t[-w file] write samples to file ('-' writes to stdout)\n\n");
+            "\t[-w file] write samples to file ('-' writes to stdout)\n"
+            "\t\tshm:NAME[.ext] renders in place into a shared memory ring, e.g. for tx_sdr shm:NAME[.ext]\n\n");
     exit(exitcode);
 }
 
+// Render into a shared memory ring in place, blocking while the ring is full.
+static int render_shm(char const *name, iq_render_t *spec, tone_t *tones)
+{
+    tx_shm_t *shm = tx_shm_create(name, sample_format_str(spec->sample_format), spec->sample_rate, 0);
+    if (!shm)
+        return 1;
+
+    iq_render_stream_t *stream = iq_render_stream_create(spec, tones);
+    size_t sample_size = sample_format_length(spec->sample_format);
+    while (!abort_render) {
+        void *span;
+        ssize_t len = tx_shm_write_span(shm, &span, 100);
+        if (len < 0)
+            continue; // full, the consumer is behind
+        size_t n = iq_render_stream_read(stream, span, (size_t)len / sample_size);
+        if (!n)
+            break;
+        tx_shm_write_done(shm, n * sample_size);
+    }
+    tx_shm_finish(shm);
+
+    // the name goes once the consumer is done with the ring, or on abort
+    while (!abort_render && tx_shm_drain(shm, 100))
+        ;
+    tx_shm_unlink(shm);
+
+    iq_render_stream_free(stream);
+    tx_shm_close(shm);
+    return 0;
+}
+
 #ifdef _WIN32
 BOOL WINAPI
 sighandler(int signum)
@@ -107,6 +140,7 @@ int main(int argc, char **argv)
     double base_f[16] = {10000.0, -10000.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
     double *next_f = base_f;
     char *wr_filename = NULL;
+    char *shm_name = NULL;
 
     iq_render_t spec = {0};
     iq_render_defaults(&spec);
@@ -185,7 +219,12 @@ int main(int argc, char **argv)
         wr_filename = "-";
     }
 
+    int to_shm = !strncmp(wr_filename, "shm:", 4);
+    if (to_shm)
+        wr_filename += 4;
     spec.sample_format = file_info(&wr_filename);
+    if (to_shm)
+        shm_name = wr_filename;
     if (verbosity)
         fprintf(stderr, "Output format %s.\n", sample_format_str(spec.sample_format));
 
@@ -221,7 +260,10 @@ int main(int argc, char **argv)
         fprintf(stderr, "Signal length: %zu us, %zu smp\n\n", length_us, length_smp);
     }
 
-    iq_render_file(wr_filename, &spec, symbols->tone);
+    if (shm_name)
+        render_shm(shm_name, &spec, symbols->tone);
+    else
+        iq_render_file(wr_filename, &spec, symbols->tone);
 
     free_symbols(symbols);
 }
@@ -200,14 +200,56 @@ void output_symbol(symbol_t const *s)
         output_tone(t);
 }
 
-symbol_t *parse_code(char const *code, symbol_t *symbols)
+// Close the current output as the next fixed part of a template.
+static int template_close_part(code_template_t *tpl, symbol_t *symbols, tone_t *out_tone)
+{
+    size_t len = (size_t)(out_tone - symbols[0].tone);
+    tone_t *part = calloc(len + 1, sizeof(tone_t));
+    if (!part)
+        return -1;
+    memcpy(part, symbols[0].tone, len * sizeof(tone_t));
+    tpl->parts[tpl->fields] = part;
+    memset(&symbols[0], 0, sizeof(symbols[0]));
+    return 0;
+}
+
+// A variable field is a transform with "@" for the data, e.g. "{MC @}".
+// Returns 1 for a field, 0 if it is not one, -1 on error.
+static int template_field(code_template_t *tpl, char const **buf)
+{
+    char const *p = *buf + 1;
+    char const *end = strchr(p, '}');
+    if (!end)
+        return 0;
+    char const *at = end;
+    while (at > p && (at[-1] == ' ' || at[-1] == '\t'))
+        --at;
+    if (at == p || at[-1] != '@')
+        return 0;
+    --at;
+
+    if (tpl->fields >= CODE_TEMPLATE_FIELDS) {
+        fprintf(stderr, "Too many template fields, at most %d\n", CODE_TEMPLATE_FIELDS);
+        return -1;
+    }
+    tpl->transforms[tpl->fields] = strndup(p, (size_t)(at - p));
+    if (!tpl->transforms[tpl->fields])
+        return -1;
+    *buf = end + 1;
+    return 1;
+}
+
+static symbol_t *parse_code_fields(char const *code, symbol_t *symbols, code_template_t *tpl)
 {
     if (!code)
         return symbols;
 
+    symbol_t *own = NULL;
     if (!symbols) {
         // enough room for 7-bit ASCII
-        symbols = calloc(128, sizeof(symbol_t));
+        symbols = own = calloc(128, sizeof(symbol_t));
+        if (!symbols)
+            return NULL;
 
         // preset a base tone
         symbols['~'].tone->hz = 10000;
@@ -217,6 +259,7 @@ symbol_t *parse_code(char const *code, symbol_t *symbols)
 
     tone_t *out_tone = symbols[0].tone;
     char const *p = code;
+    int field;
 
     while (*p) {
         skip_ws(&p);
@@ -230,6 +273,21 @@ symbol_t *parse_code(char const *code, symbol_t *symbols)
             parse_tone(&p, &t, symbols);
             append_tone(&out_tone, &t);
         }
+        else if (*p == '{' && tpl && (field = template_field(tpl, &p)) != 0) {
+            // variable field, ends a fixed part
+            if (field > 0 && template_close_part(tpl, symbols, out_tone)) {
+                free(tpl->transforms[tpl->fields]);
+                tpl->transforms[tpl->fields] = NULL;
+                field = -1;
+            }
+            if (field < 0) {
+                free_code_template(tpl);
+                free(own);
+                return NULL;
+            }
+            out_tone = symbols[0].tone;
+            tpl->fields++;
+        }
         else if (*p == '{') {
             // hex output
             append_transform(&out_tone, &p, symbols);
@@ -242,9 +300,67 @@ symbol_t *parse_code(char const *code, symbol_t *symbols)
         }
     }
 
+    if (tpl && template_close_part(tpl, symbols, out_tone)) {
+        free_code_template(tpl);
+        free(own);
+        return NULL;
+    }
+
     return symbols;
 }
 
+symbol_t *parse_code(char const *code, symbol_t *symbols)
+{
+    return parse_code_fields(code, symbols, NULL);
+}
+
+symbol_t *parse_code_template(char const *code, symbol_t *symbols, code_template_t *tpl)
+{
+    *tpl = (code_template_t){0};
+    return parse_code_fields(code, symbols, tpl);
+}
+
+tone_t *code_template_field(code_template_t const *tpl, size_t field, char const *data, symbol_t *symbols)
+{
+    if (field >= tpl->fields)
+        return NULL;
+
+    size_t name_len = strlen(tpl->transforms[field]);
+    size_t data_len = strlen(data);
+    char *arg = malloc(name_len + data_len + 2);
+    if (!arg)
+        return NULL;
+    memcpy(arg, tpl->transforms[field], name_len);
+    arg[name_len] = ' ';
+    memcpy(&arg[name_len + 1], data, data_len + 1);
+    char *res = named_transform_dup(arg);
+    free(arg);
+    if (!res)
+        return NULL;
+
+    size_t len = 0;
+    for (char const *b = res; *b; ++b)
+        for (tone_t const *j = symbols[(int)*b & 0x7f].tone; j->us; ++j)
+            ++len;
+
+    tone_t *tones = calloc(len + 1, sizeof(tone_t));
+    tone_t *out_tone = tones;
+    for (char const *b = res; tones && *b; ++b)
+        append_symbol(&out_tone, &symbols[(int)*b & 0x7f]);
+
+    free(res);
+    return tones;
+}
+
+void free_code_template(code_template_t *tpl)
+{
+    for (size_t i = 0; i <= tpl->fields; ++i)
+        free(tpl->parts[i]);
+    for (size_t i = 0; i < tpl->fields; ++i)
+        free(tpl->transforms[i]);
+    *tpl = (code_template_t){0};
+}
+
 char *parse_code_desc(char const *code)
 {
     if (!code || !*code)
@@ -20,6 +20,7 @@
 #ifndef INCLUDE_CODETEXT_H_
 #define INCLUDE_CODETEXT_H_
 
+#include <stddef.h> /* size_t */
 #include "tone_text.h"
 
 typedef struct {
@@ -27,12 +28,30 @@ typedef struct {
     tone_t tone[1000]; // TODO: really should be dynamic
 } symbol_t;
 
+#define CODE_TEMPLATE_FIELDS 8 ///< most variable fields in a template
+
+/// Code text with variable fields, a field is a transform with "@" for the data, e.g. "{MC @}".
+typedef struct {
+    size_t fields;                             ///< number of variable fields
+    tone_t *parts[CODE_TEMPLATE_FIELDS + 1];   ///< fixed tones before, between, and after the fields
+    char *transforms[CODE_TEMPLATE_FIELDS];    ///< transform of each field, e.g. "MC"
+} code_template_t;
+
 // parsing a code from string or reading in
 
 symbol_t *parse_code(char const *code, symbol_t *symbols);
 
 symbol_t *parse_code_file(char const *filename, symbol_t *symbols);
 
+/// Parse code text with variable fields into fixed parts, definitions go to the symbols.
+/// Returns NULL on error, e.g. too many fields, the template is freed then.
+symbol_t *parse_code_template(char const *code, symbol_t *symbols, code_template_t *tpl);
+
+/// Tones of a field for the given data, e.g. "f0001862d6", returns an allocated list to free().
+tone_t *code_template_field(code_template_t const *tpl, size_t field, char const *data, symbol_t *symbols);
+
+void free_code_template(code_template_t *tpl);
+
 char *parse_code_desc(char const *code);
 
 void free_symbols(symbol_t *symbols);
@@ -75,6 +75,7 @@ struct ctx {
 
     enum sample_format sample_format;
     double full_scale;
+    unsigned align_shift;
     size_t frame_size;
 
     size_t frame_len;
@@ -88,6 +89,12 @@ struct ctx {
     double g_hz;  ///< continuous freq
     uint32_t phi; ///< continuous phase
 
+    uint32_t d_phi;  ///< current tone delta phase
+    double n_att;    ///< current tone attenuation
+    double p_att;    ///< previous tone attenuation
+    size_t tone_pos; ///< current tone sample position
+    size_t tone_end; ///< current tone sample length
+
     double step_out[MAX_STEP_SIZE];
     double step_in[MAX_STEP_SIZE];
     size_t step_len;
@@ -275,6 +282,16 @@ static void signal_out_cs16(ctx_t *ctx, double i, double q)
     ctx->frame_len += 2 * sizeof(int16_t);
 }
 
+static void signal_out_cs16_aligned(ctx_t *ctx, double i, double q)
+{
+    int16_t i16 = bound_s16((int)(i * ctx->full_scale + 32768 + 0.5) - 32768);
+    int16_t q16 = bound_s16((int)(q * ctx->full_scale + 32768 + 0.5) - 32768);
+    // MSB align, e.g. 12-bit as expected by the AD9361
+    ctx->frame.s16[ctx->frame_pos++] = (int16_t)(i16 * (1 << ctx->align_shift));
+    ctx->frame.s16[ctx->frame_pos++] = (int16_t)(q16 * (1 << ctx->align_shift));
+    ctx->frame_len += 2 * sizeof(int16_t);
+}
+
 static void signal_out_cu32(ctx_t *ctx, double i, double q)
 {
     uint32_t i8 = bound_u32((i + 1.0) * ctx->full_scale);
@@ -454,7 +471,7 @@ static inline double apply_filter_q(ctx_t *ctx, double x)
     return y;
 }
 
-static inline void add_sine(ctx_t *ctx, double freq_hz, size_t time_us, int db, int ph)
+static inline void begin_sine(ctx_t *ctx, double freq_hz, size_t time_us, int db, int ph)
 {
     //uint32_t g_phi = nco_d_phase((ssize_t)ctx->g_hz, (size_t)ctx->sample_rate);
     uint32_t d_phi = nco_d_phase((ssize_t)freq_hz, (size_t)ctx->sample_rate);
@@ -474,37 +491,51 @@ static inline void add_sine(ctx_t *ctx, double freq_hz, size_t time_us, int db,
         ctx->phi += 11930465 * (uint32_t)ph; // (0x100000000 / 360)
     }
 
-    double n_att = db_to_mag(db);
-    double g_att = db_to_mag(ctx->g_db);
-    ctx->g_db = db;
-    ctx->g_hz = freq_hz;
+    ctx->d_phi = d_phi;
+    ctx->n_att = db_to_mag(db);
+    ctx->p_att = db_to_mag(ctx->g_db);
+    ctx->g_db  = db;
+    ctx->g_hz  = freq_hz;
 
-    size_t end = (size_t)(time_us * ctx->sample_rate / 1000000.0);
-    for (size_t t = 0; t < end; ++t) {
+    ctx->tone_pos = 0;
+    ctx->tone_end = (size_t)(time_us * ctx->sample_rate / 1000000.0);
+}
 
-        // ramp in and out
-        double att = t < ctx->step_len ? ctx->step_out[t] * g_att + ctx->step_in[t] * n_att : n_att;
+static inline void sine_sample(ctx_t *ctx)
+{
+    size_t t = ctx->tone_pos++;
+
+    // ramp in and out
+    double att = t < ctx->step_len ? ctx->step_out[t] * ctx->p_att + ctx->step_in[t] * ctx->n_att : ctx->n_att;
 
-        // complex I/Q
-        double i = nco_cos(ctx->phi) * ctx->gain * att;
-        double q = nco_sin(ctx->phi) * ctx->gain * att;
-        ctx->phi += d_phi;
-        //ctx->phi += t < ctx->step_len ? ctx->step_out[t] * g_phi + ctx->step_in[t] * d_phi : d_phi;
+    // complex I/Q
+    double i = nco_cos(ctx->phi) * ctx->gain * att;
+    double q = nco_sin(ctx->phi) * ctx->gain * att;
+    ctx->phi += ctx->d_phi;
+    //ctx->phi += t < ctx->step_len ? ctx->step_out[t] * g_phi + ctx->step_in[t] * d_phi : d_phi;
 
-        // disturb
-        i += (randf() - 0.5) * ctx->noise_signal;
-        q += (randf() - 0.5) * ctx->noise_signal;
+    // disturb
+    i += (randf() - 0.5) * ctx->noise_signal;
+    q += (randf() - 0.5) * ctx->noise_signal;
 
-        // band limit
-        i = apply_filter_i(ctx, i);
-        q = apply_filter_q(ctx, q);
+    // band limit
+    i = apply_filter_i(ctx, i);
+    q = apply_filter_q(ctx, q);
 
-        // disturb
-        i += (randf() - 0.5) * ctx->noise_floor;
-        q += (randf() - 0.5) * ctx->noise_floor;
+    // disturb
+    i += (randf() - 0.5) * ctx->noise_floor;
+    q += (randf() - 0.5) * ctx->noise_floor;
 
-        ctx->signal_out(ctx, i, q);
-        signal_out_maybe_flush(ctx);
+    ctx->signal_out(ctx, i, q);
+}
+
+static inline void begin_tone(ctx_t *ctx, tone_t const *tone)
+{
+    if (tone->db < -24) {
+        begin_sine(ctx, ctx->g_hz, (size_t)tone->us, tone->db, tone->ph);
+    }
+    else {
+        begin_sine(ctx, tone->hz, (size_t)tone->us, tone->db, tone->ph);
     }
 }
 
@@ -579,8 +610,11 @@ static void iq_render_init(ctx_t *ctx, iq_render_t *spec)
     ctx->gain          = sine_pk_level(spec->gain);
     ctx->sample_format = spec->sample_format;
     ctx->full_scale    = spec->full_scale;
+    ctx->align_shift   = spec->align_shift;
     ctx->frame_size    = spec->frame_size;
     ctx->signal_out    = format_out[ctx->sample_format];
+    if (ctx->align_shift && ctx->sample_format == FORMAT_CS16)
+        ctx->signal_out = signal_out_cs16_aligned;
 
     ctx->g_db = -40;
     ctx->g_hz = 0;
@@ -597,11 +631,10 @@ static size_t iq_render(ctx_t *ctx, tone_t *tones)
     size_t signal_length_us = 0;
 
     for (tone_t *tone = tones; (tone->us || tone->hz) && !abort_render; ++tone) {
-        if (tone->db < -24) {
-            add_sine(ctx, ctx->g_hz, (size_t)tone->us, tone->db, tone->ph);
-        }
-        else {
-            add_sine(ctx, tone->hz, (size_t)tone->us, tone->db, tone->ph);
+        begin_tone(ctx, tone);
+        while (ctx->tone_pos < ctx->tone_end) {
+            sine_sample(ctx);
+            signal_out_maybe_flush(ctx);
         }
         signal_length_us += (size_t)tone->us;
     }
@@ -682,3 +715,273 @@ int iq_render_buf(iq_render_t *spec, tone_t *tones, void **out_buf, size_t *out_
         *out_len = ctx.frame_size - 1;
     return 0;
 }
+
+// streaming api
+
+struct iq_render_stream {
+    ctx_t ctx;
+    iq_render_t spec;
+    tone_t *tones;
+    tone_t *tone; ///< the tone being rendered, NULL at start
+};
+
+iq_render_stream_t *iq_render_stream_create(iq_render_t *spec, tone_t const *tones)
+{
+    size_t tones_len = 0;
+    while (tones[tones_len].us || tones[tones_len].hz)
+        tones_len++;
+
+    iq_render_stream_t *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        fprintf(stderr, "Failed to allocate render stream.\n");
+        exit(1);
+    }
+    // keep the terminating zero tone
+    stream->tones = malloc((tones_len + 1) * sizeof(tone_t));
+    if (!stream->tones) {
+        fprintf(stderr, "Failed to allocate render stream.\n");
+        exit(1);
+    }
+    memcpy(stream->tones, tones, (tones_len + 1) * sizeof(tone_t));
+
+    stream->spec = *spec;
+    iq_render_stream_reset(stream);
+
+    return stream;
+}
+
+void iq_render_stream_reset(iq_render_stream_t *stream)
+{
+    stream->ctx    = (ctx_t){0};
+    stream->ctx.fd = -1;
+    iq_render_init(&stream->ctx, &stream->spec);
+    stream->tone = NULL;
+}
+
+size_t iq_render_stream_read(iq_render_stream_t *stream, void *buf, size_t n_samps)
+{
+    ctx_t *ctx = &stream->ctx;
+
+    ctx->frame.u8  = buf;
+    ctx->frame_pos = 0;
+    ctx->frame_len = 0;
+
+    size_t n = 0;
+    while (n < n_samps && !abort_render) {
+        if (ctx->tone_pos >= ctx->tone_end) {
+            tone_t *next = stream->tone ? stream->tone + 1 : stream->tones;
+            if (!next->us && !next->hz)
+                break; // end of tones
+            stream->tone = next;
+            begin_tone(ctx, next);
+            continue;
+        }
+        sine_sample(ctx);
+        n++;
+    }
+
+    ctx->frame.u8 = NULL;
+    return n;
+}
+
+void iq_render_stream_free(iq_render_stream_t *stream)
+{
+    if (!stream)
+        return;
+    free(stream->tones);
+    free(stream);
+}
+
+// packet templates
+
+#define TEMPLATE_SETTLE 64 ///< samples rendered at a splice, beyond the ramp, until the filter has settled
+
+/// A fixed part of a template, rendered once.
+typedef struct template_part {
+    tone_t *tones; ///< the tones, terminated
+    float *wave;   ///< CF32 samples as rendered from start
+    size_t len;    ///< samples in wave
+    size_t lead;   ///< samples of leading silent tones, these keep the frequency before them
+    ctx_t start;   ///< state at the start of the cached render
+    ctx_t end;     ///< state at the end of the cached render
+} template_part_t;
+
+struct iq_render_template {
+    iq_render_t spec;
+    size_t fields;
+    template_part_t *parts; ///< fields + 1 parts
+    float *buf;             ///< the last packet
+    size_t buf_cap;         ///< capacity of buf in samples
+};
+
+static size_t tones_length_smp(ctx_t const *ctx, tone_t const *tones)
+{
+    size_t len = 0;
+    for (tone_t const *tone = tones; tone->us || tone->hz; ++tone)
+        len += (size_t)(tone->us * ctx->sample_rate / 1000000.0);
+    return len;
+}
+
+// Render tones from their start into CF32 out, at most limit samples. Returns the samples rendered.
+static size_t render_tones_cf32(ctx_t *ctx, tone_t const *tones, float *out, size_t limit)
+{
+    ctx->frame.f32 = out;
+    ctx->frame_pos = 0;
+    ctx->frame_len = 0;
+
+    size_t n = 0;
+    for (tone_t const *tone = tones; (tone->us || tone->hz) && n < limit; ++tone) {
+        begin_tone(ctx, tone);
+        while (ctx->tone_pos < ctx->tone_end && n < limit) {
+            sine_sample(ctx);
+            n++;
+        }
+    }
+
+    ctx->frame.u8 = NULL;
+    return n;
+}
+
+static inline void rotate(double *i, double *q, double c, double s)
+{
+    double ri = *i * c - *q * s;
+    double rq = *i * s + *q * c;
+    *i = ri;
+    *q = rq;
+}
+
+iq_render_template_t *iq_render_template_create(iq_render_t *spec, tone_t *const *parts, size_t fields)
+{
+    if (spec->sample_format != FORMAT_CF32) {
+        fprintf(stderr, "Templates render to CF32 only.\n");
+        return NULL;
+    }
+
+    iq_render_template_t *tpl = calloc(1, sizeof(*tpl));
+    if (!tpl) {
+        fprintf(stderr, "Failed to allocate render template.\n");
+        return NULL;
+    }
+    tpl->spec   = *spec;
+    tpl->fields = fields;
+    tpl->parts  = calloc(fields + 1, sizeof(*tpl->parts));
+    if (!tpl->parts) {
+        fprintf(stderr, "Failed to allocate render template.\n");
+        free(tpl);
+        return NULL;
+    }
+
+    // render each part as if the fields before it were empty
+    ctx_t ctx = {0};
+    ctx.fd    = -1;
+    iq_render_init(&ctx, &tpl->spec);
+
+    for (size_t k = 0; k <= fields; ++k) {
+        template_part_t *part = &tpl->parts[k];
+
+        size_t tones_len = 0;
+        while (parts[k][tones_len].us || parts[k][tones_len].hz)
+            tones_len++;
+        part->tones = malloc((tones_len + 1) * sizeof(tone_t));
+        part->len   = tones_length_smp(&ctx, parts[k]);
+        part->wave  = malloc((part->len + 1) * 2 * sizeof(float));
+        if (!part->tones || !part->wave) {
+            fprintf(stderr, "Failed to allocate render template.\n");
+            iq_render_template_free(tpl);
+            return NULL;
+        }
+        memcpy(part->tones, parts[k], (tones_len + 1) * sizeof(tone_t));
+
+        for (tone_t const *tone = part->tones; (tone->us || tone->hz) && tone->db < -24; ++tone)
+            part->lead += (size_t)(tone->us * ctx.sample_rate / 1000000.0);
+
+        part->start = ctx;
+        render_tones_cf32(&ctx, part->tones, part->wave, part->len);
+        part->end = ctx;
+    }
+
+    return tpl;
+}
+
+size_t iq_render_template_packet(iq_render_template_t *tpl, tone_t *const *fields, float **out)
+{
+    template_part_t *parts = tpl->parts;
+
+    // the packet length is known up front
+    size_t total = 0;
+    for (size_t k = 0; k <= tpl->fields; ++k) {
+        total += parts[k].len;
+        if (k < tpl->fields)
+            total += tones_length_smp(&parts[0].start, fields[k]);
+    }
+    if (total + 1 > tpl->buf_cap) {
+        float *nb = realloc(tpl->buf, (total + 1) * 2 * sizeof(float));
+        if (!nb) {
+            fprintf(stderr, "Failed to allocate packet of %zu samples.\n", total);
+            return 0;
+        }
+        tpl->buf     = nb;
+        tpl->buf_cap = total + 1;
+    }
+
+    // the first part always starts from the initial state
+    float *buf = tpl->buf;
+    size_t n   = parts[0].len;
+    memcpy(buf, parts[0].wave, n * 2 * sizeof(float));
+    ctx_t ctx = parts[0].end;
+
+    for (size_t k = 1; k <= tpl->fields; ++k) {
+        template_part_t *part = &parts[k];
+
+        n += render_tones_cf32(&ctx, fields[k - 1], &buf[n * 2], total - n);
+
+        // the cached part differs in phase, after silent lead-in tones at the live frequency
+        uint32_t d_live   = nco_d_phase((ssize_t)ctx.g_hz, (size_t)ctx.sample_rate);
+        uint32_t d_cached = nco_d_phase((ssize_t)part->start.g_hz, (size_t)ctx.sample_rate);
+        uint32_t d_phi    = ctx.phi - part->start.phi + (uint32_t)part->lead * (d_live - d_cached);
+        double c          = cos(d_phi * (2.0 * M_PI / 4294967296.0));
+        double s          = sin(d_phi * (2.0 * M_PI / 4294967296.0));
+
+        // render the splice until the ramp and filter settled, then copy the cached rest
+        size_t settle = ctx.step_len + TEMPLATE_SETTLE;
+        if (settle > part->len)
+            settle = part->len;
+        double g_hz = ctx.g_hz;
+        render_tones_cf32(&ctx, part->tones, &buf[n * 2], settle);
+        for (size_t t = settle; t < part->len; ++t) {
+            double i = part->wave[t * 2];
+            double q = part->wave[t * 2 + 1];
+            rotate(&i, &q, c, s);
+            buf[(n + t) * 2]     = (float)i;
+            buf[(n + t) * 2 + 1] = (float)q;
+        }
+        n += part->len;
+
+        // continue from the cached end state, rotated to the live phase
+        ctx = part->end;
+        ctx.phi += d_phi;
+        filter_state_t *f = &ctx.filter_state;
+        for (int j = 0; j < 2; ++j) {
+            rotate(&f->xi[j], &f->xq[j], c, s);
+            rotate(&f->yi[j], &f->yq[j], c, s);
+        }
+        if (part->lead == part->len)
+            ctx.g_hz = g_hz; // all silent, the frequency carries over
+    }
+
+    *out = buf;
+    return n;
+}
+
+void iq_render_template_free(iq_render_template_t *tpl)
+{
+    if (!tpl)
+        return;
+    for (size_t k = 0; tpl->parts && k <= tpl->fields; ++k) {
+        free(tpl->parts[k].tones);
+        free(tpl->parts[k].wave);
+    }
+    free(tpl->parts);
+    free(tpl->buf);
+    free(tpl);
+}
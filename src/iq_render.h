@@ -38,9 +38,13 @@ typedef struct iq_render {
     unsigned step_width; ///< step width in us
     enum sample_format sample_format;
     double full_scale; ///< full scale, useful for CS16/CS32, 0=max
+    unsigned align_shift; ///< MSB align CS16 output, e.g. 4 for 12-bit, 0=off
     size_t frame_size; ///< default will be used if 0
 } iq_render_t;
 
+/// Streaming render state, renders tones incrementally into given buffers.
+typedef struct iq_render_stream iq_render_stream_t;
+
 // parsing a code from string or reading in
 
 extern int abort_render;
@@ -55,4 +59,32 @@ int iq_render_file(char *outpath, iq_render_t *spec, tone_t *tones);
 
 int iq_render_buf(iq_render_t *spec, tone_t *tones, void **out_buf, size_t *out_len);
 
+/// Create a streaming render of tones, the tones are copied.
+iq_render_stream_t *iq_render_stream_create(iq_render_t *spec, tone_t const *tones);
+
+/// Render up to n_samps samples into buf, returns the number of samples, 0 at the end.
+size_t iq_render_stream_read(iq_render_stream_t *stream, void *buf, size_t n_samps);
+
+/// Restart the streaming render at the first tone.
+void iq_render_stream_reset(iq_render_stream_t *stream);
+
+/// Free a streaming render.
+void iq_render_stream_free(iq_render_stream_t *stream);
+
+// packet templates
+
+/// A packet template, the fixed parts are rendered once, the fields per packet.
+typedef struct iq_render_template iq_render_template_t;
+
+/// Create a template of fields + 1 fixed parts of tones, the fields go in between.
+/// The tones are copied, the spec must be for CF32.
+iq_render_template_t *iq_render_template_create(iq_render_t *spec, tone_t *const *parts, size_t fields);
+
+/// Render a packet with the tones of each field, the cached parts are spliced in phase.
+/// Returns the number of samples in @p out, valid until the next packet.
+size_t iq_render_template_packet(iq_render_template_t *tpl, tone_t *const *fields, float **out);
+
+/// Free a packet template.
+void iq_render_template_free(iq_render_template_t *tpl);
+
 #endif /* INCLUDE_IQRENDER_H_ */
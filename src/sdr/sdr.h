@@ -33,6 +33,8 @@ typedef struct sdr_dev {
     char *driver_key;
     char *hardware_key;
     char *hardware_info;
+    void *priv; ///< private backend state
+    double lo_frequency; ///< private, LO frequency of the last transmit, 0 if unknown
 } sdr_dev_t;
 
 typedef struct sdr_ctx {
@@ -53,6 +55,13 @@ typedef union sdr_buffer {
     double *f64;
 } sdr_buffer_t;
 
+/// A dwell on one frequency in a hop list.
+typedef struct sdr_hop {
+    double frequency;     ///< center frequency in Hz
+    double dwell_ms;      ///< time on this frequency in ms
+    char const *gain_str; ///< gain on this frequency, NULL to keep
+} sdr_hop_t;
+
 typedef struct sdr_cmd {
     // device selection
     char const *dev_query;
@@ -60,30 +69,72 @@ typedef struct sdr_cmd {
     char const *gain_str;
     char const *antenna;
     size_t channel;
+    size_t channels_len; ///< number of extra channels streamed along, 0 for none
+    struct sdr_cmd **channels; ///< extra channels, each with channel, gain, antenna, and input set
+    char const *cache_dir; ///< calibration cache directory, NULL for default, "" to disable
+    char const *iq_cal_file; ///< IQ imbalance and DC offset corrections by device, channel, and frequency, NULL for none
     // rf setup
     double ppm_error;
     double center_frequency;
+    double freq_offset; ///< digital frequency offset in Hz, mixed in software
+    double hop_span;    ///< frequency-agile: keep the LO while targets are within this span in Hz, 0 to always tune
     double sample_rate;
     double bandwidth;
     double master_clock_rate;
     char const *output_format; ///< force output format if set
     size_t block_size;         ///< force output block size if set
+    size_t fifo_size;          ///< device FIFO size in samples, 0 for default
+    int latency_mode;          ///< 0 balanced, 1 low latency, 2 throughput
     // transmit control
-    unsigned initial_delay;
+    unsigned initial_delay; ///< delay of the first sample in ms, 0 for untimed
+    char const *time_source; ///< set the device time to 0 on this event (e.g. "PPS") before a timed start, NULL for none
+    int rt_priority;          ///< real-time priority of the device thread (1-99), also locks memory, 0 for none
+    int rt_round_robin;       ///< use SCHED_RR instead of SCHED_FIFO
+    char const *cpu_affinity; ///< pin threads by role, e.g. "device=2,status=3,render=0-1", NULL for none
     unsigned repeats;
     unsigned repeat_delay;
     unsigned loops;
     unsigned loop_delay;
+    size_t hops_len; ///< number of hops, 0 for a fixed frequency
+    struct sdr_hop const *hops; ///< frequency hops, cycled until the input ends
+    struct sdr_hop const *retune; ///< retune before the next read, e.g. set by read_cb between jobs, cleared once done
     // input from file descriptor
     char const *input_format;
     int stream_fd;
     size_t samples_to_write;
+    unsigned elastic_ms; ///< keep this much input latency in ms and track the input clock, 0 for none
+    double input_rate;   ///< sample rate of the input, resampled to sample_rate, 0 if the same
     // input from buffer
     void *stream_buffer;
     size_t buffer_offset;
     size_t buffer_size;
+    // input from shared memory
+    void *shm; ///< tx_shm_t ring to read from in place, if set, see tx_shm.h
+    // input from renderer
+    void *render_stream; ///< iq_render_stream_t to render from, if set
+    // input from callback
+    ssize_t (*read_cb)(void *read_ctx, void *buf, size_t n_samps); ///< read n_samps in input_format, returns samples, 0 at end, -1 to retry
+    void *read_ctx; ///< context for read_cb
+    int read_native; ///< read_cb gives samples in output_format at the device full scale, no conversion
+    // shared start
+    void (*start_cb)(void *start_ctx); ///< called when ready to stream, e.g. to wait for other devices
+    void *start_ctx; ///< context for start_cb
+    // transmit statistics
+    size_t samples_written; ///< samples accepted by the device
+    unsigned underflows;    ///< underflows reported by the device
+    unsigned late_packets;  ///< late packets (time errors) reported by the device
+    unsigned deadline_misses; ///< input blocks that took longer to read than to transmit
+    double drift_ppm;         ///< input clock against the device clock, measured by the elastic buffer
     // private
     double fullScale;
+    unsigned sample_shift; ///< private, MSB alignment of device samples
+    double nco_phase; ///< private, phase of the frequency offset mixer in cycles
+    size_t hop_index; ///< private, the current hop
+    size_t hop_left;  ///< private, samples left in the current dwell
+    double worst_load; ///< private, worst ratio of input time to airtime of a block
+    void *elastic;     ///< private, elastic buffer state
+    void *resampler;   ///< private, sample rate converter state
+    void *iq_cal;      ///< private, IQ correction table and current coefficients
     int flag_abort; ///< private
     sdr_buffer_t conv_buf;
 } sdr_cmd_t;
@@ -125,4 +176,17 @@ int sdr_tx(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx);
 /// Free transmit data.
 int sdr_tx_free(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx);
 
+/// Pin the calling thread to the CPUs set for a role ("device", "status", or "render") in cpu_affinity.
+int sdr_thread_pin(sdr_cmd_t const *tx, char const *role);
+
+/// Lock all current and future memory, counted, the last sdr_mem_unlock() unlocks.
+/// Returns 0 if the lock is held, -1 on error.
+int sdr_mem_lock(void);
+
+/// Release a memory lock from sdr_mem_lock().
+void sdr_mem_unlock(void);
+
+/// Convert samples in an input format to normalized CF32, -1 if the format is not supported.
+int sdr_format_to_cf32(char const *format, void const *in, float *out, size_t n_samps);
+
 #endif /* INCLUDE_SDR_H_ */
@@ -17,18 +17,48 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE // for CPU affinity
+#endif
+
 #include "sdr_backend.h"
+#include "../iq_render.h"
+#include "../tx_shm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 #define DEFAULT_BUF_LENGTH (1 * 16384)
 #define MINIMAL_BUF_LENGTH 512
 #define MAXIMAL_BUF_LENGTH (256 * 16384)
+#define MIX_CHUNK 64 ///< samples per mixer phasor update
+#define RT_STACK_PREFAULT (256 * 1024) ///< stack to fault in for a real-time device thread
+#define SRC_TAPS 48 ///< resampler taps per phase, more when decimating
+#define SRC_MAX_PHASES 4096 ///< resampler interpolation limit, the rates need a simple ratio
+#define SRC_LANES 8 ///< resampler partial sums, taps are a multiple of this to vectorize
+#define ELASTIC_KP 0.05 ///< elastic buffer servo, rate correction per second of latency error
+#define ELASTIC_KI (ELASTIC_KP * ELASTIC_KP / 4) ///< elastic buffer servo, critically damped
+#define ELASTIC_MAX_DRIFT 1e-3 ///< elastic buffer servo, rate correction limit
+#define ELASTIC_WAIT_MS 100 ///< elastic buffer, longest wait for input before a retry
+#define ELASTIC_SETTLE_S 1.0 ///< elastic buffer, time for the device FIFO to fill before the servo starts
+#define SHM_WAIT_MS 100 ///< shared memory input, longest wait for samples before a retry
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 // format is 3-4 chars (plus null), compare as int.
 static int is_format_equal(const void *a, const void *b)
@@ -50,9 +80,9 @@ char const *sdr_ctx_available_backends(void)
            "Lime "
 #endif
 #ifdef HAS_SOAPY
-           "SoapySDR"
+           "SoapySDR "
 #endif
-            ;
+           "null file";
 }
 
 int sdr_ctx_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args)
@@ -62,11 +92,9 @@ int sdr_ctx_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args)
 
     int ret = -1;
 
-    if (!sdr_ctx->devs) {
-        // TODO: use a dynamic list
-        sdr_ctx->devs = calloc(64, sizeof(sdr_dev_t));
+    if (!strncmp(enum_args, "null:", 5) || !strncmp(enum_args, "file:", 5)) {
+        return null_enum_devices(sdr_ctx, enum_args);
     }
-
 #ifdef HAS_IIO
     if (!strncmp(enum_args, "pluto:", 6)) {
         return pluto_enum_devices(sdr_ctx, enum_args);
@@ -84,6 +112,19 @@ int sdr_ctx_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args)
     return ret;
 }
 
+sdr_dev_t *sdr_ctx_add_device(sdr_ctx_t *sdr_ctx)
+{
+    sdr_dev_t *devs = realloc(sdr_ctx->devs, (sdr_ctx->devs_len + 1) * sizeof(sdr_dev_t));
+    if (!devs) {
+        fprintf(stderr, "realloc() failed\n");
+        return NULL;
+    }
+    sdr_ctx->devs      = devs;
+    sdr_dev_t *sdr_dev = &devs[sdr_ctx->devs_len++];
+    memset(sdr_dev, 0, sizeof(sdr_dev_t));
+    return sdr_dev;
+}
+
 int sdr_ctx_release_devices(sdr_ctx_t *sdr_ctx)
 {
     if (!sdr_ctx) return -1;
@@ -110,7 +151,8 @@ int sdr_ctx_free_devices(sdr_ctx_t *sdr_ctx)
     }
 
     free(sdr_ctx->devs);
-    sdr_ctx->devs = NULL;
+    sdr_ctx->devs     = NULL;
+    sdr_ctx->devs_len = 0;
 
     return ret;
 }
@@ -122,6 +164,9 @@ int sdr_dev_free(sdr_dev_t *sdr_dev)
 
     int ret = -1;
 
+    if (!strcmp(sdr_dev->backend, "null")) {
+        return null_free_device(sdr_dev);
+    }
 #ifdef HAS_IIO
     if (!strcmp(sdr_dev->backend, "pluto")) {
         return pluto_free_device(sdr_dev);
@@ -148,6 +193,9 @@ int sdr_dev_release(sdr_dev_t *sdr_dev)
 
     int ret = -1;
 
+    if (!strcmp(sdr_dev->backend, "null")) {
+        return null_release_device(sdr_dev);
+    }
 #ifdef HAS_IIO
     if (!strcmp(sdr_dev->backend, "pluto")) {
         return pluto_release_device(sdr_dev);
@@ -174,6 +222,9 @@ int sdr_dev_acquire(sdr_dev_t *sdr_dev)
 
     int ret = -1;
 
+    if (!strcmp(sdr_dev->backend, "null")) {
+        return null_acquire_device(sdr_dev);
+    }
 #ifdef HAS_IIO
     if (!strcmp(sdr_dev->backend, "pluto")) {
         return pluto_acquire_device(sdr_dev);
@@ -228,6 +279,9 @@ int sdr_tx_setup(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
 
     int ret = -1;
 
+    if (!strcmp(sdr_dev->backend, "null")) {
+        return null_transmit_setup(sdr_ctx, sdr_dev, tx);
+    }
 #ifdef HAS_IIO
     if (!strcmp(sdr_dev->backend, "pluto")) {
         return pluto_transmit_setup(sdr_ctx, sdr_dev, tx);
@@ -245,6 +299,194 @@ int sdr_tx_setup(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
     return ret;
 }
 
+// real-time setup
+
+// Find the CPU range for a role in a spec like "device=2,status=3,render=0-1".
+static int cpu_range_for(char const *spec, char const *role, int *lo, int *hi)
+{
+    size_t role_len = strlen(role);
+    while (spec && *spec) {
+        if (!strncmp(spec, role, role_len) && spec[role_len] == '=') {
+            char *end;
+            *lo = (int)strtol(&spec[role_len + 1], &end, 10);
+            *hi = *end == '-' ? (int)strtol(end + 1, NULL, 10) : *lo;
+            return *lo >= 0 && *hi >= *lo;
+        }
+        spec = strchr(spec, ',');
+        if (spec) {
+            spec++;
+        }
+    }
+    return 0;
+}
+
+int sdr_thread_pin(sdr_cmd_t const *tx, char const *role)
+{
+    int lo, hi;
+    if (!tx->cpu_affinity || !cpu_range_for(tx->cpu_affinity, role, &lo, &hi)) {
+        return 0;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++cpu) {
+        CPU_SET(cpu, &set);
+    }
+    int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (r) {
+        fprintf(stderr, "WARNING: Failed to pin the %s thread to CPU %d-%d (%s)\n", role, lo, hi, strerror(r));
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "WARNING: CPU pinning is not supported here\n");
+    return -1;
+#endif
+}
+
+/// Scheduling of the device thread before transmit, to restore after.
+typedef struct rt_saved {
+    int changed;
+    int locked;
+#ifndef _WIN32
+    int policy;
+    struct sched_param param;
+#endif
+#ifdef __linux__
+    int pinned;
+    cpu_set_t affinity;
+#endif
+} rt_saved_t;
+
+// Memory locking is process wide, the last real-time device thread to leave unlocks.
+static pthread_mutex_t mem_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned mem_lock_users;
+
+int sdr_mem_lock(void)
+{
+#ifndef _WIN32
+    int ret = 0;
+    pthread_mutex_lock(&mem_lock_mutex);
+    if (!mem_lock_users && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        fprintf(stderr, "WARNING: Failed to lock memory (%s)\n", strerror(errno));
+        ret = -1;
+    }
+    else {
+        mem_lock_users++;
+    }
+    pthread_mutex_unlock(&mem_lock_mutex);
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+void sdr_mem_unlock(void)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&mem_lock_mutex);
+    if (mem_lock_users && !--mem_lock_users) {
+        munlockall();
+    }
+    pthread_mutex_unlock(&mem_lock_mutex);
+#endif
+}
+
+static void prefault_stack(void)
+{
+    volatile unsigned char stack[RT_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+// Pin the device thread, raise it to real-time priority, and hold the memory lock (current and future buffers).
+static void rt_enter(sdr_cmd_t *tx, rt_saved_t *saved)
+{
+    *saved = (rt_saved_t){0};
+#ifdef __linux__
+    saved->pinned = tx->cpu_affinity && !pthread_getaffinity_np(pthread_self(), sizeof(saved->affinity), &saved->affinity);
+#endif
+    sdr_thread_pin(tx, "device");
+    if (tx->rt_priority <= 0) {
+        return;
+    }
+#ifndef _WIN32
+    pthread_getschedparam(pthread_self(), &saved->policy, &saved->param);
+    struct sched_param param = {.sched_priority = tx->rt_priority};
+    int policy               = tx->rt_round_robin ? SCHED_RR : SCHED_FIFO;
+    int r                    = pthread_setschedparam(pthread_self(), policy, &param);
+    if (r) {
+        fprintf(stderr, "WARNING: Failed to set real-time priority %d (%s)\n", tx->rt_priority, strerror(r));
+    }
+    else {
+        saved->changed = 1;
+        fprintf(stderr, "Device thread at %s priority %d\n", tx->rt_round_robin ? "SCHED_RR" : "SCHED_FIFO", tx->rt_priority);
+    }
+    saved->locked = !sdr_mem_lock();
+    prefault_stack();
+#else
+    fprintf(stderr, "WARNING: Real-time priority is not supported here\n");
+#endif
+}
+
+static void rt_leave(rt_saved_t *saved)
+{
+#ifndef _WIN32
+    if (saved->changed) {
+        pthread_setschedparam(pthread_self(), saved->policy, &saved->param);
+    }
+    if (saved->locked) {
+        sdr_mem_unlock();
+    }
+#endif
+#ifdef __linux__
+    if (saved->pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(saved->affinity), &saved->affinity);
+    }
+#endif
+}
+
+static double elapsed_since(struct timespec const *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static size_t hop_samples(sdr_cmd_t *tx, sdr_hop_t const *hop)
+{
+    size_t n = (size_t)(hop->dwell_ms * tx->sample_rate / 1000.0 + 0.5);
+    return n ? n : 1;
+}
+
+static void iq_cal_tune(sdr_cmd_t *tx, double frequency);
+
+sdr_hop_t const *sdr_hop_next(sdr_cmd_t *tx)
+{
+    if (tx->retune) {
+        sdr_hop_t const *hop = tx->retune;
+        tx->retune           = NULL;
+        iq_cal_tune(tx, hop->frequency);
+        return hop;
+    }
+    if (!tx->hops_len || tx->hop_left) {
+        return NULL;
+    }
+    tx->hop_index        = (tx->hop_index + 1) % tx->hops_len;
+    sdr_hop_t const *hop = &tx->hops[tx->hop_index];
+    tx->hop_left         = hop_samples(tx, hop);
+    iq_cal_tune(tx, hop->frequency);
+    return hop;
+}
+
+static int elastic_start(sdr_cmd_t *tx);
+static void elastic_stop(sdr_cmd_t *tx);
+static int resampler_start(sdr_cmd_t *tx);
+static void resampler_stop(sdr_cmd_t *tx);
+static int iq_cal_start(sdr_dev_t *sdr_dev, sdr_cmd_t *tx);
+static void iq_cal_stop(sdr_cmd_t *tx);
+
 int sdr_tx(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
 {
     if (!sdr_ctx) return -1;
@@ -254,20 +496,82 @@ int sdr_tx(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
 
     int ret = -1;
 
+    double target        = tx->center_frequency;
+    double offset        = tx->freq_offset;
+    char const *gain_str = tx->gain_str;
+
+    // a hop list starts on its first hop
+    if (tx->hops_len) {
+        tx->center_frequency = tx->hops[0].frequency;
+        if (tx->hops[0].gain_str) {
+            tx->gain_str = tx->hops[0].gain_str;
+        }
+        tx->hop_index = 0;
+        tx->hop_left  = hop_samples(tx, &tx->hops[0]);
+        fprintf(stderr, "Hopping over %zu frequencies\n", tx->hops_len);
+    }
+
+    // frequency-agile: keep the LO if the target is within the span, mix the difference in software
+    if (tx->hop_span > 0.0 && sdr_dev->lo_frequency > 0.0) {
+        double span  = tx->hop_span < tx->sample_rate ? tx->hop_span : tx->sample_rate;
+        double delta = tx->center_frequency + offset - sdr_dev->lo_frequency;
+        if (fabs(delta) <= span / 2) {
+            tx->center_frequency = sdr_dev->lo_frequency;
+            tx->freq_offset      = delta;
+            fprintf(stderr, "Keeping the LO at %.0f Hz, mixing %+.0f Hz\n", tx->center_frequency, delta);
+        }
+    }
+    tx->nco_phase       = 0.0;
+    tx->deadline_misses = 0;
+    tx->worst_load      = 0.0;
+    tx->drift_ppm       = 0.0;
+
+    if ((tx->elastic_ms && elastic_start(tx)) || resampler_start(tx) || iq_cal_start(sdr_dev, tx)) {
+        elastic_stop(tx);
+        resampler_stop(tx);
+        iq_cal_stop(tx);
+        tx->center_frequency = target;
+        tx->freq_offset      = offset;
+        tx->gain_str         = gain_str;
+        return -1;
+    }
+
+    rt_saved_t rt_saved;
+    rt_enter(tx, &rt_saved);
+
+    if (!strcmp(sdr_dev->backend, "null")) {
+        ret = null_transmit(sdr_ctx, sdr_dev, tx);
+    }
 #ifdef HAS_IIO
-    if (!strcmp(sdr_dev->backend, "pluto")) {
-        return pluto_transmit(sdr_ctx, sdr_dev, tx);
+    else if (!strcmp(sdr_dev->backend, "pluto")) {
+        ret = pluto_transmit(sdr_ctx, sdr_dev, tx);
     }
 #endif
 #ifdef HAS_LIME
-    if (!strcmp(sdr_dev->backend, "lime")) {
-        return lime_transmit(sdr_ctx, sdr_dev, tx);
+    else if (!strcmp(sdr_dev->backend, "lime")) {
+        ret = lime_transmit(sdr_ctx, sdr_dev, tx);
     }
 #endif
 #ifdef HAS_SOAPY
-    ret = soapy_transmit(sdr_ctx, sdr_dev, tx);
+    else {
+        ret = soapy_transmit(sdr_ctx, sdr_dev, tx);
+    }
 #endif
 
+    rt_leave(&rt_saved);
+    elastic_stop(tx);
+    resampler_stop(tx);
+    iq_cal_stop(tx);
+    if (tx->deadline_misses || tx->rt_priority || tx->cpu_affinity) {
+        fprintf(stderr, "%u deadline misses, the slowest input block took %.0f%% of its airtime\n",
+                tx->deadline_misses, tx->worst_load * 100.0);
+    }
+
+    sdr_dev->lo_frequency = tx->hop_span > 0.0 && !tx->hops_len ? tx->center_frequency : 0.0;
+    tx->center_frequency  = target;
+    tx->freq_offset       = offset;
+    tx->gain_str          = gain_str;
+
     return ret;
 }
 
@@ -279,6 +583,9 @@ int sdr_tx_free(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
 
     int ret = -1;
 
+    if (!strcmp(sdr_dev->backend, "null")) {
+        return null_transmit_done(tx);
+    }
 #ifdef HAS_IIO
     if (!strcmp(sdr_dev->backend, "pluto")) {
         return pluto_transmit_done(tx);
@@ -302,11 +609,1199 @@ int sdr_tx_free(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
     //free(tx->input_format);
 }
 
+// sample conversion
+
+/// Formats supported by the conversion matrix.
+enum conv_format {
+    CONV_CU8,
+    CONV_CS8,
+    CONV_CS12,
+    CONV_CS16,
+    CONV_CF32,
+};
+
+static size_t const conv_sample_size[] = {
+        2 * sizeof(uint8_t),
+        2 * sizeof(int8_t),
+        3 * sizeof(uint8_t),
+        2 * sizeof(int16_t),
+        2 * sizeof(float),
+};
+
+static double const conv_full_scale[] = {
+        128.0,
+        128.0,
+        2048.0,
+        32768.0,
+        1.0,
+};
+
+static int conv_format(char const *format)
+{
+    if (!format)
+        return -1;
+    else if (is_format_equal(format, "CU8"))
+        return CONV_CU8;
+    else if (is_format_equal(format, "CS8"))
+        return CONV_CS8;
+    else if (is_format_equal(format, "CS12"))
+        return CONV_CS12;
+    else if (is_format_equal(format, "CS16"))
+        return CONV_CS16;
+    else if (is_format_equal(format, "CF32"))
+        return CONV_CF32;
+    return -1;
+}
+
+// load a sample normalized to [-1.0, 1.0]
+
+static inline void load_cu8(void const *in, size_t k, float *i, float *q)
+{
+    uint8_t const *u8 = in;
+    *i = (u8[2 * k] - 127.4f) / 128.0f;
+    *q = (u8[2 * k + 1] - 127.4f) / 128.0f;
+}
+
+static inline void load_cs8(void const *in, size_t k, float *i, float *q)
+{
+    int8_t const *s8 = in;
+    *i = (s8[2 * k] + 0.4f) / 128.0f;
+    *q = (s8[2 * k + 1] + 0.4f) / 128.0f;
+}
+
+static inline void load_cs12(void const *in, size_t k, float *i, float *q)
+{
+    uint8_t const *u8 = in;
+    // note: byte0 = i[7:0]; byte1 = {q[3:0], i[11:8]}; byte2 = q[11:4];
+    int16_t i16 = (int16_t)((u8[3 * k + 1] & 0x0f) << 12 | u8[3 * k] << 4);
+    int16_t q16 = (int16_t)(u8[3 * k + 2] << 8 | (u8[3 * k + 1] & 0xf0));
+    *i = i16 / 32768.0f;
+    *q = q16 / 32768.0f;
+}
+
+static inline void load_cs16(void const *in, size_t k, float *i, float *q)
+{
+    int16_t const *s16 = in;
+    *i = s16[2 * k] / 32768.0f;
+    *q = s16[2 * k + 1] / 32768.0f;
+}
+
+static inline void load_cf32(void const *in, size_t k, float *i, float *q)
+{
+    float const *f32 = in;
+    *i = f32[2 * k];
+    *q = f32[2 * k + 1];
+}
+
+// store a normalized sample to the given full scale
+
+static inline float clamp_f(float x, float lo, float hi)
+{
+    return x < lo ? lo : x > hi ? hi : x;
+}
+
+static inline void store_cu8(void *out, size_t k, float i, float q, float scale)
+{
+    uint8_t *u8    = out;
+    u8[2 * k]     = (uint8_t)clamp_f(i * scale + 127.5f, 0.0f, 255.0f);
+    u8[2 * k + 1] = (uint8_t)clamp_f(q * scale + 127.5f, 0.0f, 255.0f);
+}
+
+static inline void store_cs8(void *out, size_t k, float i, float q, float scale)
+{
+    int8_t *s8    = out;
+    s8[2 * k]     = (int8_t)clamp_f(i * scale, -128.0f, 127.0f);
+    s8[2 * k + 1] = (int8_t)clamp_f(q * scale, -128.0f, 127.0f);
+}
+
+static inline void store_cs12(void *out, size_t k, float i, float q, float scale)
+{
+    uint8_t *u8 = out;
+    int16_t i12 = (int16_t)clamp_f(i * scale, -2048.0f, 2047.0f);
+    int16_t q12 = (int16_t)clamp_f(q * scale, -2048.0f, 2047.0f);
+    // note: byte0 = i[7:0]; byte1 = {q[3:0], i[11:8]}; byte2 = q[11:4];
+    u8[3 * k]     = (uint8_t)(i12);
+    u8[3 * k + 1] = (uint8_t)(((uint16_t)q12 << 4) | (((uint16_t)i12 >> 8) & 0x0f));
+    u8[3 * k + 2] = (uint8_t)((uint16_t)q12 >> 4);
+}
+
+static inline void store_cs16(void *out, size_t k, float i, float q, float scale)
+{
+    int16_t *s16   = out;
+    s16[2 * k]     = (int16_t)clamp_f(i * scale, -32768.0f, 32767.0f);
+    s16[2 * k + 1] = (int16_t)clamp_f(q * scale, -32768.0f, 32767.0f);
+}
+
+static inline void store_cf32(void *out, size_t k, float i, float q, float scale)
+{
+    float *f32     = out;
+    f32[2 * k]     = i * scale;
+    f32[2 * k + 1] = q * scale;
+}
+
+// IQ pre-correction in normalized units: i' = i + dc_i, q' = cross * i + gain * q + dc_q
+typedef struct iq_corr {
+    float dc_i;
+    float dc_q;
+    float gain;  ///< Q gain times cos(phase)
+    float cross; ///< Q gain times sin(phase)
+} iq_corr_t;
+
+static iq_corr_t const iq_corr_none = {0.0f, 0.0f, 1.0f, 0.0f};
+
+static inline void iq_correct(iq_corr_t const *c, float *i, float *q)
+{
+    float ci = *i + c->dc_i;
+    *q       = c->cross * *i + c->gain * *q + c->dc_q;
+    *i       = ci;
+}
+
+// each sample is loaded before it is stored, thus same-format conversions work in place
+#define CONV_FN(IN, OUT) \
+    static void conv_##IN##_##OUT(void const *in, void *out, size_t n_samps, float scale) \
+    { \
+        for (size_t k = 0; k < n_samps; ++k) { \
+            float i, q; \
+            load_##IN(in, k, &i, &q); \
+            store_##OUT(out, k, i, q, scale); \
+        } \
+    }
+
+#define CONV_ROW(IN) \
+    CONV_FN(IN, cu8) \
+    CONV_FN(IN, cs8) \
+    CONV_FN(IN, cs12) \
+    CONV_FN(IN, cs16) \
+    CONV_FN(IN, cf32)
+
+CONV_ROW(cu8)
+CONV_ROW(cs8)
+CONV_ROW(cs12)
+CONV_ROW(cs16)
+CONV_ROW(cf32)
+
+// conversion with the IQ correction fused in, no extra pass over the data
+#define CONV_IQ_FN(IN, OUT) \
+    static void conv_iq_##IN##_##OUT(void const *in, void *out, size_t n_samps, float scale, iq_corr_t const *c) \
+    { \
+        iq_corr_t const corr = *c; \
+        for (size_t k = 0; k < n_samps; ++k) { \
+            float i, q; \
+            load_##IN(in, k, &i, &q); \
+            iq_correct(&corr, &i, &q); \
+            store_##OUT(out, k, i, q, scale); \
+        } \
+    }
+
+#define CONV_IQ_ROW(IN) \
+    CONV_IQ_FN(IN, cu8) \
+    CONV_IQ_FN(IN, cs8) \
+    CONV_IQ_FN(IN, cs12) \
+    CONV_IQ_FN(IN, cs16) \
+    CONV_IQ_FN(IN, cf32)
+
+CONV_IQ_ROW(cu8)
+CONV_IQ_ROW(cs8)
+CONV_IQ_ROW(cs12)
+CONV_IQ_ROW(cs16)
+CONV_IQ_ROW(cf32)
+
+// mix in place with a complex oscillator, phase is in cycles and carries over between calls;
+// the phasor steps once per chunk so the inner loop has no dependency between samples
+#define MIX_FN(FMT) \
+    static void mix_##FMT(void *buf, size_t n_samps, float scale, double *phase, double step, iq_corr_t const *c) \
+    { \
+        iq_corr_t const corr = *c; \
+        float rot_i[MIX_CHUNK], rot_q[MIX_CHUNK]; \
+        for (size_t k = 0; k < MIX_CHUNK; ++k) { \
+            rot_i[k] = (float)cos(2.0 * M_PI * step * k); \
+            rot_q[k] = (float)sin(2.0 * M_PI * step * k); \
+        } \
+        for (size_t base = 0; base < n_samps; base += MIX_CHUNK) { \
+            size_t len = n_samps - base < MIX_CHUNK ? n_samps - base : MIX_CHUNK; \
+            float ci   = (float)cos(2.0 * M_PI * *phase); \
+            float cq   = (float)sin(2.0 * M_PI * *phase); \
+            for (size_t k = 0; k < len; ++k) { \
+                float ri = ci * rot_i[k] - cq * rot_q[k]; \
+                float rq = ci * rot_q[k] + cq * rot_i[k]; \
+                float i, q; \
+                load_##FMT(buf, base + k, &i, &q); \
+                float mi = i * ri - q * rq; \
+                float mq = i * rq + q * ri; \
+                iq_correct(&corr, &mi, &mq); \
+                store_##FMT(buf, base + k, mi, mq, scale); \
+            } \
+            *phase += step * len; \
+            *phase -= floor(*phase); \
+        } \
+    }
+
+MIX_FN(cu8)
+MIX_FN(cs8)
+MIX_FN(cs12)
+MIX_FN(cs16)
+MIX_FN(cf32)
+
+typedef void (*mix_fn)(void *buf, size_t n_samps, float scale, double *phase, double step, iq_corr_t const *c);
+
+static mix_fn const mix_funcs[] = {mix_cu8, mix_cs8, mix_cs12, mix_cs16, mix_cf32};
+
+typedef void (*conv_fn)(void const *in, void *out, size_t n_samps, float scale);
+
+/// Conversion matrix, input format by output format.
+static conv_fn const conv_matrix[][5] = {
+        {conv_cu8_cu8, conv_cu8_cs8, conv_cu8_cs12, conv_cu8_cs16, conv_cu8_cf32},
+        {conv_cs8_cu8, conv_cs8_cs8, conv_cs8_cs12, conv_cs8_cs16, conv_cs8_cf32},
+        {conv_cs12_cu8, conv_cs12_cs8, conv_cs12_cs12, conv_cs12_cs16, conv_cs12_cf32},
+        {conv_cs16_cu8, conv_cs16_cs8, conv_cs16_cs12, conv_cs16_cs16, conv_cs16_cf32},
+        {conv_cf32_cu8, conv_cf32_cs8, conv_cf32_cs12, conv_cf32_cs16, conv_cf32_cf32},
+};
+
+typedef void (*conv_iq_fn)(void const *in, void *out, size_t n_samps, float scale, iq_corr_t const *c);
+
+/// Conversion matrix with IQ correction, input format by output format.
+static conv_iq_fn const conv_iq_matrix[][5] = {
+        {conv_iq_cu8_cu8, conv_iq_cu8_cs8, conv_iq_cu8_cs12, conv_iq_cu8_cs16, conv_iq_cu8_cf32},
+        {conv_iq_cs8_cu8, conv_iq_cs8_cs8, conv_iq_cs8_cs12, conv_iq_cs8_cs16, conv_iq_cs8_cf32},
+        {conv_iq_cs12_cu8, conv_iq_cs12_cs8, conv_iq_cs12_cs12, conv_iq_cs12_cs16, conv_iq_cs12_cf32},
+        {conv_iq_cs16_cu8, conv_iq_cs16_cs8, conv_iq_cs16_cs12, conv_iq_cs16_cs16, conv_iq_cs16_cf32},
+        {conv_iq_cf32_cu8, conv_iq_cf32_cs8, conv_iq_cf32_cs12, conv_iq_cf32_cs16, conv_iq_cf32_cf32},
+};
+
+int sdr_format_bits(char const *format, double fullScale)
+{
+    int fmt = conv_format(format);
+    if (fmt == CONV_CF32)
+        return 24; // float mantissa
+    if (fmt < 0 || fullScale <= 1.0)
+        return 16; // unknown, assume the common maximum
+    int bits = 1;
+    while ((double)(1 << (bits - 1)) < fullScale)
+        bits++;
+    return bits;
+}
+
+size_t sdr_format_sample_size(char const *format)
+{
+    int fmt = conv_format(format);
+    if (fmt < 0)
+        return 0;
+    return conv_sample_size[fmt];
+}
+
+double sdr_format_full_scale(char const *format)
+{
+    int fmt = conv_format(format);
+    if (fmt < 0)
+        return 0.0;
+    return conv_full_scale[fmt];
+}
+
+int sdr_format_to_cf32(char const *format, void const *in, float *out, size_t n_samps)
+{
+    int fmt = conv_format(format);
+    if (fmt < 0)
+        return -1;
+    conv_matrix[fmt][CONV_CF32](in, out, n_samps, 1.0f);
+    return 0;
+}
+
+// IQ correction
+
+/*
+    An IQ calibration file has one line per device, channel, and frequency:
+        # device channel frequency dc_i dc_q gain phase_deg
+        lime 0 433.92M 0.0012 -0.0008 1.004 0.8
+    The device matches the hardware or driver key, "*" matches any device.
+    DC offsets are in units of full scale, gain and phase (in degrees)
+    apply to Q. Between frequencies the coefficients are interpolated.
+*/
+
+typedef struct iq_cal_point {
+    double frequency;
+    double dc_i;
+    double dc_q;
+    double gain;
+    double phase; ///< in degrees
+} iq_cal_point_t;
+
+typedef struct sdr_iq_cal {
+    size_t len;
+    iq_cal_point_t *points; ///< sorted by frequency
+    iq_corr_t corr;         ///< at the current frequency
+} sdr_iq_cal_t;
+
+// Parse a frequency with an optional k, M, or G suffix.
+static int parse_frequency(char const *str, double *freq)
+{
+    char *end;
+    *freq = strtod(str, &end);
+    if (end == str) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        *freq *= 1e3;
+        end++;
+    }
+    else if (*end == 'M') {
+        *freq *= 1e6;
+        end++;
+    }
+    else if (*end == 'G') {
+        *freq *= 1e9;
+        end++;
+    }
+    return *end ? -1 : 0;
+}
+
+static int cmp_cal_point(void const *a, void const *b)
+{
+    double fa = ((iq_cal_point_t const *)a)->frequency;
+    double fb = ((iq_cal_point_t const *)b)->frequency;
+    return (fa > fb) - (fa < fb);
+}
+
+// Set the correction for a frequency, interpolated between the nearest points.
+static void iq_cal_tune(sdr_cmd_t *tx, double frequency)
+{
+    sdr_iq_cal_t *cal = tx->iq_cal;
+    if (!cal) {
+        return;
+    }
+    iq_cal_point_t const *lo = &cal->points[0];
+    iq_cal_point_t const *hi = &cal->points[cal->len - 1];
+    for (size_t k = 1; k < cal->len; ++k) {
+        if (cal->points[k].frequency >= frequency) {
+            lo = &cal->points[k - 1];
+            hi = &cal->points[k];
+            break;
+        }
+    }
+    double t = 0.0;
+    if (hi->frequency > lo->frequency) {
+        t = (frequency - lo->frequency) / (hi->frequency - lo->frequency);
+        t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+    }
+    else if (frequency > lo->frequency) {
+        lo = hi;
+    }
+    double phase = (lo->phase + t * (hi->phase - lo->phase)) * M_PI / 180.0;
+    double gain  = lo->gain + t * (hi->gain - lo->gain);
+
+    cal->corr.dc_i  = (float)(lo->dc_i + t * (hi->dc_i - lo->dc_i));
+    cal->corr.dc_q  = (float)(lo->dc_q + t * (hi->dc_q - lo->dc_q));
+    cal->corr.gain  = (float)(gain * cos(phase));
+    cal->corr.cross = (float)(gain * sin(phase));
+}
+
+// Load the points for this device and channel, none is not an error.
+static int iq_cal_load(sdr_dev_t *sdr_dev, sdr_cmd_t *tx, char const *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open IQ calibration %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    sdr_iq_cal_t *cal = calloc(1, sizeof(*cal));
+    if (!cal) {
+        fprintf(stderr, "calloc() failed\n");
+        fclose(fp);
+        return -1;
+    }
+    size_t cap = 0;
+    char line[256];
+    unsigned line_no = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char dev[64], freq[32];
+        unsigned long channel;
+        iq_cal_point_t pt;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%63s %lu %31s %lf %lf %lf %lf", dev, &channel, freq, &pt.dc_i, &pt.dc_q, &pt.gain, &pt.phase) != 7
+                || parse_frequency(freq, &pt.frequency)) {
+            fprintf(stderr, "WARNING: Invalid IQ calibration in %s line %u\n", path, line_no);
+            continue;
+        }
+        int dev_match = !strcmp(dev, "*")
+                || (sdr_dev->hardware_key && !strcmp(dev, sdr_dev->hardware_key))
+                || (sdr_dev->driver_key && !strcmp(dev, sdr_dev->driver_key));
+        if (!dev_match || channel != tx->channel) {
+            continue;
+        }
+        if (cal->len == cap) {
+            cap                    = cap ? 2 * cap : 16;
+            iq_cal_point_t *points = realloc(cal->points, cap * sizeof(*points));
+            if (!points) {
+                fprintf(stderr, "realloc() failed\n");
+                break;
+            }
+            cal->points = points;
+        }
+        cal->points[cal->len++] = pt;
+    }
+    fclose(fp);
+
+    if (!cal->len) {
+        fprintf(stderr, "WARNING: No IQ calibration for %s channel %zu in %s\n", sdr_dev->hardware_key, tx->channel, path);
+        free(cal->points);
+        free(cal);
+        return 0;
+    }
+    qsort(cal->points, cal->len, sizeof(*cal->points), cmp_cal_point);
+    tx->iq_cal = cal;
+    return 0;
+}
+
+static void iq_cal_free(sdr_cmd_t *tx)
+{
+    sdr_iq_cal_t *cal = tx->iq_cal;
+    if (cal) {
+        free(cal->points);
+        free(cal);
+        tx->iq_cal = NULL;
+    }
+}
+
+static int iq_cal_start(sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
+{
+    if (!tx->iq_cal_file || !*tx->iq_cal_file) {
+        return 0;
+    }
+    if (iq_cal_load(sdr_dev, tx, tx->iq_cal_file)) {
+        return -1;
+    }
+    iq_cal_tune(tx, tx->center_frequency);
+    // extra channels have their own IQ paths, they tune with the device unless set
+    for (size_t i = 0; i < tx->channels_len; ++i) {
+        sdr_cmd_t *ch = tx->channels[i];
+        if (iq_cal_load(sdr_dev, ch, tx->iq_cal_file)) {
+            return -1;
+        }
+        iq_cal_tune(ch, ch->center_frequency > 0.0 ? ch->center_frequency : tx->center_frequency);
+    }
+    if (tx->iq_cal) {
+        sdr_iq_cal_t const *cal = tx->iq_cal;
+        fprintf(stderr, "IQ correction at %.0f Hz: DC %+.4f %+.4f, Q gain %.4f, phase %+.2f deg\n", tx->center_frequency,
+                (double)cal->corr.dc_i, (double)cal->corr.dc_q, hypot(cal->corr.gain, cal->corr.cross), atan2(cal->corr.cross, cal->corr.gain) * 180.0 / M_PI);
+    }
+    return 0;
+}
+
+static void iq_cal_stop(sdr_cmd_t *tx)
+{
+    iq_cal_free(tx);
+    for (size_t i = 0; i < tx->channels_len; ++i) {
+        iq_cal_free(tx->channels[i]);
+    }
+}
+
+// The correction to fuse into the conversion, NULL if none or the mixer applies it.
+static iq_corr_t const *conv_corr(sdr_cmd_t const *tx)
+{
+    sdr_iq_cal_t const *cal = tx->iq_cal;
+    return cal && tx->freq_offset == 0.0 ? &cal->corr : NULL;
+}
+
+// The correction for samples already in the output format at fullScale.
+static iq_corr_t scaled_corr(sdr_cmd_t const *tx, int out_fmt, double fullScale)
+{
+    sdr_iq_cal_t const *cal = tx->iq_cal;
+    if (!cal) {
+        return iq_corr_none;
+    }
+    iq_corr_t corr = cal->corr;
+    if (fullScale > 0.0) {
+        corr.dc_i *= (float)(fullScale / conv_full_scale[out_fmt]);
+        corr.dc_q *= (float)(fullScale / conv_full_scale[out_fmt]);
+    }
+    return corr;
+}
+
+// Correct samples in place, for inputs that need no conversion.
+static void iq_correct_in_place(sdr_cmd_t const *tx, void *buf, size_t n_samps, int out_fmt, double fullScale)
+{
+    if (conv_corr(tx)) {
+        iq_corr_t corr = scaled_corr(tx, out_fmt, fullScale);
+        conv_iq_matrix[out_fmt][out_fmt](buf, buf, n_samps, (float)conv_full_scale[out_fmt], &corr);
+    }
+}
+
+// cache files
+
+// Create a directory and its parents, existing directories are fine.
+static int mkdir_parents(char *path)
+{
+    for (char *p = path + 1; *p; ++p) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        int r = mkdir(path, 0755);
+        *p = '/';
+        if (r && errno != EEXIST)
+            return -1;
+    }
+    if (mkdir(path, 0755) && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+char *sdr_cache_path(sdr_cmd_t *tx, char const *name)
+{
+    char dir[1024];
+
+    if (tx->cache_dir && !*tx->cache_dir) {
+        return NULL; // disabled
+    }
+    if (tx->cache_dir) {
+        snprintf(dir, sizeof(dir), "%s", tx->cache_dir);
+    }
+    else if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME")) {
+        snprintf(dir, sizeof(dir), "%s/tx_tools", getenv("XDG_CACHE_HOME"));
+    }
+    else if (getenv("HOME") && *getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.cache/tx_tools", getenv("HOME"));
+    }
+    else {
+        return NULL;
+    }
+
+    if (mkdir_parents(dir)) {
+        fprintf(stderr, "Failed to create cache directory %s (%s)\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (!path) {
+        return NULL;
+    }
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+// elastic buffer
+
+/*
+    A live input, e.g. a modulator on an audio clock, never runs at exactly
+    the device rate. A reader thread keeps a ring of input samples and the
+    device thread resamples from it with a cubic Farrow interpolator. The
+    rate is servoed slowly on the ring fill, so the latency stays at
+    elastic_ms and the stream can run indefinitely.
+*/
+
+typedef struct sdr_elastic {
+    sdr_cmd_t *tx;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int in_fmt;
+    float *ring;      ///< normalized I/Q samples
+    size_t size;      ///< ring capacity in samples
+    size_t head;      ///< samples written, guarded by lock
+    size_t tail;      ///< samples read, guarded by lock
+    int eof;          ///< input ended, guarded by lock
+    int stop;         ///< reader should stop, guarded by lock
+    int running;      ///< reader thread to join
+    size_t target;    ///< fill level to keep in samples
+    int started;      ///< prefilled to the target once
+    size_t settle;    ///< samples to output before the servo starts
+    uint8_t *raw;     ///< reader input, in input format
+    size_t raw_len;   ///< bytes of a partial sample kept in raw
+    float *conv;      ///< reader input, normalized
+    float *out;       ///< resampler output, normalized
+    float hist[8];    ///< interpolator taps x[-1], x[0], x[1], x[2] as I/Q
+    double mu;        ///< interpolator position between x[0] and x[1]
+    double ratio;     ///< input samples per output sample
+    double integral;  ///< servo integral, the drift estimate
+    double fill_avg;  ///< smoothed fill level in samples
+} sdr_elastic_t;
+
+// Reader thread: move input to the ring, blocks while the ring is full.
+static void *elastic_reader(void *arg)
+{
+    sdr_elastic_t *el  = arg;
+    sdr_cmd_t *tx      = el->tx;
+    size_t in_size     = conv_sample_size[el->in_fmt];
+    size_t chunk       = tx->block_size;
+
+    pthread_mutex_lock(&el->lock);
+    while (!el->stop) {
+        if (el->size - (el->head - el->tail) < chunk) {
+            pthread_cond_wait(&el->cond, &el->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&el->lock);
+
+#ifndef _WIN32
+        // poll so a stop is noticed even if the producer stalls
+        struct pollfd pfd = {.fd = tx->stream_fd, .events = POLLIN};
+        if (poll(&pfd, 1, ELASTIC_WAIT_MS) == 0) {
+            pthread_mutex_lock(&el->lock);
+            continue;
+        }
+#endif
+        ssize_t n_read = read(tx->stream_fd, &el->raw[el->raw_len], chunk * in_size - el->raw_len);
+        if (n_read < 0 && (errno == EINTR || errno == EAGAIN)) {
+            pthread_mutex_lock(&el->lock);
+            continue;
+        }
+        if (n_read <= 0) {
+            if (n_read < 0) {
+                fprintf(stderr, "Input read error (%d)\n", errno);
+            }
+            pthread_mutex_lock(&el->lock);
+            el->eof = 1;
+            pthread_cond_broadcast(&el->cond);
+            break;
+        }
+        size_t len     = el->raw_len + (size_t)n_read;
+        size_t n_samps = len / in_size;
+        conv_matrix[el->in_fmt][CONV_CF32](el->raw, el->conv, n_samps, 1.0f);
+        // keep a partial sample for the next read
+        el->raw_len = len - n_samps * in_size;
+        memmove(el->raw, &el->raw[n_samps * in_size], el->raw_len);
+
+        // only the reader moves head, the space checked above is still free
+        size_t pos   = el->head % el->size;
+        size_t first = n_samps < el->size - pos ? n_samps : el->size - pos;
+        memcpy(&el->ring[2 * pos], el->conv, first * 2 * sizeof(float));
+        memcpy(el->ring, &el->conv[2 * first], (n_samps - first) * 2 * sizeof(float));
+
+        pthread_mutex_lock(&el->lock);
+        el->head += n_samps;
+        pthread_cond_broadcast(&el->cond);
+    }
+    pthread_mutex_unlock(&el->lock);
+    return NULL;
+}
+
+static void elastic_free(sdr_elastic_t *el)
+{
+    free(el->ring);
+    free(el->raw);
+    free(el->conv);
+    free(el->out);
+    free(el);
+}
+
+static int elastic_start(sdr_cmd_t *tx)
+{
+    if (tx->stream_fd < 0 || tx->read_cb || tx->render_stream || tx->stream_buffer) {
+        fprintf(stderr, "WARNING: The elastic buffer needs a stream input, ignored\n");
+        return 0;
+    }
+    if (tx->sample_rate <= 0.0) {
+        fprintf(stderr, "The elastic buffer needs a sample rate.\n");
+        return -1;
+    }
+    int in_fmt = conv_format(tx->input_format);
+    if (in_fmt < 0) {
+        fprintf(stderr, "Unsupported input format: %s\n", tx->input_format);
+        return -1;
+    }
+
+    sdr_elastic_t *el = calloc(1, sizeof(*el));
+    if (!el) {
+        fprintf(stderr, "calloc() failed\n");
+        return -1;
+    }
+    el->tx     = tx;
+    el->in_fmt = in_fmt;
+    el->target = (size_t)(tx->elastic_ms * tx->sample_rate / 1000.0);
+    if (el->target < 2 * tx->block_size) {
+        el->target = 2 * tx->block_size;
+    }
+    // room to absorb drift on both sides of the target
+    el->size     = 2 * el->target + 2 * tx->block_size;
+    el->ring     = malloc(el->size * 2 * sizeof(float));
+    el->raw      = malloc(tx->block_size * conv_sample_size[in_fmt]);
+    el->conv     = malloc(tx->block_size * 2 * sizeof(float));
+    el->out      = malloc(tx->block_size * 2 * sizeof(float));
+    el->mu       = 1.0; // load x[1] first
+    el->ratio    = 1.0;
+    el->fill_avg = (double)el->target;
+    if (!el->ring || !el->raw || !el->conv || !el->out) {
+        fprintf(stderr, "malloc() failed\n");
+        elastic_free(el);
+        return -1;
+    }
+    pthread_mutex_init(&el->lock, NULL);
+    pthread_cond_init(&el->cond, NULL);
+    if (pthread_create(&el->thread, NULL, elastic_reader, el)) {
+        fprintf(stderr, "Failed to start the elastic buffer reader\n");
+        pthread_mutex_destroy(&el->lock);
+        pthread_cond_destroy(&el->cond);
+        elastic_free(el);
+        return -1;
+    }
+    el->running = 1;
+
+    fprintf(stderr, "Elastic buffer of %.0f ms, holding %zu samples\n", el->target * 1000.0 / tx->sample_rate, el->target);
+    tx->elastic = el;
+    return 0;
+}
+
+static void elastic_stop(sdr_cmd_t *tx)
+{
+    sdr_elastic_t *el = tx->elastic;
+    if (!el) {
+        return;
+    }
+    if (el->running) {
+        pthread_mutex_lock(&el->lock);
+        el->stop = 1;
+        pthread_cond_broadcast(&el->cond);
+        pthread_mutex_unlock(&el->lock);
+        pthread_join(el->thread, NULL);
+    }
+
+    tx->drift_ppm = el->integral * 1e6;
+    fprintf(stderr, "Elastic buffer: input clock %+.1f ppm against the device\n", tx->drift_ppm);
+
+    pthread_mutex_destroy(&el->lock);
+    pthread_cond_destroy(&el->cond);
+    elastic_free(el);
+    tx->elastic = NULL;
+}
+
+// Rewind the input for a loop, the reader is stopped while the fd is moved, then refills from the start.
+static int elastic_reset(sdr_cmd_t *tx)
+{
+    sdr_elastic_t *el = tx->elastic;
+    pthread_mutex_lock(&el->lock);
+    el->stop = 1;
+    pthread_cond_broadcast(&el->cond);
+    pthread_mutex_unlock(&el->lock);
+    pthread_join(el->thread, NULL);
+
+    lseek(tx->stream_fd, 0, SEEK_SET);
+    // the ring is drained at the end, the interpolator and the drift estimate carry on
+    el->head    = 0;
+    el->tail    = 0;
+    el->eof     = 0;
+    el->stop    = 0;
+    el->raw_len = 0;
+    el->started = 0;
+    if (pthread_create(&el->thread, NULL, elastic_reader, el)) {
+        fprintf(stderr, "Failed to restart the elastic buffer reader\n");
+        el->eof     = 1; // ends the stream
+        el->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the ring to hold at least n samples, returns the fill (less at the end), -1 on a timeout.
+static ssize_t elastic_wait(sdr_elastic_t *el, size_t n)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += ELASTIC_WAIT_MS * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&el->lock);
+    while (el->head - el->tail < n && !el->eof && !ATOMIC_LOAD(el->tx->flag_abort)) {
+        if (pthread_cond_timedwait(&el->cond, &el->lock, &until)) {
+            break;
+        }
+    }
+    ssize_t fill = (ssize_t)(el->head - el->tail);
+    if ((size_t)fill < n && !el->eof) {
+        fill = -1;
+    }
+    pthread_mutex_unlock(&el->lock);
+    return fill;
+}
+
+// Resample up to n_samps from the ring to buf in the output format.
+// Returns samples, 0 at the end, -1 with errno EAGAIN to retry.
+static ssize_t elastic_read(sdr_elastic_t *el, void *buf, size_t n_samps, int out_fmt, double fullScale)
+{
+    sdr_cmd_t *tx = el->tx;
+
+    // prefill, the reader is expected to take a while
+    while (!el->started) {
+        if (elastic_wait(el, el->target) >= 0) {
+            el->started = 1;
+            el->settle  = (size_t)(ELASTIC_SETTLE_S * tx->sample_rate);
+        }
+        else if (ATOMIC_LOAD(tx->flag_abort)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    // input needed for this block, with a margin for the rounding of mu
+    size_t need = (size_t)(el->mu + n_samps * el->ratio) + 1;
+    ssize_t fill = elastic_wait(el, need);
+    if (fill < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (el->settle) {
+        // the device FIFO takes its share first, the servo then starts from the fill when it is full
+        el->settle -= n_samps < el->settle ? n_samps : el->settle;
+        el->fill_avg = (double)fill;
+    }
+    else {
+        // the device clock decides the pace, correct the rate on the smoothed fill towards the -E latency
+        double dt    = n_samps / tx->sample_rate;
+        double alpha = dt < 1.0 ? dt : 1.0; // about 1 s smoothing
+        el->fill_avg += alpha * ((double)fill - el->fill_avg);
+        double err = (el->fill_avg - (double)el->target) / tx->sample_rate;
+        el->integral += ELASTIC_KI * err * dt;
+        if (el->integral > ELASTIC_MAX_DRIFT) el->integral = ELASTIC_MAX_DRIFT;
+        if (el->integral < -ELASTIC_MAX_DRIFT) el->integral = -ELASTIC_MAX_DRIFT;
+        double corr = ELASTIC_KP * err + el->integral;
+        if (corr > ELASTIC_MAX_DRIFT) corr = ELASTIC_MAX_DRIFT;
+        if (corr < -ELASTIC_MAX_DRIFT) corr = -ELASTIC_MAX_DRIFT;
+        el->ratio = 1.0 + corr;
+    }
+
+    // the reader only appends, samples up to fill stay put without the lock
+    size_t pos  = el->tail;
+    size_t end  = el->tail + (size_t)fill;
+    float *h    = el->hist;
+    size_t n_out = 0;
+    for (; n_out < n_samps; ++n_out) {
+        while (el->mu >= 1.0 && pos < end) {
+            float const *x = &el->ring[2 * (pos % el->size)];
+            memmove(h, &h[2], 6 * sizeof(float));
+            h[6] = x[0];
+            h[7] = x[1];
+            pos++;
+            el->mu -= 1.0;
+        }
+        if (el->mu >= 1.0) {
+            break; // input ended
+        }
+        // cubic Lagrange in Farrow form, between x[0] and x[1]
+        float mu = (float)el->mu;
+        for (int c = 0; c < 2; ++c) {
+            float xm1 = h[c], x0 = h[2 + c], x1 = h[4 + c], x2 = h[6 + c];
+            float c1  = x1 - xm1 / 3.0f - x0 / 2.0f - x2 / 6.0f;
+            float c2  = (xm1 + x1) / 2.0f - x0;
+            float c3  = (x2 - xm1) / 6.0f + (x0 - x1) / 2.0f;
+            el->out[2 * n_out + c] = ((c3 * mu + c2) * mu + c1) * mu + x0;
+        }
+        el->mu += el->ratio;
+    }
+
+    pthread_mutex_lock(&el->lock);
+    el->tail = pos;
+    pthread_cond_broadcast(&el->cond);
+    pthread_mutex_unlock(&el->lock);
+
+    conv_iq_matrix[CONV_CF32][out_fmt](el->out, buf, n_out, (float)fullScale, conv_corr(tx) ? conv_corr(tx) : &iq_corr_none);
+    return (ssize_t)n_out;
+}
+
 // input processing
 
+// Read raw samples from the callback or file descriptor, returns bytes like read().
+static ssize_t input_read_raw(sdr_cmd_t *tx, void *buf, size_t in_size, size_t n_samps)
+{
+    if (tx->read_cb) {
+        ssize_t n = tx->read_cb(tx->read_ctx, buf, n_samps);
+        if (n < 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return n * (ssize_t)in_size;
+    }
+    if (tx->shm) {
+        // copy out of the ring, up to both spans at the wrap
+        size_t len = 0;
+        while (len < in_size * n_samps) {
+            void *span;
+            ssize_t n = tx_shm_read_span(tx->shm, &span, len ? 0 : SHM_WAIT_MS);
+            if (n <= 0) {
+                if (n < 0 && !len) {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                break;
+            }
+            size_t copy = (size_t)n < in_size * n_samps - len ? (size_t)n : in_size * n_samps - len;
+            memcpy((uint8_t *)buf + len, span, copy);
+            tx_shm_read_done(tx->shm, copy);
+            len += copy;
+        }
+        return (ssize_t)len;
+    }
+    return read(tx->stream_fd, buf, in_size * n_samps);
+}
+
+// Convert samples from a shared memory ring in place, without a copy to the conversion buffer.
+static ssize_t shm_read_convert(sdr_cmd_t *tx, void *buf, size_t block_size, int in_fmt, int out_fmt, double fullScale, size_t *out_samps)
+{
+    size_t in_size = conv_sample_size[in_fmt];
+    void *span;
+    ssize_t n_read = tx_shm_read_span(tx->shm, &span, SHM_WAIT_MS);
+    if (n_read <= 0) {
+        *out_samps = 0;
+        if (n_read < 0) {
+            errno = EAGAIN;
+        }
+        return n_read;
+    }
+    size_t n_samps = (size_t)n_read / in_size;
+    if (n_samps > block_size) {
+        n_samps = block_size;
+    }
+
+    // as for stream input, but straight from the ring
+    iq_corr_t const *corr = conv_corr(tx);
+    if (in_fmt == out_fmt && corr) {
+        conv_iq_matrix[in_fmt][out_fmt](span, buf, n_samps, (float)(fullScale > 0.0 ? fullScale : conv_full_scale[in_fmt]), corr);
+    }
+    else if (in_fmt == out_fmt && in_fmt == CONV_CS16 && fullScale >= 2047.0 && fullScale <= 2048.0) {
+        for (size_t i = 0; i < n_samps * 2; ++i) {
+            ((int16_t *)buf)[i] = (int16_t)(((int16_t *)span)[i] >> 4);
+        }
+    }
+    else if (in_fmt == out_fmt && !(fullScale > 0.0 && fullScale < conv_full_scale[in_fmt] - 1.0)) {
+        memcpy(buf, span, n_samps * in_size);
+    }
+    else if (corr) {
+        conv_iq_matrix[in_fmt][out_fmt](span, buf, n_samps, (float)fullScale, corr);
+    }
+    else {
+        conv_matrix[in_fmt][out_fmt](span, buf, n_samps, (float)fullScale);
+    }
+    tx_shm_read_done(tx->shm, n_samps * in_size);
+
+    *out_samps = n_samps;
+    return (ssize_t)(n_samps * in_size);
+}
+
+// sample rate conversion
+
+/*
+    A rational L/M polyphase resampler converts the input rate to the
+    device rate. The prototype lowpass runs at L times the input rate,
+    phase p holds every L-th tap from p, reversed, so each output sample
+    is a plain dot product over contiguous I and Q histories.
+*/
+
+typedef struct sdr_resampler {
+    int in_fmt;
+    unsigned up;      ///< interpolation L
+    unsigned down;    ///< decimation M
+    unsigned taps;    ///< taps per phase
+    float *coeffs;    ///< up phases of taps each
+    unsigned phase;   ///< phase of the next output
+    size_t block;     ///< input samples per read
+    float *hist_i;    ///< input history, taps - 1 samples followed by a block
+    float *hist_q;
+    size_t have;      ///< samples in the history
+    size_t pos;       ///< history index of the newest tap for the next output
+    uint8_t *raw;     ///< input in input format, a block after a partial sample
+    size_t raw_len;   ///< bytes of a partial sample kept in raw
+    float *conv;      ///< input, normalized
+    float *out;       ///< output, normalized
+} sdr_resampler_t;
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b)
+{
+    while (b) {
+        uint64_t t = a % b;
+        a          = b;
+        b          = t;
+    }
+    return a;
+}
+
+static void resampler_free(sdr_resampler_t *rs)
+{
+    free(rs->coeffs);
+    free(rs->hist_i);
+    free(rs->hist_q);
+    free(rs->raw);
+    free(rs->conv);
+    free(rs->out);
+    free(rs);
+}
+
+static int resampler_start(sdr_cmd_t *tx)
+{
+    if (tx->input_rate <= 0.0 || tx->input_rate == tx->sample_rate) {
+        return 0;
+    }
+    if (tx->render_stream || tx->stream_buffer || tx->read_native) {
+        fprintf(stderr, "WARNING: Rendered input is at the device rate, the input rate is ignored\n");
+        return 0;
+    }
+    if (tx->elastic_ms) {
+        fprintf(stderr, "The elastic buffer needs the input at the device rate.\n");
+        return -1;
+    }
+    int in_fmt = conv_format(tx->input_format);
+    if (in_fmt < 0 || tx->sample_rate <= 0.0) {
+        fprintf(stderr, "Resampling needs an input format and a sample rate.\n");
+        return -1;
+    }
+
+    uint64_t in_rate  = (uint64_t)llround(tx->input_rate);
+    uint64_t out_rate = (uint64_t)llround(tx->sample_rate);
+    uint64_t div      = gcd_u64(in_rate, out_rate);
+    if (out_rate / div > SRC_MAX_PHASES || in_rate / div > SRC_MAX_PHASES) {
+        fprintf(stderr, "No simple ratio from %.0f to %.0f S/s, try a rounder device rate.\n", tx->input_rate, tx->sample_rate);
+        return -1;
+    }
+
+    sdr_resampler_t *rs = calloc(1, sizeof(*rs));
+    if (!rs) {
+        fprintf(stderr, "calloc() failed\n");
+        return -1;
+    }
+    rs->in_fmt = in_fmt;
+    rs->up     = (unsigned)(out_rate / div);
+    rs->down   = (unsigned)(in_rate / div);
+    unsigned wide = rs->up > rs->down ? rs->up : rs->down;
+    rs->taps   = (SRC_TAPS * wide + rs->up - 1) / rs->up;
+    rs->taps   = (rs->taps + SRC_LANES - 1) / SRC_LANES * SRC_LANES;
+    rs->block  = tx->block_size * rs->down / rs->up + 1;
+    rs->coeffs = malloc((size_t)rs->up * rs->taps * sizeof(float));
+    rs->hist_i = calloc(rs->taps - 1 + rs->block, sizeof(float));
+    rs->hist_q = calloc(rs->taps - 1 + rs->block, sizeof(float));
+    rs->raw    = malloc((rs->block + 1) * conv_sample_size[in_fmt]);
+    rs->conv   = malloc(rs->block * 2 * sizeof(float));
+    rs->out    = malloc(tx->block_size * 2 * sizeof(float));
+    if (!rs->coeffs || !rs->hist_i || !rs->hist_q || !rs->raw || !rs->conv || !rs->out) {
+        fprintf(stderr, "malloc() failed\n");
+        resampler_free(rs);
+        return -1;
+    }
+    rs->have = rs->taps - 1;
+    rs->pos  = rs->taps - 1;
+
+    // Blackman windowed sinc at L times the input rate, below the lower Nyquist, with a gain of L
+    size_t len = (size_t)rs->up * rs->taps;
+    double fc  = 0.4 / wide;
+    for (size_t j = 0; j < len; ++j) {
+        double t = (double)j - (len - 1) / 2.0;
+        double w = 0.42 - 0.5 * cos(2.0 * M_PI * j / (len - 1)) + 0.08 * cos(4.0 * M_PI * j / (len - 1));
+        double h = t == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * t) / (M_PI * t);
+        // tap j = p + k * L goes to phase p, reversed to run oldest first
+        size_t p = j % rs->up;
+        size_t k = j / rs->up;
+        rs->coeffs[p * rs->taps + (rs->taps - 1 - k)] = (float)(h * w * rs->up);
+    }
+
+    fprintf(stderr, "Resampling from %.0f to %.0f S/s (%u/%u, %u taps per phase)\n",
+            tx->input_rate, tx->sample_rate, rs->up, rs->down, rs->taps);
+    tx->resampler = rs;
+    return 0;
+}
+
+static void resampler_stop(sdr_cmd_t *tx)
+{
+    if (tx->resampler) {
+        resampler_free(tx->resampler);
+        tx->resampler = NULL;
+    }
+}
+
+// Start over with an empty history, e.g. for a loop, so the filter does not run across the seam.
+static void resampler_reset(sdr_resampler_t *rs)
+{
+    memset(rs->hist_i, 0, (rs->taps - 1) * sizeof(float));
+    memset(rs->hist_q, 0, (rs->taps - 1) * sizeof(float));
+    rs->have    = rs->taps - 1;
+    rs->pos     = rs->taps - 1;
+    rs->phase   = 0;
+    rs->raw_len = 0;
+}
+
+// Resample up to n_samps to buf in the output format, reads input as needed.
+// Returns samples, 0 at the end, -1 on a read error (errno set).
+static ssize_t resampler_read(sdr_cmd_t *tx, void *buf, size_t n_samps, int out_fmt, double fullScale)
+{
+    sdr_resampler_t *rs = tx->resampler;
+    size_t in_size      = conv_sample_size[rs->in_fmt];
+    size_t n_out        = 0;
+
+    while (n_out < n_samps) {
+        if (rs->pos >= rs->have) {
+            // keep the taps - 1 newest samples, then refill
+            size_t keep = rs->taps - 1;
+            size_t drop = rs->have - keep;
+            memmove(rs->hist_i, &rs->hist_i[drop], keep * sizeof(float));
+            memmove(rs->hist_q, &rs->hist_q[drop], keep * sizeof(float));
+            rs->pos -= drop;
+            rs->have = keep;
+
+            ssize_t n_read = input_read_raw(tx, &rs->raw[rs->raw_len], in_size, rs->block);
+            if (n_read <= 0) {
+                if (n_out) {
+                    break; // deliver what we have, the end shows on the next read
+                }
+                return n_read < 0 ? -1 : 0;
+            }
+            size_t len  = rs->raw_len + (size_t)n_read;
+            size_t n_in = len / in_size;
+            conv_matrix[rs->in_fmt][CONV_CF32](rs->raw, rs->conv, n_in, 1.0f);
+            // keep a partial sample for the next read
+            rs->raw_len = len - n_in * in_size;
+            memmove(rs->raw, &rs->raw[n_in * in_size], rs->raw_len);
+            for (size_t k = 0; k < n_in; ++k) {
+                rs->hist_i[keep + k] = rs->conv[2 * k];
+                rs->hist_q[keep + k] = rs->conv[2 * k + 1];
+            }
+            rs->have = keep + n_in;
+            continue;
+        }
+
+        float const *c  = &rs->coeffs[rs->phase * rs->taps];
+        float const *xi = &rs->hist_i[rs->pos + 1 - rs->taps];
+        float const *xq = &rs->hist_q[rs->pos + 1 - rs->taps];
+        // independent partial sums, the compiler can keep them in vector registers
+        float acc_i[SRC_LANES] = {0}, acc_q[SRC_LANES] = {0};
+        for (unsigned k = 0; k < rs->taps; k += SRC_LANES) {
+            for (unsigned l = 0; l < SRC_LANES; ++l) {
+                acc_i[l] += c[k + l] * xi[k + l];
+                acc_q[l] += c[k + l] * xq[k + l];
+            }
+        }
+        float sum_i = 0.0f, sum_q = 0.0f;
+        for (unsigned l = 0; l < SRC_LANES; ++l) {
+            sum_i += acc_i[l];
+            sum_q += acc_q[l];
+        }
+        rs->out[2 * n_out]     = sum_i;
+        rs->out[2 * n_out + 1] = sum_q;
+        n_out++;
+
+        rs->phase += rs->down;
+        rs->pos += rs->phase / rs->up;
+        rs->phase %= rs->up;
+    }
+
+    conv_iq_matrix[CONV_CF32][out_fmt](rs->out, buf, n_out, (float)fullScale, conv_corr(tx) ? conv_corr(tx) : &iq_corr_none);
+    return (ssize_t)n_out;
+}
+
 int sdr_input_reset(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
 {
-    if (tx->stream_fd >= 0) {
+    if (tx->resampler) {
+        resampler_reset(tx->resampler);
+    }
+    if (tx->render_stream) {
+        iq_render_stream_reset(tx->render_stream);
+    }
+    else if (tx->read_cb) {
+        // the callback handles repeats itself
+    }
+    else if (tx->elastic) {
+        return elastic_reset(tx);
+    }
+    else if (tx->stream_fd >= 0) {
         lseek(tx->stream_fd, 0, SEEK_SET);
     }
     else {
@@ -319,7 +1814,15 @@ int sdr_input_reset(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx)
 ssize_t sdr_input_read(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void *buf, size_t *out_samps, double fullScale)
 {
     ssize_t n_read = 0;
-    size_t n_samps = 0;
+    size_t n_samps = *out_samps;
+
+    struct timespec read_start;
+    clock_gettime(CLOCK_MONOTONIC, &read_start);
+
+    // a read never crosses the end of a dwell
+    if (tx->hops_len && tx->hop_left && (!n_samps || n_samps > tx->hop_left)) {
+        n_samps = tx->hop_left;
+    }
 
     n_read = sdr_input_try_read(sdr_ctx, tx, buf, &n_samps, fullScale);
     if (n_read == -2) {
@@ -363,79 +1866,168 @@ ssize_t sdr_input_read(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void *buf, size_t *out
         tx->samples_to_write = 0;
         tx->flag_abort = 1;
     }
+    if (tx->hops_len) {
+        tx->hop_left -= n_samps < tx->hop_left ? n_samps : tx->hop_left;
+    }
+    if (tx->freq_offset != 0.0 && tx->sample_rate > 0.0) {
+        int out_fmt    = conv_format(tx->output_format);
+        iq_corr_t corr = scaled_corr(tx, out_fmt, fullScale);
+        mix_funcs[out_fmt](buf, n_samps, (float)conv_full_scale[out_fmt], &tx->nco_phase, tx->freq_offset / tx->sample_rate, &corr);
+    }
+    // a block that takes longer to produce than to transmit drains the device FIFO
+    if (n_samps && tx->sample_rate > 0.0) {
+        double load = elapsed_since(&read_start) * tx->sample_rate / n_samps;
+        if (load > 1.0) {
+            tx->deadline_misses++;
+        }
+        if (load > tx->worst_load) {
+            tx->worst_load = load;
+        }
+    }
     *out_samps = n_samps;
     return n_read;
 }
 
+void sdr_input_read_channels(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void **bufs, size_t n_samps)
+{
+    size_t sample_size = sdr_format_sample_size(tx->output_format);
+    int silence        = is_format_equal(tx->output_format, "CU8") ? 0x80 : 0;
+
+    for (size_t i = 0; i < tx->channels_len; ++i) {
+        sdr_cmd_t *ch = tx->channels[i];
+        uint8_t *buf  = bufs[i + 1];
+        size_t pos    = 0;
+        // a channel without input or with its limit reached is silent
+        int has_input = ch->render_stream || ch->stream_buffer || ch->read_cb || ch->shm || ch->stream_fd >= 0;
+        while (has_input && !ch->flag_abort && pos < n_samps) {
+            size_t n = n_samps - pos;
+            if (sdr_input_read(sdr_ctx, ch, &buf[pos * sample_size], &n, tx->fullScale) <= 0) {
+                break; // ended or no data yet
+            }
+            pos += n;
+        }
+        // pad a short read with silence, a channel never holds up the others
+        memset(&buf[pos * sample_size], silence, (n_samps - pos) * sample_size);
+    }
+}
+
 ssize_t sdr_input_try_read(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void *buf, size_t *out_samps, double fullScale)
 {
-    if (!is_format_equal(tx->output_format, "CS16")) {
-        // TODO: support other output format besides CS16
+    int out_fmt = conv_format(tx->output_format);
+    if (out_fmt < 0) {
         fprintf(stderr, "Unsupported output format: %s (input format: %s)\n", tx->output_format, tx->input_format);
         return -2;
     }
+    size_t out_size = conv_sample_size[out_fmt];
+
+    size_t block_size = tx->block_size;
+    if (*out_samps && *out_samps < block_size)
+        block_size = *out_samps;
+
+    // render directly to the output, already in output format
+
+    if (tx->render_stream) {
+        size_t n_samps = iq_render_stream_read(tx->render_stream, buf, block_size);
+        iq_correct_in_place(tx, buf, n_samps, out_fmt, fullScale);
+
+        *out_samps = n_samps;
+        return (ssize_t)(n_samps * out_size);
+    }
+
+    // read rendered blocks from the callback, already in output format
 
-    // read from buffer
+    if (tx->read_cb && tx->read_native) {
+        ssize_t n_samps = tx->read_cb(tx->read_ctx, buf, block_size);
+        if (n_samps < 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        iq_correct_in_place(tx, buf, (size_t)n_samps, out_fmt, fullScale);
 
-    if (!tx->stream_fd) {
-        size_t n_read = sizeof(int16_t) * 2 * tx->block_size;
-        if (n_read > tx->block_size - tx->buffer_offset)
-            n_read = tx->block_size - tx->buffer_offset;
+        *out_samps = (size_t)n_samps;
+        return n_samps * (ssize_t)out_size;
+    }
+
+    // read from buffer, already in output format
+
+    if (tx->stream_buffer) {
+        size_t n_read = out_size * block_size;
+        if (n_read > tx->buffer_size - tx->buffer_offset)
+            n_read = tx->buffer_size - tx->buffer_offset;
 
         memcpy(buf, (uint8_t *)(tx->stream_buffer) + tx->buffer_offset, n_read);
         tx->buffer_offset += n_read;
+        iq_correct_in_place(tx, buf, n_read / out_size, out_fmt, fullScale);
 
-        *out_samps = (size_t)n_read / sizeof(uint16_t) / 2;
+        *out_samps = (size_t)n_read / out_size;
         return (ssize_t)n_read;
     }
 
+    // read through the elastic buffer, resampled to the device clock
+
+    if (tx->elastic) {
+        ssize_t n_samps = elastic_read(tx->elastic, buf, block_size, out_fmt, fullScale);
+
+        *out_samps = n_samps < 0 ? 0 : (size_t)n_samps;
+        return n_samps < 0 ? -1 : n_samps * (ssize_t)out_size;
+    }
+
+    // read through the resampler, converted to the device rate
+
+    if (tx->resampler) {
+        ssize_t n_samps = resampler_read(tx, buf, block_size, out_fmt, fullScale);
+
+        *out_samps = n_samps < 0 ? 0 : (size_t)n_samps;
+        return n_samps < 0 ? -1 : n_samps * (ssize_t)out_size;
+    }
+
     // read from stream
 
+    int in_fmt = conv_format(tx->input_format);
+    if (in_fmt < 0) {
+        fprintf(stderr, "Unsupported input format: %s (output format: %s)\n", tx->input_format, tx->output_format);
+        return -2;
+    }
+    size_t in_size = conv_sample_size[in_fmt];
+
+    if (tx->shm && !tx->read_cb) {
+        return shm_read_convert(tx, buf, block_size, in_fmt, out_fmt, fullScale, out_samps);
+    }
+
     ssize_t n_read;
     size_t n_samps;
+    iq_corr_t const *corr = conv_corr(tx);
 
-    if (is_format_equal(tx->input_format, "CS16")) {
-        n_read  = read(tx->stream_fd, buf, sizeof(int16_t) * 2 * tx->block_size);
-        n_samps = n_read < 0 ? 0 : (size_t)n_read / sizeof(uint16_t) / 2;
-        // The "native" format we read in, write out no conversion needed
-        if (fullScale >= 2047.0 && fullScale <= 2048.0) {
+    if (in_fmt == out_fmt && corr) {
+        // scale and correct in one pass
+        n_read  = input_read_raw(tx, buf, in_size, block_size);
+        n_samps = n_read < 0 ? 0 : (size_t)n_read / in_size;
+        conv_iq_matrix[in_fmt][out_fmt](buf, buf, n_samps, (float)(fullScale > 0.0 ? fullScale : conv_full_scale[in_fmt]), corr);
+    }
+    else if (in_fmt == out_fmt) {
+        // The "native" format we read in, write out with no conversion or in-place scaling
+        n_read  = input_read_raw(tx, buf, in_size, block_size);
+        n_samps = n_read < 0 ? 0 : (size_t)n_read / in_size;
+        if (in_fmt == CONV_CS16 && fullScale >= 2047.0 && fullScale <= 2048.0) {
             // Quick and dirty, so -1 (0xFFFF) to -15 (0xFFF1) scale down to -1 instead of 0
             for (size_t i = 0; i < n_samps * 2; ++i) {
                 ((int16_t *)buf)[i] >>= 4;
             }
         }
-        else if (fullScale < 32767.0) { // actually we expect 32768.0
-            for (size_t i = 0; i < n_samps * 2; ++i) {
-                ((int16_t *)buf)[i] *= (int)(fullScale / 32768.0);
-            }
+        else if (fullScale > 0.0 && fullScale < conv_full_scale[in_fmt] - 1.0) {
+            conv_matrix[in_fmt][out_fmt](buf, buf, n_samps, (float)fullScale);
         }
     }
-    else if (is_format_equal(tx->input_format, "CS8")) {
-        n_read  = read(tx->stream_fd, tx->conv_buf.u8, sizeof(int8_t) * 2 * tx->block_size);
-        n_samps = n_read < 0 ? 0 : (size_t)n_read / sizeof(int8_t) / 2;
-        for (size_t i = 0; i < n_samps * 2; ++i) {
-            ((int16_t *)buf)[i] = (int16_t)((tx->conv_buf.s8[i] + 0.4) / 128.0 * fullScale);
+    else {
+        n_read  = input_read_raw(tx, tx->conv_buf.u8, in_size, block_size);
+        n_samps = n_read < 0 ? 0 : (size_t)n_read / in_size;
+        if (corr) {
+            conv_iq_matrix[in_fmt][out_fmt](tx->conv_buf.u8, buf, n_samps, (float)fullScale, corr);
         }
-    }
-    else if (is_format_equal(tx->input_format, "CU8")) {
-        n_read  = read(tx->stream_fd, tx->conv_buf.u8, sizeof(uint8_t) * 2 * tx->block_size);
-        n_samps = n_read < 0 ? 0 : (size_t)n_read / sizeof(uint8_t) / 2;
-        for (size_t i = 0; i < n_samps * 2; ++i) {
-            ((int16_t *)buf)[i] = (int16_t)((tx->conv_buf.u8[i] - 127.4) / 128.0 * fullScale);
+        else {
+            conv_matrix[in_fmt][out_fmt](tx->conv_buf.u8, buf, n_samps, (float)fullScale);
         }
     }
-    else if (is_format_equal(tx->input_format, "CF32")) {
-        n_read  = read(tx->stream_fd, tx->conv_buf.u8, sizeof(float) * 2 * tx->block_size);
-        n_samps = n_read < 0 ? 0 : (size_t)n_read / sizeof(float) / 2;
-        if (!is_format_equal(tx->output_format, "CF32"))
-            for (size_t i = 0; i < n_samps * 2; ++i) {
-                ((int16_t *)buf)[i] = (int16_t)(tx->conv_buf.f32[i] / 1.0f * (float)fullScale);
-            }
-    }
-    else {
-        fprintf(stderr, "Unsupported input format: %s (output format: %s)\n", tx->input_format, tx->output_format);
-        return -2;
-    }
 
     *out_samps = n_samps;
     return n_read;
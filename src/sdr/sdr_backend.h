@@ -22,19 +22,73 @@
 
 #include "sdr.h"
 
+// Internal: device list
+
+/// Append a cleared device entry, invalidates earlier entry pointers.
+sdr_dev_t *sdr_ctx_add_device(sdr_ctx_t *sdr_ctx);
+
 // Internal: input processing
 
 /// Reset input data.
 int sdr_input_reset(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx);
 
 /// Read input data.
+/// On input out_samps limits the samples to read (0 for the block size), on output it has the samples read.
 ssize_t sdr_input_read(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void *buf, size_t *out_samps, double fullScale);
 
+/// Read input data of the extra channels into bufs[1] onwards, bufs[0] is the main channel.
+/// Reads exactly n_samps samples for each channel, a short input is padded with silence.
+void sdr_input_read_channels(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void **bufs, size_t n_samps);
+
+/// Advance to the next hop once the current dwell is done, reads stop at the end of each dwell.
+/// A pending retune comes first. Returns the hop to tune to, NULL if none is due.
+sdr_hop_t const *sdr_hop_next(sdr_cmd_t *tx);
+
 /// Try to read input data.
+/// On input out_samps limits the samples to read (0 for the block size), on output it has the samples read.
 ssize_t sdr_input_try_read(sdr_ctx_t *sdr_ctx, sdr_cmd_t *tx, void *buf, size_t *out_samps, double fullScale);
 
+// Internal: sample formats
+
+/// Effective precision in bits of a sample format at a given full scale.
+int sdr_format_bits(char const *format, double fullScale);
+
+/// Size in bytes of a sample (I and Q) in a sample format, 0 if the format can not be converted to.
+size_t sdr_format_sample_size(char const *format);
+
+/// Default full scale of a sample format, 0 if the format can not be converted to.
+double sdr_format_full_scale(char const *format);
+
+// Internal: cache files
+
+/// Path of a named file in the cache directory, created if needed.
+/// Returns an allocated string, NULL if caching is disabled or unavailable.
+char *sdr_cache_path(sdr_cmd_t *tx, char const *name);
+
+// Internal: counters shared with status threads, use long (needs windows.h on MSVC)
+
+#ifdef _MSC_VER
+#define ATOMIC_INC(x) InterlockedIncrement(&(x))
+#define ATOMIC_ADD(x, v) InterlockedExchangeAdd(&(x), (v))
+#define ATOMIC_LOAD(x) InterlockedCompareExchange(&(x), 0, 0)
+#define ATOMIC_STORE(x, v) InterlockedExchange(&(x), (v))
+#else
+#define ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_ADD(x, v) __atomic_add_fetch(&(x), (v), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#endif
+
 // Backends: prototypes
 
+int null_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args);
+int null_release_device(sdr_dev_t *sdr_dev);
+int null_acquire_device(sdr_dev_t *sdr_dev);
+int null_free_device(sdr_dev_t *sdr_dev);
+int null_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx);
+int null_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx);
+int null_transmit_done(sdr_cmd_t *tx);
+
 #ifdef HAS_SOAPY
 int soapy_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args);
 int soapy_release_device(sdr_dev_t *sdr_dev);
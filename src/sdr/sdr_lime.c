@@ -23,8 +23,8 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
-#include <sys/time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <lime/LimeSuite.h>
 
@@ -34,6 +34,13 @@
 #define EXIT_CODE_LMS_OPEN  (-1)
 
 #define DEFAULT_ANTENNA 1 // antenna with BW [30MHz .. 2000MHz]
+#define DEFAULT_FIFO_SIZE (1024 * 1024)
+#define MAX_TX_CHANNELS 4 ///< main channel and extra channels streamed together
+
+/// Private device state, kept while the device is open.
+typedef struct lime_state {
+    char config_key[128]; ///< configuration the device is currently calibrated for
+} lime_state_t;
 
 static char const *query_args(char const *enum_args)
 {
@@ -66,8 +73,6 @@ int lime_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args)
     device_count = LMS_GetDeviceList(device_list);
 
     for (int i = 0; i < device_count; ++i) {
-        sdr_dev_t *sdr_dev = &sdr_ctx->devs[sdr_ctx->devs_len++];
-
         if (index >= 0 && index != i) {
             continue;
         }
@@ -77,27 +82,22 @@ int lime_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args)
 
         fprintf(stderr, "device[%d/%d]=%s\n", i + 1, device_count, device_list[i]);
 
-        lms_device_t *device = NULL;
-        lms_dev_info_t const *info = NULL;
-        int ret = LMS_Open(&device, device_list[i], NULL);
-        if (ret == 0) {
-            info = LMS_GetDeviceInfo(device);
-            sdr_dev->hardware_key = strdup(info->deviceName);
-            //fprintf(stderr, "* deviceName = %s\n", info->deviceName);
-            //fprintf(stderr, "* expansionName = %s\n", info->expansionName);
-            //fprintf(stderr, "* firmwareVersion = %s\n", info->firmwareVersion);
-            //fprintf(stderr, "* hardwareVersion = %s\n", info->hardwareVersion);
-            //fprintf(stderr, "* protocolVersion = %s\n", info->protocolVersion);
-            //fprintf(stderr, "* boardSerialNumber = %llu\n", info->boardSerialNumber);
-            //fprintf(stderr, "* gatewareVersion = %s\n", info->gatewareVersion);
-            //fprintf(stderr, "* gatewareTargetBoard = %s\n", info->gatewareTargetBoard);
+        sdr_dev_t *sdr_dev = sdr_ctx_add_device(sdr_ctx);
+        if (!sdr_dev) {
+            break;
+        }
+
+        // the device is opened on first use, the list entry starts with the device name
+        char *hardware_key = strdup(device_list[i]);
+        if (hardware_key && strchr(hardware_key, ',')) {
+            *strchr(hardware_key, ',') = '\0';
         }
 
         sdr_dev->backend       = "lime";
-        sdr_dev->device        = device;
         sdr_dev->dev_kwargs    = strdup(kwargs);
         //sdr_dev->dev_index     = strdup(device_list[i]);
         sdr_dev->driver_key    = "Lime";
+        sdr_dev->hardware_key  = hardware_key;
         sdr_dev->hardware_info = strdup(device_list[i]);
     }
 
@@ -118,6 +118,11 @@ int lime_release_device(sdr_dev_t *sdr_dev)
     }
     sdr_dev->device = NULL;
 
+    lime_state_t *state = sdr_dev->priv;
+    if (state) {
+        state->config_key[0] = '\0'; // recalibrate or reload when reopened
+    }
+
     return LMS_Close(device);
 }
 
@@ -177,6 +182,8 @@ int lime_free_device(sdr_dev_t *sdr_dev)
 
     lime_release_device(sdr_dev);
     sdr_dev->backend = NULL;
+    free(sdr_dev->priv);
+    sdr_dev->priv = NULL;
     free(sdr_dev->dev_kwargs);
     free(sdr_dev->hardware_key);
     free(sdr_dev->hardware_info);
@@ -184,6 +191,52 @@ int lime_free_device(sdr_dev_t *sdr_dev)
     return 0;
 }
 
+// LimeSuite takes F32, I16, or I12 (LSB aligned in 16-bit), the latter two are both CS16 to us.
+static int lime_data_format(sdr_cmd_t *tx)
+{
+    if (!strcmp(tx->output_format, "CF32")) {
+        return LMS_FMT_F32;
+    }
+    if (tx->fullScale > 2048.0) {
+        return LMS_FMT_I16;
+    }
+    return LMS_FMT_I12;
+}
+
+/// Stream status shared between the transmit loop and the status thread.
+typedef struct lime_status {
+    lms_stream_t *stream;
+    sdr_cmd_t const *tx;
+    long stop;
+    long underflows;
+    long late_packets;
+} lime_status_t;
+
+// Report the stream status once per second, off the send path.
+static void *lime_status_thread(void *arg)
+{
+    lime_status_t *status = arg;
+    struct timespec tick  = {0, 100000000}; // 100 ms, bounds the join delay
+    sdr_thread_pin(status->tx, "status");
+
+    for (unsigned ticks = 1; !ATOMIC_LOAD(status->stop); ++ticks) {
+        nanosleep(&tick, NULL);
+        if (ticks % 10) {
+            continue;
+        }
+        lms_stream_status_t stream_status;
+        if (LMS_GetStreamStatus(status->stream, &stream_status)) {
+            continue;
+        }
+        // the counters are reset on each read
+        ATOMIC_ADD(status->underflows, (long)stream_status.underrun);
+        ATOMIC_ADD(status->late_packets, (long)stream_status.droppedPackets);
+        fprintf(stderr, "TX rate:%lf MB/s, FIFO %u of %u\n", stream_status.linkRate / 1e6, stream_status.fifoFilledCount, stream_status.fifoSize);
+    }
+
+    return NULL;
+}
+
 int lime_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 {
     if (!tx) return -1;
@@ -194,17 +247,46 @@ int lime_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
         return ret;
     }
 
-    tx->output_format = "CS16";
-    tx->fullScale     = 2048.0; // LSB aligned 12-bit
+    if (tx->output_format && !strcmp(tx->output_format, "CF32")) {
+        tx->fullScale = 1.0; // F32
+    }
+    else if (tx->output_format && !strcmp(tx->output_format, "CS16")) {
+        tx->fullScale = sdr_format_full_scale("CS16"); // I16
+    }
+    else {
+        if (tx->output_format) {
+            fprintf(stderr, "WARNING: Output format %s not supported, using CS16 with 12-bit samples\n", tx->output_format);
+        }
+        tx->output_format = "CS16";
+        tx->fullScale     = 2048.0; // I12, LSB aligned 12-bit
+    }
 
     return 0;
 }
 
+static unsigned lime_gain_value(char const *gain_str)
+{
+    double gain = 0.0;
+    if (gain_str && *gain_str)
+        gain = strtod(gain_str, NULL);
+
+    // TX gain is [-12.0; 64.0]
+    // "PAD": [0.0; 52.0]
+    // "IAMP": [-12.0; 12.0]
+    if (gain < -12.0) {
+        gain = -12.0;
+    }
+    if (gain > 64.0) {
+        gain = 64.0;
+    }
+    fprintf(stderr, "Using gain %.0f dB\n", gain);
+    return (unsigned)(gain + 12.5); // [0; 76]
+}
+
 int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 {
     if (!tx) return -1;
 
-    double gain = 0.0;
     unsigned gain_value;
     int32_t antenna = DEFAULT_ANTENNA;
     size_t channel = tx->channel;
@@ -212,32 +294,79 @@ int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     double tx_frequency = tx->center_frequency;
     double tx_bandwidth = tx->bandwidth;
 
-    if (tx->gain_str && *tx->gain_str)
-        gain = strtod(tx->gain_str, NULL);
     if (tx->antenna && *tx->antenna)
         antenna = (int32_t)strtol(tx->antenna, NULL, 0);
 
-    // TX gain is [-12.0; 64.0]
-    // "PAD": [0.0; 52.0]
-    // "IAMP": [-12.0; 12.0]
-    if (gain < -12.0) {
-        gain = -12.0;
+    gain_value = lime_gain_value(tx->gain_str);
+
+    // extra channels share the TX LO and sample clock, each has its own gain and stream
+    size_t nch = 1 + tx->channels_len;
+    if (nch > MAX_TX_CHANNELS) {
+        fprintf(stderr, "Only %d channels supported\n", MAX_TX_CHANNELS);
+        return -1;
     }
-    if (gain > 64.0) {
-        gain = 64.0;
+    size_t chans[MAX_TX_CHANNELS];
+    unsigned gains[MAX_TX_CHANNELS];
+    for (size_t c = 1; c < nch; ++c) {
+        sdr_cmd_t *ch = tx->channels[c - 1];
+        chans[c]      = ch->channel;
+        gains[c]      = ch->gain_str ? lime_gain_value(ch->gain_str) : gain_value;
+        if (ch->center_frequency > 0.0 && ch->center_frequency != tx_frequency) {
+            fprintf(stderr, "WARNING: Channel %zu shares the TX LO, using %.0f Hz\n", chans[c], tx_frequency);
+        }
     }
-    gain_value = (unsigned)(gain + 12.5); // [0; 76]
-    fprintf(stderr, "Using gain %.0f dB\n", gain);
 
     lms_device_t *device = (lms_device_t *)sdr_dev->device;
 
-    int ret = LMS_Reset(device);
-    if (ret) {
-        fprintf(stderr, "LMS_Reset %d(%s)\n", ret, LMS_GetLastErrorMessage());
+    if (!sdr_dev->priv) {
+        sdr_dev->priv = calloc(1, sizeof(lime_state_t));
     }
-    ret = LMS_Init(device);
-    if (ret) {
-        fprintf(stderr, "LMS_Init %d(%s)\n", ret, LMS_GetLastErrorMessage());
+    lime_state_t *state = sdr_dev->priv;
+
+    // calibration holds for a device, channel, LO band, bandwidth, gain, and sample rate
+    char config_key[128];
+    lms_dev_info_t const *info = LMS_GetDeviceInfo(device);
+    int key_len = snprintf(config_key, sizeof(config_key), "lime_%llx_ch%zu_%.0fMHz_bw%.0f_g%u_sr%.0f",
+            info ? (unsigned long long)info->boardSerialNumber : 0ULL, channel,
+            floor(tx_frequency / 1e6), tx_bandwidth, gain_value, sampleRate);
+    for (size_t c = 1; c < nch && key_len > 0 && (size_t)key_len < sizeof(config_key); ++c) {
+        key_len += snprintf(&config_key[key_len], sizeof(config_key) - (size_t)key_len, "_ch%zu_g%u", chans[c], gains[c]);
+    }
+    if (key_len > 0 && (size_t)key_len < sizeof(config_key)) {
+        snprintf(&config_key[key_len], sizeof(config_key) - (size_t)key_len, ".ini");
+    }
+
+    int ret;
+    int calibrated = state && !strcmp(state->config_key, config_key);
+    char *cache_path = NULL;
+    if (calibrated) {
+        fprintf(stderr, "Device already configured, skipping reset and calibration\n");
+    }
+    else {
+        if (state) {
+            state->config_key[0] = '\0';
+        }
+        cache_path = sdr_cache_path(tx, config_key);
+        if (cache_path && access(cache_path, R_OK) == 0) {
+            fprintf(stderr, "Loading calibration from %s\n", cache_path);
+            ret = LMS_LoadConfig(device, cache_path);
+            if (ret) {
+                fprintf(stderr, "LMS_LoadConfig %d(%s)\n", ret, LMS_GetLastErrorMessage());
+            }
+            else {
+                calibrated = 1;
+            }
+        }
+    }
+    if (!calibrated) {
+        ret = LMS_Reset(device);
+        if (ret) {
+            fprintf(stderr, "LMS_Reset %d(%s)\n", ret, LMS_GetLastErrorMessage());
+        }
+        ret = LMS_Init(device);
+        if (ret) {
+            fprintf(stderr, "LMS_Init %d(%s)\n", ret, LMS_GetLastErrorMessage());
+        }
     }
 
     ret = LMS_GetNumChannels(device, LMS_CH_TX);
@@ -250,6 +379,19 @@ int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
         channel = 0;
     }
     fprintf(stderr, "Using channel %zu\n", channel);
+    chans[0] = channel;
+    gains[0] = gain_value;
+    for (size_t c = 1; c < nch; ++c) {
+        int valid = chans[c] < channel_count;
+        for (size_t d = 0; d < c; ++d) {
+            valid = valid && chans[c] != chans[d];
+        }
+        if (!valid) {
+            fprintf(stderr, "Invalid or duplicate extra channel %zu\n", chans[c]);
+            return -1;
+        }
+        fprintf(stderr, "Using extra channel %zu\n", chans[c]);
+    }
 
     int antenna_count = LMS_GetAntennaList(device, LMS_CH_TX, channel, NULL);
     fprintf(stderr, "TX%zu Channel has %d antenna(ae)\n", channel, antenna_count);
@@ -272,13 +414,19 @@ int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     }
     // LMS_SetAntenna(device, LMS_CH_TX, channel, antenna); // SetLOFrequency should take care of selecting the proper antenna
 
-    ret = LMS_SetGaindB(device, LMS_CH_TX, channel, gain_value);
-    if (ret) {
-        fprintf(stderr, "LMS_SetGaindB %d(%s)\n", ret, LMS_GetLastErrorMessage());
+    for (size_t c = 0; c < nch; ++c) {
+        ret = LMS_SetGaindB(device, LMS_CH_TX, chans[c], gains[c]);
+        if (ret) {
+            fprintf(stderr, "LMS_SetGaindB %d(%s)\n", ret, LMS_GetLastErrorMessage());
+        }
     }
     // Disable all other channels
     for (size_t ch = 0; ch < channel_count; ++ch) {
-        if (ch != channel) {
+        int used = 0;
+        for (size_t c = 0; c < nch; ++c) {
+            used = used || chans[c] == ch;
+        }
+        if (!used) {
             LMS_EnableChannel(device, LMS_CH_TX, ch, false);
         }
     }
@@ -289,8 +437,10 @@ int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
             LMS_EnableChannel(device, LMS_CH_RX, ch, false);
         }
     }
-    // Enable our Tx channel
-    LMS_EnableChannel(device, LMS_CH_TX, channel, true);
+    // Enable our Tx channels
+    for (size_t c = 0; c < nch; ++c) {
+        LMS_EnableChannel(device, LMS_CH_TX, chans[c], true);
+    }
 
     ret = LMS_SetLOFrequency(device, LMS_CH_TX, channel, tx_frequency);
     if (ret) {
@@ -340,42 +490,114 @@ int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
         fprintf(stderr, "actualRate %lf (Host) / %lf (RF)\n", actualHostSampleRate, actualRFSampleRate);
     }
 
-    fprintf(stderr, "Calibrating...\n");
-    ret = LMS_Calibrate(device, LMS_CH_TX, channel, tx_bandwidth, 0);
-    if (ret) {
-        fprintf(stderr, "LMS_Calibrate=%d(%s)\n", ret, LMS_GetLastErrorMessage());
+    if (!calibrated) {
+        fprintf(stderr, "Calibrating...\n");
+        for (size_t c = 1; c < nch; ++c) {
+            ret = LMS_Calibrate(device, LMS_CH_TX, chans[c], tx_bandwidth, 0);
+            if (ret) {
+                fprintf(stderr, "LMS_Calibrate(ch%zu)=%d(%s)\n", chans[c], ret, LMS_GetLastErrorMessage());
+            }
+        }
+        ret = LMS_Calibrate(device, LMS_CH_TX, channel, tx_bandwidth, 0);
+        if (ret) {
+            fprintf(stderr, "LMS_Calibrate=%d(%s)\n", ret, LMS_GetLastErrorMessage());
+        }
+        else {
+            calibrated = 1;
+            if (cache_path) {
+                ret = LMS_SaveConfig(device, cache_path);
+                if (ret) {
+                    fprintf(stderr, "LMS_SaveConfig %d(%s)\n", ret, LMS_GetLastErrorMessage());
+                }
+                else {
+                    fprintf(stderr, "Saved calibration to %s\n", cache_path);
+                }
+            }
+        }
+    }
+    if (calibrated && state) {
+        snprintf(state->config_key, sizeof(state->config_key), "%s", config_key);
     }
+    free(cache_path);
 
     fprintf(stderr, "Setup TX stream...\n");
-    lms_stream_t tx_stream = {.channel = (uint32_t)channel, .fifoSize = 1024*1024, .throughputVsLatency = 0.5, .isTx = true, .dataFmt = LMS_FMT_I12};
-    ret = LMS_SetupStream(device, &tx_stream);
-    if (ret) {
-        fprintf(stderr, "LMS_SetupStream=%d(%s)\n", ret, LMS_GetLastErrorMessage());
+    int data_format = lime_data_format(tx);
+    float latency   = 0.5f; // balanced
+    if (tx->latency_mode == 1) {
+        latency = 0.0f; // favour low latency
+    }
+    else if (tx->latency_mode == 2) {
+        latency = 1.0f; // favour throughput
+    }
+    uint32_t fifo_size = tx->fifo_size ? (uint32_t)tx->fifo_size : DEFAULT_FIFO_SIZE;
+    fprintf(stderr, "Using %s samples, FIFO size %u, latency %.1f\n",
+            data_format == LMS_FMT_F32 ? "F32" : data_format == LMS_FMT_I16 ? "I16" : "I12", fifo_size, (double)latency);
+    // one stream per channel, sent with the same timestamps
+    lms_stream_t tx_streams[MAX_TX_CHANNELS] = {0};
+    for (size_t c = 0; c < nch; ++c) {
+        tx_streams[c] = (lms_stream_t){.channel = (uint32_t)chans[c], .fifoSize = fifo_size, .throughputVsLatency = latency, .isTx = true};
+        tx_streams[c].dataFmt = data_format;
+        ret = LMS_SetupStream(device, &tx_streams[c]);
+        if (ret) {
+            fprintf(stderr, "LMS_SetupStream=%d(%s)\n", ret, LMS_GetLastErrorMessage());
+        }
+    }
+    lms_stream_t *tx_stream = &tx_streams[0];
+
+    size_t sample_size = data_format == LMS_FMT_F32 ? 2 * sizeof(float) : 2 * sizeof(int16_t);
+    uint8_t *sampleBuffer = malloc(nch * tx->block_size * sample_size);
+    void *sampleBuffers[MAX_TX_CHANNELS];
+    for (size_t c = 0; c < nch; ++c) {
+        sampleBuffers[c] = sampleBuffer + c * tx->block_size * sample_size;
+    }
+
+    for (size_t c = 0; c < nch; ++c) {
+        LMS_StartStream(&tx_streams[c]);
     }
 
-    //tx->block_size = (size_t)sampleRate / 100;
-    size_t bufs_per_s = (size_t)sampleRate / tx->block_size;
-    if (bufs_per_s < 1) {
-        bufs_per_s = 1;
+    // wait for other devices, then schedule the first sample
+    if (tx->start_cb) {
+        tx->start_cb(tx->start_ctx);
+    }
+    if (tx->time_source) {
+        fprintf(stderr, "WARNING: Time source %s not supported, using the stream timestamp\n", tx->time_source);
+    }
+    lms_stream_meta_t meta = {0};
+    if (tx->initial_delay) {
+        lms_stream_status_t stream_status = {0};
+        LMS_GetStreamStatus(tx_stream, &stream_status);
+        meta.timestamp        = stream_status.timestamp + (uint64_t)(sampleRate * tx->initial_delay / 1000.0);
+        meta.waitForTimestamp = true;
+        fprintf(stderr, "Scheduling first sample at timestamp %llu\n", (unsigned long long)meta.timestamp);
     }
-    int16_t *sampleBuffer = malloc(tx->block_size * 2 * sizeof(int16_t));
 
-    LMS_StartStream(&tx_stream);
+    // poll stream status asynchronously, the loop below only fills and sends
+    lime_status_t status = {.stream = tx_stream, .tx = tx};
+    pthread_t status_thread;
+    int status_running = pthread_create(&status_thread, NULL, lime_status_thread, &status) == 0;
+    if (!status_running) {
+        fprintf(stderr, "WARNING: Failed to start stream status thread\n");
+    }
+    long seen_underflows = 0;
 
-    size_t loop = 0;
     size_t n_written = 0;
+    if (tx->hops_len) {
+        fprintf(stderr, "WARNING: No timed commands, hops are retuned untimed and will not land on sample boundaries\n");
+    }
     while (!tx->flag_abort) {
+        sdr_hop_t const *hop = sdr_hop_next(tx);
+        if (hop) {
+            ret = LMS_SetLOFrequency(device, LMS_CH_TX, channel, hop->frequency);
+            if (ret) {
+                fprintf(stderr, "LMS_SetLOFrequency(%lf)=%d(%s)\n", hop->frequency, ret, LMS_GetLastErrorMessage());
+            }
+            if (hop->gain_str) {
+                LMS_SetGaindB(device, LMS_CH_TX, channel, lime_gain_value(hop->gain_str));
+            }
+        }
+
         size_t n_samps = 0;
         ssize_t n_read = sdr_input_read(sdr_ctx, tx, sampleBuffer, &n_samps, tx->fullScale);
-        loop++;
-        if (n_read < 0 || 0 == (loop % bufs_per_s)) {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            fprintf(stderr, "gettimeofday()=> %ld:%06ld ; ", tv.tv_sec, (long)tv.tv_usec);
-            lms_stream_status_t status;
-            LMS_GetStreamStatus(&tx_stream, &status); //Obtain TX stream stats
-            fprintf(stderr, "TX rate:%lf MB/s\n", status.linkRate / 1e6);
-        }
         if (n_read < 0) {
             fprintf(stderr, "Input end\n");
             break; // EOF
@@ -384,22 +606,56 @@ int lime_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
             continue; // retry
         }
 
-        ret = LMS_SendStream(&tx_stream, sampleBuffer, n_samps, NULL, 1000);
+        // flush TX buffer?
+        meta.flushPartialPacket = n_samps < tx->block_size;
+        if (nch > 1) {
+            sdr_input_read_channels(sdr_ctx, tx, sampleBuffers, n_samps);
+            for (size_t c = 1; c < nch; ++c) {
+                ret = LMS_SendStream(&tx_streams[c], sampleBuffers[c], n_samps, &meta, 1000);
+                if (ret < 0) {
+                    fprintf(stderr, "LMS_SendStream(ch%zu) %d(%s)\n", chans[c], ret, LMS_GetLastErrorMessage());
+                }
+            }
+        }
+        ret = LMS_SendStream(tx_stream, sampleBuffer, n_samps, &meta, 1000);
         if (ret < 0) {
             fprintf(stderr, "LMS_SendStream %d(%s)\n", ret, LMS_GetLastErrorMessage());
         }
         else {
             n_written += (size_t)ret;
+            meta.timestamp += (uint64_t)ret;
+        }
+
+        long underflows = ATOMIC_LOAD(status.underflows);
+        if (underflows != seen_underflows) {
+            seen_underflows = underflows;
+            fprintf(stderr, "U");
+            fflush(stderr);
         }
     }
     fprintf(stderr, "%zu samples written\n", n_written);
+
+    if (status_running) {
+        ATOMIC_STORE(status.stop, 1);
+        pthread_join(status_thread, NULL);
+    }
+    tx->samples_written = n_written;
+    tx->underflows      = (unsigned)ATOMIC_LOAD(status.underflows);
+    tx->late_packets    = (unsigned)ATOMIC_LOAD(status.late_packets);
+    fprintf(stderr, "%u underflows, %u late packets\n", tx->underflows, tx->late_packets);
+
     fprintf(stderr, "Release TX stream...\n");
 
-    LMS_StopStream(&tx_stream);
-    LMS_DestroyStream(device, &tx_stream);
+    for (size_t c = 0; c < nch; ++c) {
+        LMS_StopStream(&tx_streams[c]);
+        LMS_DestroyStream(device, &tx_streams[c]);
+    }
 
     free(sampleBuffer);
 
+    for (size_t c = 1; c < nch; ++c) {
+        LMS_EnableChannel(device, LMS_CH_TX, chans[c], false);
+    }
     ret = LMS_EnableChannel(device, LMS_CH_TX, channel, false);
 
     return ret;
@@ -0,0 +1,370 @@
+/** @file
+    tx_tools - Null SDR backend, a virtual device for testing without hardware.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdr_backend.h"
+
+#define DEFAULT_FIFO_BLOCKS 8 ///< simulated FIFO size in blocks, unless set
+
+/*
+    "null:[options]" discards all samples, "file:path[,options]" records
+    them to a file ("-" for stdout) in the output format.
+    Options are comma separated:
+    - pace: accept samples no faster than the sample rate
+    - fifo=N: simulated FIFO size in samples, underflows are counted when it runs empty
+    - format=F: output format, e.g. CU8, CS8, CS12, CS16 (default), CF32
+    Extra channels are recorded interleaved by sample.
+*/
+
+/// Options of a virtual device.
+typedef struct null_cfg {
+    char *path;       ///< record to this file, NULL to discard
+    int pace;         ///< pace writes at the sample rate
+    size_t fifo_size; ///< simulated FIFO size in samples, 0 for default
+    char format[8];   ///< output format, empty for default
+} null_cfg_t;
+
+static int parse_args(char const *args, null_cfg_t *cfg)
+{
+    if (!strncmp(args, "file:", 5)) {
+        args += 5;
+        size_t len = strcspn(args, ",");
+        if (!len) {
+            fprintf(stderr, "Missing path in file device \"file:\"\n");
+            return -1;
+        }
+        cfg->path = strndup(args, len);
+        args += len;
+    }
+    else if (!strncmp(args, "null:", 5)) {
+        args += 5;
+    }
+
+    while (*args) {
+        if (*args == ',') {
+            args++;
+            continue;
+        }
+        char opt[64];
+        size_t len = strcspn(args, ",");
+        snprintf(opt, sizeof(opt), "%.*s", (int)len, args);
+        args += len;
+
+        char *val = strchr(opt, '=');
+        if (val) {
+            *val++ = '\0';
+        }
+        if (!strcmp(opt, "pace")) {
+            cfg->pace = val ? atoi(val) : 1;
+        }
+        else if (!strcmp(opt, "fifo") && val) {
+            cfg->fifo_size = (size_t)strtoul(val, NULL, 10);
+        }
+        else if (!strcmp(opt, "format") && val) {
+            snprintf(cfg->format, sizeof(cfg->format), "%s", val);
+        }
+        else {
+            fprintf(stderr, "Unknown null device option: %s\n", opt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static double elapsed_s(struct timespec const *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void sleep_until(struct timespec const *start, double t)
+{
+    double wait = t - elapsed_s(start);
+    if (wait <= 0.0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec  = (time_t)wait;
+    ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+int null_enum_devices(sdr_ctx_t *sdr_ctx, char const *enum_args)
+{
+    null_cfg_t *cfg = calloc(1, sizeof(*cfg));
+    if (!cfg) {
+        fprintf(stderr, "calloc() failed\n");
+        return -1;
+    }
+    if (parse_args(enum_args, cfg)) {
+        free(cfg->path);
+        free(cfg);
+        return -1;
+    }
+
+    sdr_dev_t *sdr_dev = sdr_ctx_add_device(sdr_ctx);
+    if (!sdr_dev) {
+        free(cfg->path);
+        free(cfg);
+        return -1;
+    }
+
+    char desc[1024];
+    if (cfg->path) {
+        snprintf(desc, sizeof(desc), "Virtual device, records to %s", cfg->path);
+    }
+    else {
+        snprintf(desc, sizeof(desc), "Virtual device, discards all samples");
+    }
+
+    sdr_dev->backend             = "null";
+    sdr_dev->dev_kwargs          = strdup(enum_args);
+    sdr_dev->context_name        = strdup(cfg->path ? "file" : "null");
+    sdr_dev->context_description = strdup(desc);
+    sdr_dev->driver_key          = "null";
+    sdr_dev->hardware_key        = cfg->path ? "file" : "null";
+    sdr_dev->priv                = cfg;
+
+    fprintf(stderr, "* %s\n", desc);
+
+    return 0;
+}
+
+int null_release_device(sdr_dev_t *sdr_dev)
+{
+    if (!sdr_dev || !sdr_dev->backend || strcmp(sdr_dev->backend, "null")) {
+        return -1;
+    }
+
+    FILE *out = sdr_dev->device;
+    if (!out) {
+        return 0;
+    }
+    sdr_dev->device = NULL;
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
+
+int null_acquire_device(sdr_dev_t *sdr_dev)
+{
+    if (!sdr_dev || !sdr_dev->backend || strcmp(sdr_dev->backend, "null")) {
+        return -1;
+    }
+    null_cfg_t *cfg = sdr_dev->priv;
+    if (sdr_dev->device || !cfg->path) {
+        return 0;
+    }
+
+    FILE *out = !strcmp(cfg->path, "-") ? stdout : fopen(cfg->path, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s (%s)\n", cfg->path, strerror(errno));
+        return -1;
+    }
+
+    sdr_dev->device = out;
+    return 0;
+}
+
+int null_free_device(sdr_dev_t *sdr_dev)
+{
+    if (!sdr_dev || !sdr_dev->backend || strcmp(sdr_dev->backend, "null")) {
+        return -1;
+    }
+
+    null_release_device(sdr_dev);
+    sdr_dev->backend = NULL;
+    null_cfg_t *cfg  = sdr_dev->priv;
+    if (cfg) {
+        free(cfg->path);
+        free(cfg);
+        sdr_dev->priv = NULL;
+    }
+    free(sdr_dev->dev_kwargs);
+    free(sdr_dev->context_name);
+    free(sdr_dev->context_description);
+
+    return 0;
+}
+
+int null_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
+{
+    if (!tx) return -1;
+    if (!sdr_dev) return -1;
+
+    int ret = null_acquire_device(sdr_dev);
+    if (ret) {
+        return ret;
+    }
+    null_cfg_t *cfg = sdr_dev->priv;
+
+    // any convertible format is accepted
+    if (!tx->output_format) {
+        tx->output_format = *cfg->format ? cfg->format : "CS16";
+    }
+    tx->fullScale = sdr_format_full_scale(tx->output_format);
+    if (tx->fullScale <= 0.0) {
+        fprintf(stderr, "Unsupported output format: %s\n", tx->output_format);
+        return -1;
+    }
+    tx->sample_shift = 0;
+
+    if (cfg->pace && tx->sample_rate <= 0.0) {
+        fprintf(stderr, "Pacing needs a sample rate.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int null_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
+{
+    if (!tx) return -1;
+
+    null_cfg_t *cfg    = sdr_dev->priv;
+    FILE *out          = sdr_dev->device;
+    size_t sample_size = sdr_format_sample_size(tx->output_format);
+    size_t fifo_size   = cfg->fifo_size ? cfg->fifo_size : tx->fifo_size ? tx->fifo_size : DEFAULT_FIFO_BLOCKS * tx->block_size;
+    double sample_rate = tx->sample_rate;
+    size_t nch         = 1 + tx->channels_len;
+
+    // one buffer per channel, and one to interleave them
+    uint8_t *buf   = malloc(2 * nch * tx->block_size * sample_size);
+    void **bufs    = calloc(nch, sizeof(*bufs));
+    uint8_t *ilbuf = buf ? &buf[nch * tx->block_size * sample_size] : NULL;
+    if (!buf || !bufs) {
+        fprintf(stderr, "malloc() failed\n");
+        free(buf);
+        free(bufs);
+        return -1;
+    }
+    for (size_t ch = 0; ch < nch; ++ch) {
+        bufs[ch] = &buf[ch * tx->block_size * sample_size];
+    }
+    if (tx->channels_len) {
+        fprintf(stderr, "Streaming %zu channels\n", nch);
+    }
+
+    if (cfg->pace) {
+        fprintf(stderr, "Pacing at %.0f S/s with a FIFO of %zu samples\n", sample_rate, fifo_size);
+    }
+
+    // wait for other devices
+    if (tx->start_cb) {
+        tx->start_cb(tx->start_ctx);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the simulated FIFO runs empty at fifo_end, in seconds since start
+    double fifo_end     = tx->initial_delay / 1000.0;
+    int ret             = 0;
+    size_t n_written    = 0;
+    unsigned underflows = 0;
+
+    fprintf(stderr, "* Transmit starts...\n");
+    while (!tx->flag_abort) {
+        sdr_hop_t const *hop = sdr_hop_next(tx);
+        if (hop) {
+            fprintf(stderr, "Hop to %.0f Hz at sample %zu\n", hop->frequency, n_written);
+        }
+
+        size_t n_samps = 0;
+        ssize_t n_read = sdr_input_read(sdr_ctx, tx, buf, &n_samps, tx->fullScale);
+
+        if (n_read < 0) {
+            fprintf(stderr, "Input end\n");
+            break; // EOF
+        }
+        if (n_read == 0) {
+            continue; // retry
+        }
+
+        uint8_t *wbuf  = buf;
+        size_t w_samps = n_samps;
+        if (tx->channels_len) {
+            sdr_input_read_channels(sdr_ctx, tx, bufs, n_samps);
+            for (size_t k = 0; k < n_samps; ++k) {
+                for (size_t ch = 0; ch < nch; ++ch) {
+                    memcpy(&ilbuf[(k * nch + ch) * sample_size], (uint8_t *)bufs[ch] + k * sample_size, sample_size);
+                }
+            }
+            wbuf    = ilbuf;
+            w_samps = n_samps * nch;
+        }
+
+        if (out && fwrite(wbuf, sample_size, w_samps, out) != w_samps) {
+            fprintf(stderr, "Error writing to %s (%s)\n", cfg->path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        n_written += n_samps;
+
+        if (cfg->pace) {
+            double now = elapsed_s(&start);
+            if (fifo_end < now) {
+                if (n_written > n_samps) {
+                    underflows++;
+                    fprintf(stderr, "U");
+                }
+                fifo_end = now;
+            }
+            fifo_end += n_samps / sample_rate;
+            // block while the FIFO is full
+            sleep_until(&start, fifo_end - fifo_size / sample_rate);
+        }
+    }
+
+    if (cfg->pace && !tx->flag_abort) {
+        sleep_until(&start, fifo_end); // drain
+    }
+    if (out) {
+        fflush(out);
+    }
+
+    double elapsed = elapsed_s(&start);
+    fprintf(stderr, "%zu samples written in %.3f s (%.3f MS/s)\n", n_written, elapsed, elapsed > 0.0 ? n_written / elapsed / 1e6 : 0.0);
+    if (underflows) {
+        fprintf(stderr, "%u underflows\n", underflows);
+    }
+    tx->samples_written = n_written;
+    tx->underflows      = underflows;
+    tx->late_packets    = 0;
+    fprintf(stderr, "* Transmit ended.\n");
+
+    free(bufs);
+    free(buf);
+    return ret;
+}
+
+int null_transmit_done(sdr_cmd_t *tx)
+{
+    // ...
+
+    return 0;
+}
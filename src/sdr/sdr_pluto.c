@@ -22,6 +22,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
 
 #include <iio.h>
 #ifdef HAS_AD9361_IIO
@@ -31,6 +32,13 @@
 #include "sdr_backend.h"
 
 #define MHZ(x) ((long long)(x*1000000.0 + .5))
+#define PLUTO_MIN_RATE (25e6 / 12) ///< lowest baseband rate with the FIR bypassed
+#define PLUTO_FIR_SAFE_RATE 3000000 ///< rate to switch FIR setups at
+#define PLUTO_FIR_TAPS 32 ///< FIR taps per interpolation step, 128 taps at most
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 static char const *query_args(char const *enum_args)
 {
@@ -97,7 +105,11 @@ int pluto_enum_devices(sdr_ctx_t *sdr_ctx, char const *enum_args)
     fprintf(stderr, "* Context description: %s\n", iio_context_get_description(ctx));
 
     // assumes a single device per context and that it is a Pluto
-    sdr_dev_t *sdr_dev = &sdr_ctx->devs[sdr_ctx->devs_len++];
+    sdr_dev_t *sdr_dev = sdr_ctx_add_device(sdr_ctx);
+    if (!sdr_dev) {
+        iio_context_destroy(ctx);
+        return -1;
+    }
 
     sdr_dev->backend             = "pluto";
     sdr_dev->device              = ctx;
@@ -190,10 +202,80 @@ int pluto_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 
     tx->output_format = "CS16";
     tx->fullScale     = 32768.0; // MSB aligned 12-bit
+    tx->sample_shift  = 4;       // rendered inputs are quantized to 12-bit
 
     return 0;
 }
 
+static double pluto_gain_db(char const *gain_str)
+{
+    double gain_db;
+    if (!gain_str || !*gain_str) {
+        gain_db = -20.0;
+    } else {
+        if (!strncmp(gain_str, "PGA=", 4))
+            gain_str = &gain_str[4];
+        gain_db = atof(gain_str);
+        // IIO TX gain is attenuation [0; -89.75]
+        // flip and clamp to match Soapy
+        if (gain_db >= 0)
+            gain_db = gain_db - 89.0;
+    }
+    // phy_chn "hardwaregain_available" value: [-89.750000 0.250000 0.000000]
+    if (gain_db > 0.0) gain_db = 0.0;
+    if (gain_db < -89.0) gain_db = -89.0;
+    return gain_db;
+}
+
+#ifndef HAS_AD9361_IIO
+// Load an interpolation FIR into the AD9361, fir_int of 2 or 4, or 0 to turn the FIR off.
+// libad9361 does this itself with ad9361_set_bb_rate().
+static int pluto_set_fir(struct iio_device *phydev, struct iio_channel *phy_chn, int fir_int)
+{
+    // the FIR setting is per device and persists, a previous transmit may have left it on
+    struct iio_channel *fir_chn = iio_device_find_channel(phydev, "out", false);
+    iio_channel_attr_write_bool(fir_chn, "voltage_filter_fir_en", false);
+    if (!fir_int) {
+        return 0;
+    }
+
+    // without the FIR low rates are invalid, move to a rate that works either way
+    long long rate = 0;
+    iio_channel_attr_read_longlong(phy_chn, "sampling_frequency", &rate);
+    if (rate < PLUTO_MIN_RATE) {
+        iio_channel_attr_write_longlong(phy_chn, "sampling_frequency", PLUTO_FIR_SAFE_RATE);
+    }
+
+    // Blackman windowed sinc at the FIR output rate, -6 dB at half the baseband rate;
+    // TX needs a gain of fir_int for the zeros stuffed in, RX (unused) gets unity
+    int taps   = PLUTO_FIR_TAPS * fir_int;
+    double fc  = 0.5 / fir_int;
+    size_t len = 64 + (size_t)taps * 16;
+    char *cfg  = malloc(len);
+    if (!cfg) {
+        fprintf(stderr, "malloc() failed\n");
+        return -1;
+    }
+    int pos = snprintf(cfg, len, "RX 3 GAIN 0 DEC %d\nTX 3 GAIN 0 INT %d\n", fir_int, fir_int);
+    for (int j = 0; j < taps; ++j) {
+        double t = j - (taps - 1) / 2.0;
+        double w = 0.42 - 0.5 * cos(2.0 * M_PI * j / (taps - 1)) + 0.08 * cos(4.0 * M_PI * j / (taps - 1));
+        double h = sin(2.0 * M_PI * fc * t) / (M_PI * t) * w;
+        int c    = (int)lround(h * fir_int * 32767.0);
+        pos += snprintf(&cfg[pos], len - (size_t)pos, "%d,%d\n", c, (int)lround(h * 32767.0));
+    }
+
+    ssize_t r = iio_device_attr_write_raw(phydev, "filter_fir_config", cfg, (size_t)pos);
+    free(cfg);
+    if (r < 0 || iio_channel_attr_write_bool(fir_chn, "voltage_filter_fir_en", true) < 0) {
+        fprintf(stderr, "Failed to load the TX FIR.\n");
+        return -1;
+    }
+    fprintf(stderr, "Loaded a %d tap FIR interpolating by %d\n", taps, fir_int);
+    return 0;
+}
+#endif
+
 int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 {
     if (!tx) return -1;
@@ -214,9 +296,14 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     struct iio_channel *tx0_q = NULL;
     struct iio_buffer *tx_buffer = NULL;
 
+    if (tx->channels_len) {
+        fprintf(stderr, "WARNING: Extra channels not supported, transmitting on one channel only\n");
+    }
+
     // TX stream default config
     cfg_fs_hz = (long long)tx->sample_rate;
     int interpolation = false;
+    int fir_int = 0; // FIR interpolation, 0 for bypass
     // The minimum sampling rate that can be set without enabling the decimation/interpolation of the FIRs is 2.083 MSPS,
     // the minimum ADC rate is 25 MHz and the maximum decimation of the half band filters is 12.
     /*
@@ -228,16 +315,20 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     iio_attr --auto -d ad9361-phy tx_path_rates
     iio_attr --auto -o -c ad9361-phy voltage0 sampling_frequency [<rate>]
     iio_attr --auto -o -c cf-ad9361-dds-core-lpc voltage0 sampling_frequency [<rate|rate/8>]
-    will accept lower rates (down to 25M/48 and 25M/48/8) but those will enable FIR and probably not work without loading a FIR.
+    will accept lower rates (down to 25M/48 and 25M/48/8) but those need a FIR loaded.
+    Down to 25M/48 = 520.833kSps we stream at the native rate and load a FIR interpolating by 2 or 4,
+    below that the FPGA scales by 8 as well, down to 25M/48/8 = 65.104kSps.
     */
-    if (cfg_fs_hz < (25e6 / 12)) {
-        if (cfg_fs_hz * 8 < (25e6 / 12)) {
-            fprintf(stderr, "Error low sample rate needs FIR and is not supported.\n");
-            return -1;
+    if (cfg_fs_hz < PLUTO_MIN_RATE) {
+        if (cfg_fs_hz * 4 < PLUTO_MIN_RATE) {
+            if (cfg_fs_hz * 8 * 4 < PLUTO_MIN_RATE) {
+                fprintf(stderr, "Error sample rate below %.0f is not supported.\n", PLUTO_MIN_RATE / 4 / 8);
+                return -1;
+            }
+            interpolation = true;
+            cfg_fs_hz = cfg_fs_hz * 8;
         }
-
-        interpolation = true;
-        cfg_fs_hz = cfg_fs_hz * 8;
+        fir_int = cfg_fs_hz >= PLUTO_MIN_RATE ? 0 : cfg_fs_hz * 2 >= PLUTO_MIN_RATE ? 2 : 4;
     }
 
     cfg_lo_hz = (long long)tx->center_frequency;
@@ -248,21 +339,7 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
         cfg_rfport = "A";
     }
 
-    if (!tx->gain_str || !*tx->gain_str) {
-        cfg_gain_db = -20.0;
-    } else {
-        char const *gain_str = tx->gain_str;
-        if (!strncmp(gain_str, "PGA=", 4))
-            gain_str = &gain_str[4];
-        cfg_gain_db = atof(gain_str);
-        // IIO TX gain is attenuation [0; -89.75]
-        // flip and clamp to match Soapy
-        if (cfg_gain_db >= 0)
-            cfg_gain_db = cfg_gain_db - 89.0;
-    }
-    // phy_chn "hardwaregain_available" value: [-89.750000 0.250000 0.000000]
-    if (cfg_gain_db > 0.0) cfg_gain_db = 0.0;
-    if (cfg_gain_db < -89.0) cfg_gain_db = -89.0;
+    cfg_gain_db = pluto_gain_db(tx->gain_str);
 
     cfg_bw_hz = (long long)tx->bandwidth;
     if (cfg_bw_hz <= 0) cfg_bw_hz = cfg_fs_hz;
@@ -292,6 +369,12 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     struct iio_channel* phy_chn = iio_device_find_channel(phydev, "voltage0", true);
     iio_channel_attr_write(phy_chn, "rf_port_select", cfg_rfport);
     iio_channel_attr_write_longlong(phy_chn, "rf_bandwidth", cfg_bw_hz);
+#ifndef HAS_AD9361_IIO
+    if (pluto_set_fir(phydev, phy_chn, fir_int)) {
+        ret = -1;
+        goto error_exit;
+    }
+#endif
     iio_channel_attr_write_longlong(phy_chn, "sampling_frequency", cfg_fs_hz);
     iio_channel_attr_write_double(phy_chn, "hardwaregain", cfg_gain_db);
 
@@ -316,7 +399,13 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     iio_channel_enable(tx0_q);
 
 #ifdef HAS_AD9361_IIO
-    ad9361_set_bb_rate(phydev, (unsigned long)cfg_fs_hz);
+    // designs and loads a FIR for low rates as needed
+    if (ad9361_set_bb_rate(phydev, (unsigned long)cfg_fs_hz)) {
+        fprintf(stderr, "Failed to set a baseband rate of %lld.\n", cfg_fs_hz);
+        ret = -1;
+        goto error_exit;
+    }
+    (void)fir_int; // libad9361 picks its own
 #endif
 
     fprintf(stderr, "* Creating TX buffer\n");
@@ -331,12 +420,35 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     iio_channel_attr_write_bool(
         iio_device_find_channel(phydev, "altvoltage1", true), "powerdown", false); // Turn ON TX LO
 
+    // we convert or render straight into the iio buffer, this needs interleaved I/Q of 12-bit in 16-bit
+    if (iio_buffer_step(tx_buffer) != 2 * sizeof(int16_t)) {
+        fprintf(stderr, "Unexpected TX buffer step of %zd bytes.\n", (ssize_t)iio_buffer_step(tx_buffer));
+        ret = -1;
+        goto error_exit;
+    }
     short *ptx_buffer = (short *)iio_buffer_start(tx_buffer);
 
+    // wait for other devices
+    if (tx->start_cb) {
+        tx->start_cb(tx->start_ctx);
+    }
+
     fprintf(stderr, "* Transmit starts...\n");
+    if (tx->hops_len) {
+        fprintf(stderr, "WARNING: No timed commands, hops are retuned untimed and will not land on sample boundaries\n");
+    }
     // Keep writing samples while there is more data to send and no failures have occurred.
     size_t n_written = 0;
     while (!tx->flag_abort) {
+        sdr_hop_t const *hop = sdr_hop_next(tx);
+        if (hop) {
+            iio_channel_attr_write_longlong(
+                iio_device_find_channel(phydev, "altvoltage1", true), "frequency", (long long)hop->frequency); // Set TX LO frequency
+            if (hop->gain_str) {
+                iio_channel_attr_write_double(phy_chn, "hardwaregain", pluto_gain_db(hop->gain_str));
+            }
+        }
+
         size_t n_samps = 0;
         ssize_t n_read = sdr_input_read(sdr_ctx, tx, ptx_buffer, &n_samps, tx->fullScale);
 
@@ -348,8 +460,8 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
             continue; // retry
         }
 
-        // Schedule TX buffer
-        ssize_t ntx = iio_buffer_push(tx_buffer);
+        // Schedule TX buffer, a dwell may end mid buffer
+        ssize_t ntx = n_samps < tx->block_size ? iio_buffer_push_partial(tx_buffer, n_samps) : iio_buffer_push(tx_buffer);
         if (ntx < 0) {
             fprintf(stderr, "Error pushing buf %zd\n", ntx);
             break;
@@ -359,6 +471,7 @@ int pluto_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
         }
     }
     fprintf(stderr, "%zu samples written\n", n_written);
+    tx->samples_written = n_written;
     fprintf(stderr, "* Transmit ended.\n");
 
 error_exit:
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -34,6 +35,7 @@
 #endif
 
 #include <math.h>
+#include <pthread.h>
 
 #include <SoapySDR/Version.h>
 #include <SoapySDR/Device.h>
@@ -41,6 +43,8 @@
 
 #include "sdr_backend.h"
 
+#define HOP_START_DELAY_MS 100 ///< timed start for hops, unless a delay is set
+
 #ifdef _MSC_VER
 
 //http://unixpapa.com/incnote/string.html
@@ -56,18 +60,144 @@ char * strsep(char **sp, char *sep)
 }
 #endif
 
+/// Stream status shared between the transmit loop and the status thread.
+typedef struct soapy_status {
+    SoapySDRDevice *dev;
+    SoapySDRStream *stream;
+    sdr_cmd_t const *tx;
+    long timeout_us;
+    long stop;
+    long underflows;
+    long late_packets;
+    long end_bursts;
+    long errors;
+    long unsupported; ///< set if the driver has no stream status
+} soapy_status_t;
+
+// Poll the stream status with a short timeout, off the transmit path.
+static void *soapy_status_thread(void *arg)
+{
+	soapy_status_t *status = arg;
+	sdr_thread_pin(status->tx, "status");
+
+	while (!ATOMIC_LOAD(status->stop)) {
+		size_t channel = 0;
+		int flags = 0;
+		long long timeNs = 0;
+		int r = SoapySDRDevice_readStreamStatus(status->dev, status->stream, &channel, &flags, &timeNs, status->timeout_us);
+		if (r == SOAPY_SDR_NOT_SUPPORTED) {
+			ATOMIC_STORE(status->unsupported, 1);
+			break; // nothing to poll
+		}
+		else if (r == SOAPY_SDR_TIMEOUT) {
+			continue;
+		}
+		else if (r == SOAPY_SDR_UNDERFLOW) {
+			ATOMIC_INC(status->underflows);
+		}
+		else if (r == SOAPY_SDR_TIME_ERROR) {
+			ATOMIC_INC(status->late_packets);
+		}
+		else if (r) {
+			ATOMIC_INC(status->errors);
+			fprintf(stderr, "readStreamStatus %s (%d), channel=%zu flags=%d, timeNs=%lld\n", SoapySDR_errToStr(r), r, channel, flags, timeNs);
+		}
+		if (flags & SOAPY_SDR_END_BURST) {
+			ATOMIC_INC(status->end_bursts);
+		}
+	}
+
+	return NULL;
+}
+
 // format is 3-4 chars (plus null), compare as int.
 static int is_format_equal(const void *a, const void *b)
 {
     return *(const uint32_t *)a == *(const uint32_t *)b;
 }
 
-int soapy_set_frequency(SoapySDRDevice *dev, const int direction, double frequency)
+/// Per driver settle quirks, only devices listed here pay for a fixed delay.
+typedef struct soapy_quirk {
+    char const *driver_key;
+    unsigned rate_settle_ms; ///< tune away and wait this long on a sample rate change
+} soapy_quirk_t;
+
+static soapy_quirk_t const soapy_quirks[] = {
+        // At setSampleRate the PlutoSDR will blast out garbage for 1.5s at full gain.
+        {"PlutoSDR", 1000},
+};
+
+static soapy_quirk_t const *soapy_find_quirk(SoapySDRDevice *dev)
+{
+	soapy_quirk_t const *quirk = NULL;
+	char *driver_key = SoapySDRDevice_getDriverKey(dev);
+	for (size_t i = 0; driver_key && i < sizeof(soapy_quirks) / sizeof(*soapy_quirks); ++i) {
+		if (!strcmp(driver_key, soapy_quirks[i].driver_key)) {
+			quirk = &soapy_quirks[i];
+		}
+	}
+	free(driver_key);
+	return quirk;
+}
+
+static void soapy_sleep_ms(unsigned ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static int has_string(char **list, size_t len, char const *str)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (!strcmp(list[i], str)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/// Wait for a boolean sensor, e.g. "lo_locked", to read true.
+/// Returns 0 when ready, 1 if there is no such sensor, -1 on timeout.
+static int soapy_wait_sensor(SoapySDRDevice *dev, const int direction, char const *key, unsigned timeout_ms)
+{
+	size_t len = 0;
+	char **sensors = SoapySDRDevice_listChannelSensors(dev, direction, 0, &len);
+	int channel_sensor = has_string(sensors, len, key);
+	SoapySDRStrings_clear(&sensors, len);
+	if (!channel_sensor) {
+		sensors = SoapySDRDevice_listSensors(dev, &len);
+		int global_sensor = has_string(sensors, len, key);
+		SoapySDRStrings_clear(&sensors, len);
+		if (!global_sensor) {
+			return 1;
+		}
+	}
+
+	for (unsigned ms = 0;; ++ms) {
+		char *val = channel_sensor ? SoapySDRDevice_readChannelSensor(dev, direction, 0, key) : SoapySDRDevice_readSensor(dev, key);
+		int ready = val && !strcmp(val, "true");
+		free(val);
+		if (ready) {
+			fprintf(stderr, "Sensor %s ready after %u ms\n", key, ms);
+			return 0;
+		}
+		if (ms >= timeout_ms) {
+			fprintf(stderr, "WARNING: Sensor %s not ready after %u ms\n", key, ms);
+			return -1;
+		}
+		soapy_sleep_ms(1);
+	}
+}
+
+int soapy_set_frequency(SoapySDRDevice *dev, const int direction, size_t channel, double frequency)
 {
 	int r;
 
 	SoapySDRKwargs args = {0};
-	r = SoapySDRDevice_setFrequency(dev, direction, 0, frequency, &args);
+	r = SoapySDRDevice_setFrequency(dev, direction, channel, frequency, &args);
 	if (r != 0) {
 		fprintf(stderr, "WARNING: Failed to set center freq.\n");
 	} else {
@@ -107,7 +237,7 @@ int soapy_set_bandwidth(SoapySDRDevice *dev, const int direction, double bandwid
 	return r;
 }
 
-int soapy_gain_str_set(SoapySDRDevice *dev, char const *gain_str)
+int soapy_gain_str_set(SoapySDRDevice *dev, size_t channel, char const *gain_str)
 {
 	SoapySDRKwargs args = {0};
 	int r = 0;
@@ -129,7 +259,7 @@ int soapy_gain_str_set(SoapySDRDevice *dev, char const *gain_str)
 			double value = atof(args.vals[i]);
 
 			fprintf(stderr, "Setting gain element %s: %f dB\n", name, value);
-			r = SoapySDRDevice_setGainElement(dev, SOAPY_SDR_TX, 0, name, value);
+			r = SoapySDRDevice_setGainElement(dev, SOAPY_SDR_TX, channel, name, value);
 			if (r != 0) {
 				fprintf(stderr, "WARNING: setGainElement(%s, %f) failed: %d\n", name, value, r);
 			}
@@ -137,7 +267,7 @@ int soapy_gain_str_set(SoapySDRDevice *dev, char const *gain_str)
 	} else {
 		// Set overall gain and let SoapySDR distribute amongst components
 		double value = atof(gain_str);
-		r = SoapySDRDevice_setGain(dev, SOAPY_SDR_TX, 0, value);
+		r = SoapySDRDevice_setGain(dev, SOAPY_SDR_TX, channel, value);
 		if (r != 0) {
 			fprintf(stderr, "WARNING: Failed to set tuner gain.\n");
 		} else {
@@ -277,19 +407,20 @@ int soapy_device_search(char const *s, SoapySDRDevice **devOut, const int direct
 		return -1;
 	}
 
-	show_device_info(dev, direction);
-
 	*devOut = dev;
 	return 0;
 }
 
-int soapy_setup_stream(SoapySDRDevice *dev, SoapySDRStream **streamOut, const int direction, const char *format)
+int soapy_setup_stream(SoapySDRDevice *dev, SoapySDRStream **streamOut, const int direction, const char *format, size_t const *channels, size_t numChanns)
 {
 	SoapySDRKwargs stream_args = {0};
 
 	// request exactly the first channel, e.g. SoapyPlutoSDR has strange ideas about "the default channel"
-	size_t channels[] = {0};
-	size_t numChanns = 1;
+	size_t first_channel[] = {0};
+	if (!channels || !numChanns) {
+		channels  = first_channel;
+		numChanns = 1;
+	}
 #if SOAPY_SDR_API_VERSION >= 0x00080000
 	// API version 0.8
 #undef SoapySDRDevice_setupStream
@@ -342,40 +473,24 @@ int soapy_enum_devices(sdr_ctx_t *sdr_ctx, const char *enum_args)
     SoapySDRKwargs *devs_kwargs = SoapySDRDevice_enumerateStrArgs(enum_args, &devs_len);
     fprintf(stderr, "found %u devices\n", (unsigned)devs_len);
 
+    // only list the devices, the selected one is made on first use
     for (size_t i = 0; i < devs_len; ++i) {
         char *kwargs = SoapySDRKwargs_toString(devs_kwargs + i);
         fprintf(stderr, "%u : %s\n", (unsigned)i, kwargs);
-        free(kwargs);
-    }
 
-    // make all devices
-    fprintf(stderr, "SoapySDRDevice_make_list()...\n");
-    SoapySDRDevice **devs = SoapySDRDevice_make_list(devs_kwargs, devs_len);
-    if (!devs) {
-        SoapySDRKwargsList_clear(devs_kwargs, devs_len); // frees entries and struct
-        return -1;
-    }
-
-    for (size_t i = 0; i < devs_len; ++i) {
-        sdr_dev_t *sdr_dev = &sdr_ctx->devs[sdr_ctx->devs_len++];
+        sdr_dev_t *sdr_dev = sdr_ctx_add_device(sdr_ctx);
+        if (!sdr_dev) {
+            free(kwargs);
+            break;
+        }
+        char const *driver = SoapySDRKwargs_get(devs_kwargs + i, "driver");
 
-        sdr_dev->backend = "soapy";
-        char *kwargs = SoapySDRKwargs_toString(devs_kwargs + i);
+        // the hardware key and info are only known once the device is made
+        sdr_dev->backend    = "soapy";
         sdr_dev->dev_kwargs = kwargs;
-        sdr_dev->device = devs[i];
-        if (!devs[i])
-            continue;
-        char *d_key           = SoapySDRDevice_getDriverKey(devs[i]);
-        char *h_key           = SoapySDRDevice_getHardwareKey(devs[i]);
-        SoapySDRKwargs h_info = SoapySDRDevice_getHardwareInfo(devs[i]);
-        char *p               = SoapySDRKwargs_toString(&h_info);
-        fprintf(stderr, "%u : %s : %s : %s\n", (unsigned)i, d_key, h_key, p);
-        sdr_dev->driver_key    = d_key;
-        sdr_dev->hardware_key  = h_key;
-        sdr_dev->hardware_info = p;
+        sdr_dev->driver_key = driver ? strdup(driver) : NULL;
     }
     SoapySDRKwargsList_clear(devs_kwargs, devs_len); // frees entries and struct
-    free(devs);
 
     return 0;
 }
@@ -411,9 +526,21 @@ int soapy_acquire_device(sdr_dev_t *sdr_dev)
         return -1;
     }
 
+    // the device made may differ from the last one with the same query
+    free(sdr_dev->driver_key);
+    free(sdr_dev->hardware_key);
+    free(sdr_dev->hardware_info);
+    sdr_dev->driver_key    = SoapySDRDevice_getDriverKey(sdr_dev->device);
+    sdr_dev->hardware_key  = SoapySDRDevice_getHardwareKey(sdr_dev->device);
+    SoapySDRKwargs h_info  = SoapySDRDevice_getHardwareInfo(sdr_dev->device);
+    sdr_dev->hardware_info = SoapySDRKwargs_toString(&h_info);
+    SoapySDRKwargs_clear(&h_info);
+
     return 0;
 }
 
+static void soapy_caps_free(void *priv);
+
 int soapy_free_device(sdr_dev_t *sdr_dev)
 {
     if (!sdr_dev || !sdr_dev->backend || strcmp(sdr_dev->backend, "soapy")) {
@@ -426,10 +553,256 @@ int soapy_free_device(sdr_dev_t *sdr_dev)
     free(sdr_dev->driver_key);
     free(sdr_dev->hardware_key);
     free(sdr_dev->hardware_info);
+    soapy_caps_free(sdr_dev->priv);
+    sdr_dev->priv = NULL;
+
+    return 0;
+}
+
+/// Device capabilities, cached per device to skip the queries on later runs.
+typedef struct soapy_caps {
+    char *hardware_key; ///< the device these are for, a different device invalidates them
+    char native_format[8];
+    double full_scale;
+    char **formats; ///< supported stream formats
+    size_t formats_len;
+    double freq_min;
+    double freq_max;
+    double rate_min;
+    double rate_max;
+    size_t mtu; ///< 0 if not known yet
+} soapy_caps_t;
+
+static void soapy_caps_free(void *priv)
+{
+    soapy_caps_t *caps = priv;
+    if (!caps) {
+        return;
+    }
+    free(caps->hardware_key);
+    for (size_t i = 0; i < caps->formats_len; ++i) {
+        free(caps->formats[i]);
+    }
+    free(caps->formats);
+    free(caps);
+}
 
+static int soapy_caps_add_format(soapy_caps_t *caps, char const *format)
+{
+    char **formats = realloc(caps->formats, (caps->formats_len + 1) * sizeof(*formats));
+    if (!formats) {
+        return -1;
+    }
+    caps->formats = formats;
+    formats[caps->formats_len] = strdup(format);
+    if (!formats[caps->formats_len]) {
+        return -1;
+    }
+    caps->formats_len++;
     return 0;
 }
 
+static char *soapy_caps_path(sdr_cmd_t *tx, sdr_dev_t *sdr_dev)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "soapy_%s.caps", sdr_dev->dev_kwargs);
+    for (char *p = name; *p; ++p) {
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-') {
+            *p = '_';
+        }
+    }
+    return sdr_cache_path(tx, name);
+}
+
+// Are the capabilities for the device made, by hardware key?
+static int soapy_caps_match(soapy_caps_t const *caps, sdr_dev_t const *sdr_dev)
+{
+    char const *key = sdr_dev->hardware_key ? sdr_dev->hardware_key : "";
+    return caps->hardware_key && !strcmp(caps->hardware_key, key);
+}
+
+static int soapy_caps_load(soapy_caps_t *caps, char const *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    int found = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char *val = strchr(line, '=');
+        if (!val) {
+            continue;
+        }
+        *val++ = '\0';
+        val[strcspn(val, "\r\n")] = '\0';
+        if (!strcmp(line, "hardware_key")) {
+            free(caps->hardware_key);
+            caps->hardware_key = strdup(val);
+        }
+        else if (!strcmp(line, "native_format")) {
+            snprintf(caps->native_format, sizeof(caps->native_format), "%s", val);
+            found |= 1;
+        }
+        else if (!strcmp(line, "full_scale")) {
+            caps->full_scale = strtod(val, NULL);
+            found |= 2;
+        }
+        else if (!strcmp(line, "format")) {
+            // one line per format, any number of them
+            if (soapy_caps_add_format(caps, val)) {
+                break;
+            }
+            found |= 4;
+        }
+        else if (!strcmp(line, "freq_min")) {
+            caps->freq_min = strtod(val, NULL);
+        }
+        else if (!strcmp(line, "freq_max")) {
+            caps->freq_max = strtod(val, NULL);
+        }
+        else if (!strcmp(line, "rate_min")) {
+            caps->rate_min = strtod(val, NULL);
+        }
+        else if (!strcmp(line, "rate_max")) {
+            caps->rate_max = strtod(val, NULL);
+        }
+        else if (!strcmp(line, "mtu")) {
+            caps->mtu = (size_t)strtoul(val, NULL, 10);
+        }
+    }
+    fclose(fp);
+
+    return found == 7 ? 0 : -1;
+}
+
+static int soapy_caps_save(soapy_caps_t const *caps, char const *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to write %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "hardware_key=%s\n", caps->hardware_key ? caps->hardware_key : "");
+    fprintf(fp, "native_format=%s\n", caps->native_format);
+    fprintf(fp, "full_scale=%.17g\n", caps->full_scale);
+    for (size_t i = 0; i < caps->formats_len; ++i) {
+        fprintf(fp, "format=%s\n", caps->formats[i]);
+    }
+    fprintf(fp, "freq_min=%.17g\n", caps->freq_min);
+    fprintf(fp, "freq_max=%.17g\n", caps->freq_max);
+    fprintf(fp, "rate_min=%.17g\n", caps->rate_min);
+    fprintf(fp, "rate_max=%.17g\n", caps->rate_max);
+    fprintf(fp, "mtu=%zu\n", caps->mtu);
+
+    return fclose(fp);
+}
+
+static int soapy_caps_query(soapy_caps_t *caps, sdr_dev_t *sdr_dev)
+{
+    SoapySDRDevice *dev = sdr_dev->device;
+    caps->hardware_key  = strdup(sdr_dev->hardware_key ? sdr_dev->hardware_key : "");
+    if (!caps->hardware_key) {
+        return -1;
+    }
+
+    double fullScale   = 0.0;
+    char *nativeFormat = SoapySDRDevice_getNativeStreamFormat(dev, SOAPY_SDR_TX, 0, &fullScale);
+    if (!nativeFormat) {
+        return -1;
+    }
+    snprintf(caps->native_format, sizeof(caps->native_format), "%s", nativeFormat);
+    caps->full_scale = fullScale;
+    free(nativeFormat);
+
+    size_t len;
+    char **formats = SoapySDRDevice_getStreamFormats(dev, SOAPY_SDR_TX, 0, &len);
+    for (size_t i = 0; i < len; ++i) {
+        if (soapy_caps_add_format(caps, formats[i])) {
+            SoapySDRStrings_clear(&formats, len);
+            return -1;
+        }
+    }
+    SoapySDRStrings_clear(&formats, len);
+
+    SoapySDRRange *ranges = SoapySDRDevice_getFrequencyRange(dev, SOAPY_SDR_TX, 0, &len);
+    for (size_t i = 0; i < len; ++i) {
+        if (!i || ranges[i].minimum < caps->freq_min)
+            caps->freq_min = ranges[i].minimum;
+        if (!i || ranges[i].maximum > caps->freq_max)
+            caps->freq_max = ranges[i].maximum;
+    }
+    free(ranges);
+
+    ranges = SoapySDRDevice_getSampleRateRange(dev, SOAPY_SDR_TX, 0, &len);
+    for (size_t i = 0; i < len; ++i) {
+        if (!i || ranges[i].minimum < caps->rate_min)
+            caps->rate_min = ranges[i].minimum;
+        if (!i || ranges[i].maximum > caps->rate_max)
+            caps->rate_max = ranges[i].maximum;
+    }
+    free(ranges);
+
+    return 0;
+}
+
+/// Output formats we can convert to, narrowest first.
+static char const *const negotiable_formats[] = {
+        SOAPY_SDR_CS8,
+        SOAPY_SDR_CS12,
+        SOAPY_SDR_CS16,
+        SOAPY_SDR_CF32,
+};
+
+static int has_format(char **formats, size_t format_count, char const *format)
+{
+    for (size_t i = 0; i < format_count; ++i) {
+        if (!strcmp(formats[i], format)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// Choose the narrowest device format that preserves the input precision, returns a static string.
+static char const *negotiate_format(sdr_cmd_t *tx, char **formats, size_t format_count, char const *nativeFormat, double nativeFullScale)
+{
+    size_t const negotiable_len = sizeof(negotiable_formats) / sizeof(*negotiable_formats);
+
+    // a forced output format wins, if the device supports it
+    if (tx->output_format && *tx->output_format) {
+        for (size_t i = 0; i < negotiable_len; ++i) {
+            if (!strcmp(tx->output_format, negotiable_formats[i]) && has_format(formats, format_count, negotiable_formats[i])) {
+                return negotiable_formats[i];
+            }
+        }
+        fprintf(stderr, "Output format %s not supported, negotiating format\n", tx->output_format);
+    }
+
+    // rendered input (no input format) has a noise floor well within 8 bits
+    int input_bits  = tx->input_format ? sdr_format_bits(tx->input_format, sdr_format_full_scale(tx->input_format)) : 8;
+    int device_bits = sdr_format_bits(nativeFormat, nativeFullScale);
+    int needed_bits = input_bits < device_bits ? input_bits : device_bits;
+
+    for (size_t i = 0; i < negotiable_len; ++i) {
+        char const *format = negotiable_formats[i];
+        if (has_format(formats, format_count, format)
+                && sdr_format_bits(format, sdr_format_full_scale(format)) >= needed_bits) {
+            return format;
+        }
+    }
+
+    // no better match, use the native format if we can convert to it
+    for (size_t i = 0; i < negotiable_len; ++i) {
+        if (!strcmp(nativeFormat, negotiable_formats[i])) {
+            return negotiable_formats[i];
+        }
+    }
+    return SOAPY_SDR_CS16;
+}
+
 int soapy_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 {
     if (!tx) return -1;
@@ -440,31 +813,84 @@ int soapy_transmit_setup(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
         return ret;
     }
 
-    tx->fullScale            = 0.0;
-    char const *nativeFormat = SoapySDRDevice_getNativeStreamFormat(sdr_dev->device, SOAPY_SDR_TX, 0, &tx->fullScale);
-    if (!nativeFormat) {
-        fprintf(stderr, "No TX capability '%s'.\n", sdr_dev->dev_kwargs);
-        return -1;
+    // capabilities of another device with the same query are stale
+    soapy_caps_t *caps = sdr_dev->priv;
+    if (caps && !soapy_caps_match(caps, sdr_dev)) {
+        soapy_caps_free(caps);
+        caps = sdr_dev->priv = NULL;
+    }
+    if (!caps) {
+        caps = calloc(1, sizeof(soapy_caps_t));
+        if (!caps) {
+            return -1;
+        }
+        char *path = soapy_caps_path(tx, sdr_dev);
+        if (path && !soapy_caps_load(caps, path) && soapy_caps_match(caps, sdr_dev)) {
+            fprintf(stderr, "Using cached capabilities from %s\n", path);
+        }
+        else {
+            soapy_caps_free(caps);
+            caps = calloc(1, sizeof(soapy_caps_t));
+            if (!caps) {
+                free(path);
+                return -1;
+            }
+            show_device_info(sdr_dev->device, SOAPY_SDR_TX);
+            if (soapy_caps_query(caps, sdr_dev)) {
+                fprintf(stderr, "No TX capability '%s'.\n", sdr_dev->dev_kwargs);
+                free(path);
+                soapy_caps_free(caps);
+                return -1;
+            }
+            if (path) {
+                soapy_caps_save(caps, path);
+            }
+        }
+        free(path);
+        sdr_dev->priv = caps;
+    }
+
+    if (caps->freq_max > 0.0 && (tx->center_frequency < caps->freq_min || tx->center_frequency > caps->freq_max)) {
+        fprintf(stderr, "WARNING: Frequency %.0f Hz outside of device range %.0f - %.0f Hz\n", tx->center_frequency, caps->freq_min, caps->freq_max);
     }
-    size_t format_count;
-    char **formats = SoapySDRDevice_getStreamFormats(sdr_dev->device, SOAPY_SDR_TX, 0, &format_count);
+    if (caps->rate_max > 0.0 && (tx->sample_rate < caps->rate_min || tx->sample_rate > caps->rate_max)) {
+        fprintf(stderr, "WARNING: Sample rate %.0f S/s outside of device range %.0f - %.0f S/s\n", tx->sample_rate, caps->rate_min, caps->rate_max);
+    }
+
     fprintf(stderr, "Supported formats:");
-    for (size_t i = 0; i < format_count; ++i) {
-        fprintf(stderr, " %s", formats[i]);
+    for (size_t i = 0; i < caps->formats_len; ++i) {
+        fprintf(stderr, " %s", caps->formats[i]);
     }
     fprintf(stderr, "\n");
 
-    // TODO: allow forced output format
-    if (is_format_equal(tx->input_format, SOAPY_SDR_CF32)) {
-        tx->output_format = tx->input_format;
-    }
-    else {
-        tx->output_format = nativeFormat;
+    tx->fullScale      = caps->full_scale;
+    char const *format = negotiate_format(tx, caps->formats, caps->formats_len, caps->native_format, tx->fullScale);
+    if (!is_format_equal(format, caps->native_format)) {
+        tx->fullScale = sdr_format_full_scale(format);
     }
+    fprintf(stderr, "Using output format %s (full scale %.0f, native format %s)\n", format, tx->fullScale, caps->native_format);
+    tx->output_format = format;
 
     return 0;
 }
 
+// Retune for a hop, as a timed command at time_ns if non-zero (e.g. SoapyUHD), otherwise right away.
+static void soapy_hop(SoapySDRDevice *dev, size_t channel, sdr_hop_t const *hop, long long time_ns)
+{
+    if (time_ns) {
+        int r = SoapySDRDevice_setHardwareTime(dev, time_ns, "CMD");
+        if (r != 0)
+            fprintf(stderr, "SoapySDRDevice_setHardwareTime(CMD): %s (%d)\n", SoapySDR_errToStr(r), r);
+    }
+    soapy_set_frequency(dev, SOAPY_SDR_TX, channel, hop->frequency);
+    if (hop->gain_str) {
+        soapy_gain_str_set(dev, channel, hop->gain_str);
+    }
+    if (time_ns) {
+        SoapySDRDevice_setHardwareTime(dev, 0, "CMD"); // clear the command time
+    }
+}
+
 int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 {
     SoapySDRDevice *dev    = sdr_dev->device;
@@ -472,14 +898,35 @@ int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     uint8_t *txbuf         = {0};
     int r;
 
+    // the main channel and any extra channels, streamed together
+    size_t nch         = 1 + tx->channels_len;
+    sdr_cmd_t **chs    = calloc(nch, sizeof(*chs));
+    size_t *chans      = calloc(nch, sizeof(*chans));
+    void **chbufs      = calloc(nch, sizeof(*chbufs));
+    const void **buffs = calloc(nch, sizeof(*buffs));
+    if (!chs || !chans || !chbufs || !buffs) {
+        perror("calloc channels");
+        exit(EXIT_FAILURE);
+    }
+    chs[0] = tx;
+    for (size_t c = 1; c < nch; ++c) {
+        chs[c] = tx->channels[c - 1];
+    }
+    for (size_t c = 0; c < nch; ++c) {
+        chans[c] = chs[c]->channel;
+    }
+
     size_t sample_size = SoapySDR_formatToSize(tx->output_format);
-    txbuf = malloc(tx->block_size * sample_size);
+    txbuf = malloc(nch * tx->block_size * sample_size);
     if (!txbuf) {
         perror("malloc txbuf");
         exit(EXIT_FAILURE);
     }
+    for (size_t c = 0; c < nch; ++c) {
+        chbufs[c] = &txbuf[c * tx->block_size * sample_size];
+    }
 
-    r = soapy_setup_stream(dev, &stream, SOAPY_SDR_TX, tx->output_format);
+    r = soapy_setup_stream(dev, &stream, SOAPY_SDR_TX, tx->output_format, chans, nch);
     if (r != 0) {
         fprintf(stderr, "Failed to setup sdr stream '%s'.\n", tx->output_format);
         goto out;
@@ -487,14 +934,20 @@ int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
 
     fprintf(stderr, "Using input format: %s (output format %s)\n", tx->input_format, tx->output_format);
 
-    if (tx->antenna && *tx->antenna) {
-        char *ant = SoapySDRDevice_getAntenna(dev, SOAPY_SDR_TX, 0);
-        fprintf(stderr, "Antenna was: %s\n", ant);
-        r = SoapySDRDevice_setAntenna(dev, SOAPY_SDR_TX, 0, tx->antenna);
-        if (r != 0)
-            fprintf(stderr, "SoapySDRDevice_setAntenna: %s (%d)\n", SoapySDR_errToStr(r), r);
-        tx->antenna = SoapySDRDevice_getAntenna(dev, SOAPY_SDR_TX, 0);
-        fprintf(stderr, "Antenna set to: %s\n", tx->antenna);
+    if (nch > 1) {
+        fprintf(stderr, "Streaming %zu channels\n", nch);
+    }
+
+    for (size_t c = 0; c < nch; ++c) {
+        if (chs[c]->antenna && *chs[c]->antenna) {
+            char *ant = SoapySDRDevice_getAntenna(dev, SOAPY_SDR_TX, chans[c]);
+            fprintf(stderr, "Antenna on channel %zu was: %s\n", chans[c], ant);
+            r = SoapySDRDevice_setAntenna(dev, SOAPY_SDR_TX, chans[c], chs[c]->antenna);
+            if (r != 0)
+                fprintf(stderr, "SoapySDRDevice_setAntenna: %s (%d)\n", SoapySDR_errToStr(r), r);
+            chs[c]->antenna = SoapySDRDevice_getAntenna(dev, SOAPY_SDR_TX, chans[c]);
+            fprintf(stderr, "Antenna on channel %zu set to: %s\n", chans[c], chs[c]->antenna);
+        }
     }
 
     if (tx->master_clock_rate != 0.0) {
@@ -510,22 +963,37 @@ int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     if (tx->bandwidth != 0.0) {
         double bw = SoapySDRDevice_getBandwidth(dev, SOAPY_SDR_TX, 0);
         fprintf(stderr, "Bandwidth was: %.0f\n", bw);
-        r = SoapySDRDevice_setBandwidth(dev, SOAPY_SDR_TX, 0, tx->bandwidth);
-        if (r != 0)
-            fprintf(stderr, "SoapySDRDevice_setBandwidth: %s (%d)\n", SoapySDR_errToStr(r), r);
+        for (size_t c = 0; c < nch; ++c) {
+            r = SoapySDRDevice_setBandwidth(dev, SOAPY_SDR_TX, chans[c], tx->bandwidth);
+            if (r != 0)
+                fprintf(stderr, "SoapySDRDevice_setBandwidth: %s (%d)\n", SoapySDR_errToStr(r), r);
+        }
         tx->bandwidth = SoapySDRDevice_getBandwidth(dev, SOAPY_SDR_TX, 0);
         fprintf(stderr, "Bandwidth set to: %.0f\n", tx->bandwidth);
     }
 
-    /* At SoapySDRDevice_setSampleRate the PlutoSDR will blast out garbage for 1.5s at full gain. */
-    /* tune away and wait */
-    soapy_set_frequency(dev, SOAPY_SDR_TX, 3e9);
-
-    /* Set the sample rate */
-    soapy_set_sample_rate(dev, SOAPY_SDR_TX, tx->sample_rate);
-
-    fprintf(stderr, "Waiting for TX to settle...\n");
-    sleep(1);
+    /* Set the sample rate, only if it changes, some devices need to tune away and settle */
+    soapy_quirk_t const *quirk = soapy_find_quirk(dev);
+    double prev_rate           = SoapySDRDevice_getSampleRate(dev, SOAPY_SDR_TX, 0);
+    if (fabs(prev_rate - tx->sample_rate) >= 1.0) {
+        if (quirk && quirk->rate_settle_ms) {
+            soapy_set_frequency(dev, SOAPY_SDR_TX, 0, 3e9);
+        }
+        soapy_set_sample_rate(dev, SOAPY_SDR_TX, tx->sample_rate);
+        for (size_t c = 0; c < nch; ++c) {
+            if (chans[c] != 0) {
+                SoapySDRDevice_setSampleRate(dev, SOAPY_SDR_TX, chans[c], tx->sample_rate);
+            }
+        }
+        fprintf(stderr, "Sample rate reads back as %.0f S/s\n", SoapySDRDevice_getSampleRate(dev, SOAPY_SDR_TX, 0));
+        if (quirk && quirk->rate_settle_ms) {
+            fprintf(stderr, "Waiting %u ms for TX to settle...\n", quirk->rate_settle_ms);
+            soapy_sleep_ms(quirk->rate_settle_ms);
+        }
+    }
+    else {
+        fprintf(stderr, "Sample rate unchanged at %.0f S/s\n", prev_rate);
+    }
 
     /* note: needs sample rate set */
     bool hasHwTime = SoapySDRDevice_hasHardwareTime(dev, "");
@@ -533,12 +1001,23 @@ int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     long long hwTime = SoapySDRDevice_getHardwareTime(dev, "");
     fprintf(stderr, "SoapySDRDevice_getHardwareTime: %lld\n", hwTime);
 
-    /* Set the center frequency */
-    soapy_set_frequency(dev, SOAPY_SDR_TX, tx->center_frequency);
+    /* Set the center frequency, only if it changes, extra channels default to the main one */
+    for (size_t c = 0; c < nch; ++c) {
+        double freq = chs[c]->center_frequency > 0.0 ? chs[c]->center_frequency : tx->center_frequency;
+        if (fabs(SoapySDRDevice_getFrequency(dev, SOAPY_SDR_TX, chans[c]) - freq) >= 1.0) {
+            soapy_set_frequency(dev, SOAPY_SDR_TX, chans[c], freq);
+        }
+        else {
+            fprintf(stderr, "Frequency unchanged at %.0f Hz\n", freq);
+        }
+    }
+    soapy_wait_sensor(dev, SOAPY_SDR_TX, "lo_locked", 100);
 
     soapy_ppm_set(dev, tx->ppm_error);
 
-    soapy_gain_str_set(dev, "0");
+    for (size_t c = 0; c < nch; ++c) {
+        soapy_gain_str_set(dev, chans[c], "0");
+    }
 
     fprintf(stderr, "Writing samples in sync mode...\n");
     SoapySDRKwargs args = {0};
@@ -549,56 +1028,176 @@ int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
     }
 
     // TODO: save current gain
-    if (tx->gain_str) {
-        soapy_gain_str_set(dev, tx->gain_str);
+    for (size_t c = 0; c < nch; ++c) {
+        if (chs[c]->gain_str) {
+            soapy_gain_str_set(dev, chans[c], chs[c]->gain_str);
+        }
     }
 
     size_t mtu = SoapySDRDevice_getStreamMTU(dev, stream);
     fprintf(stderr, "Stream MTU: %u\n", (unsigned)mtu);
+    soapy_caps_t *caps = sdr_dev->priv;
+    if (caps && caps->mtu != mtu) {
+        caps->mtu  = mtu;
+        char *path = soapy_caps_path(tx, sdr_dev);
+        if (path) {
+            soapy_caps_save(caps, path);
+        }
+        free(path);
+    }
+
+    // wait for other devices, then schedule the first sample
+    if (tx->start_cb) {
+        tx->start_cb(tx->start_ctx);
+    }
+    long long start_ns = 0;
+    // hops are timed commands relative to the first sample, this needs a timed start
+    unsigned start_delay = tx->initial_delay;
+    if (!start_delay && tx->hops_len && hasHwTime) {
+        start_delay = HOP_START_DELAY_MS;
+    }
+    if (start_delay && hasHwTime) {
+        if (tx->time_source) {
+            r = SoapySDRDevice_setHardwareTime(dev, 0, tx->time_source);
+            if (r != 0)
+                fprintf(stderr, "SoapySDRDevice_setHardwareTime(%s): %s (%d)\n", tx->time_source, SoapySDR_errToStr(r), r);
+        }
+        else {
+            start_ns = SoapySDRDevice_getHardwareTime(dev, "");
+        }
+        start_ns += (long long)start_delay * 1000000;
+        fprintf(stderr, "Scheduling first sample at device time %lld ns\n", start_ns);
+    }
+    else if (tx->initial_delay || tx->time_source) {
+        fprintf(stderr, "WARNING: No hardware time, starting untimed\n");
+    }
+    int timed = start_ns > 0;
+    if (tx->hops_len && !timed) {
+        fprintf(stderr, "WARNING: Hops are retuned untimed, they will not land on sample boundaries\n");
+    }
+
+    // convert or render straight into the driver buffers if supported
+    // direct access buffers are single channel here, extra channels take the write path
+    size_t direct_bufs = nch > 1 ? 0 : SoapySDRDevice_getNumDirectAccessBuffers(dev, stream);
+    if (direct_bufs > 0) {
+        fprintf(stderr, "Using %zu direct access buffers\n", direct_bufs);
+    }
+
+    // poll stream status asynchronously, the loop below only fills and writes
+    soapy_status_t status = {0};
+    status.dev            = dev;
+    status.stream         = stream;
+    status.tx             = tx;
+    status.timeout_us     = 100000; // 100 ms, bounds the join delay
+    pthread_t status_thread;
+    int status_running = pthread_create(&status_thread, NULL, soapy_status_thread, &status) == 0;
+    if (!status_running) {
+        fprintf(stderr, "WARNING: Failed to start stream status thread\n");
+    }
+    long seen_underflows   = 0;
+    long seen_late_packets = 0;
 
     size_t n_written = 0;
     int timeouts     = 0;
+    int burst_ended  = 0;
     while (!tx->flag_abort) {
-        const void *buffs[1];
         int flags        = 0;
         long long timeNs = 0;
         long timeoutUs   = 1000000; // 1 second
 
+        sdr_hop_t const *hop = sdr_hop_next(tx);
+        if (hop) {
+            long long hop_ns = start_ns > 0 ? start_ns + (long long)(n_written * 1e9 / tx->sample_rate) : 0;
+            soapy_hop(dev, chans[0], hop, hop_ns);
+        }
+        // a read cut short at the end of a dwell or before a retune does not end the burst
+        int dwell_end = 0;
+
         size_t n_samps = 0;
-        ssize_t n_read = sdr_input_read(sdr_ctx, tx, txbuf, &n_samps, tx->fullScale);
-
-        if (n_read < 0) {
-            fprintf(stderr, "Input end\n");
-            break; // EOF
-        }
-        if (n_read == 0) {
-            continue; // retry
-        }
-
-        //long long hwTime = SoapySDRDevice_getHardwareTime(dev, "");
-        //timeNs =  hwTime + (0.001e9); //100ms
-        timeNs = 0; //(long long)(n_written * 1e9 / tx->sample_rate);
-        flags  = 0; //SOAPY_SDR_HAS_TIME;
-        r      = 0; // clean ret should we exit
-        for (size_t pos = 0; pos < n_samps && !tx->flag_abort;) {
-            buffs[0] = &txbuf[pos * sample_size];
-
-            // flush TX buffer?
-            if (n_samps < tx->block_size)
-                flags = SOAPY_SDR_END_BURST;
-            r = SoapySDRDevice_writeStream(dev, stream, buffs, n_samps - pos, &flags, timeNs, timeoutUs);
-            //fprintf(stderr, "writeStream ret=%d (%zu of %zu in %zu), flags=%d, timeNs=%lld\n", r, n_samps - pos, n_samps, tx->block_size, flags, timeNs);
-            if (r < 0) {
-                break;
+        ssize_t n_read = 0;
+
+        if (direct_bufs > 0) {
+            void *direct_buffs[1];
+            size_t handle = 0;
+            r = SoapySDRDevice_acquireWriteBuffer(dev, stream, &handle, direct_buffs, timeoutUs);
+            if (r == SOAPY_SDR_NOT_SUPPORTED) {
+                fprintf(stderr, "Direct buffer access failed, falling back to writeStream\n");
+                direct_bufs = 0;
+                continue;
+            }
+            if (r > 0) {
+                size_t n_avail = (size_t)r < tx->block_size ? (size_t)r : tx->block_size;
+                n_samps        = n_avail;
+                n_read         = sdr_input_read(sdr_ctx, tx, direct_buffs[0], &n_samps, tx->fullScale);
+                if (n_read <= 0) {
+                    n_samps = 0;
+                }
+                dwell_end = (tx->hops_len && !tx->hop_left) || tx->retune;
+                // flush TX buffer?
+                if (n_samps < n_avail && n_read != 0 && !dwell_end) {
+                    flags       = SOAPY_SDR_END_BURST;
+                    burst_ended = 1;
+                }
+                if (timed && n_samps) {
+                    flags |= SOAPY_SDR_HAS_TIME;
+                    timeNs = start_ns;
+                    timed  = 0;
+                }
+                SoapySDRDevice_releaseWriteBuffer(dev, stream, handle, n_samps, &flags, timeNs);
+                if (n_read < 0) {
+                    fprintf(stderr, "Input end\n");
+                    break; // EOF
+                }
+                r = 0; // clean ret should we exit
+            }
+        }
+        else {
+            n_read = sdr_input_read(sdr_ctx, tx, txbuf, &n_samps, tx->fullScale);
+
+            if (n_read < 0) {
+                fprintf(stderr, "Input end\n");
+                break; // EOF
+            }
+            if (n_read == 0) {
+                continue; // retry
+            }
+            dwell_end = (tx->hops_len && !tx->hop_left) || tx->retune;
+
+            if (timed) {
+                flags  = SOAPY_SDR_HAS_TIME;
+                timeNs = start_ns;
+                timed  = 0;
+            }
+            r = 0; // clean ret should we exit
+            if (nch > 1) {
+                sdr_input_read_channels(sdr_ctx, tx, chbufs, n_samps);
+            }
+            for (size_t pos = 0; pos < n_samps && !tx->flag_abort;) {
+                for (size_t c = 0; c < nch; ++c) {
+                    buffs[c] = (uint8_t *)chbufs[c] + pos * sample_size;
+                }
+
+                // flush TX buffer?
+                if (n_samps < tx->block_size && !dwell_end) {
+                    flags       = SOAPY_SDR_END_BURST;
+                    burst_ended = 1;
+                }
+                r = SoapySDRDevice_writeStream(dev, stream, buffs, n_samps - pos, &flags, timeNs, timeoutUs);
+                //fprintf(stderr, "writeStream ret=%d (%zu of %zu in %zu), flags=%d, timeNs=%lld\n", r, n_samps - pos, n_samps, tx->block_size, flags, timeNs);
+                if (r < 0) {
+                    break;
+                }
+                flags &= ~SOAPY_SDR_HAS_TIME; // only the first sample is timed
+                //usleep(r * 1e6 / tx->sample_rate);
+                pos += (size_t)r;
             }
-            //usleep(r * 1e6 / tx->sample_rate);
-            pos += (size_t)r;
         }
 
         //fprintf(stderr, "last writeStream ret=%d (%zu of %zu), flags=%d, timeNs=%lld\n", r, n_samps, tx->block_size, flags, timeNs);
         if (r >= 0) {
             n_written += n_samps;
             timeouts = 0;
+            r        = 0; // clean ret should we exit
         }
         else {
             if (r == SOAPY_SDR_OVERFLOW) {
@@ -615,26 +1214,68 @@ int soapy_transmit(sdr_ctx_t *sdr_ctx, sdr_dev_t *sdr_dev, sdr_cmd_t *tx)
             fprintf(stderr, "WARNING: sync write failed. %s (%d)\n", SoapySDR_errToStr(r), r);
         }
 
-        size_t channel = 0;
-        r              = SoapySDRDevice_readStreamStatus(dev, stream, &channel, &flags, &timeNs, (long)(1e6 / tx->sample_rate * tx->block_size / 2));
-        if (r == SOAPY_SDR_NOT_SUPPORTED) {
-            r = 0;
+        long underflows = ATOMIC_LOAD(status.underflows);
+        if (underflows != seen_underflows) {
+            seen_underflows = underflows;
+            fprintf(stderr, "U");
+            fflush(stderr);
         }
-        else if (r && r != SOAPY_SDR_TIMEOUT) {
-            fprintf(stderr, "readStreamStatus %s (%d), channel=%zu flags=%d, timeNs=%lld\n", SoapySDR_errToStr(r), r, channel, flags, timeNs);
+        long late_packets = ATOMIC_LOAD(status.late_packets);
+        if (late_packets != seen_late_packets) {
+            seen_late_packets = late_packets;
+            fprintf(stderr, "L");
+            fflush(stderr);
         }
     }
     fprintf(stderr, "%zu samples written\n", n_written);
 
+    // let the device drain before tuning away, as reported by an end of burst or estimated
+    if (!tx->flag_abort) {
+        unsigned drain_ms = (unsigned)(1000.0 * 4 * tx->block_size / tx->sample_rate) + 10;
+        if (drain_ms > 1000) {
+            drain_ms = 1000;
+        }
+        if (burst_ended && status_running && !ATOMIC_LOAD(status.unsupported)) {
+            // not all drivers report the end of a burst, never wait longer than the buffers take
+            unsigned ms = 0;
+            while (!ATOMIC_LOAD(status.end_bursts) && !ATOMIC_LOAD(status.unsupported) && ms < drain_ms) {
+                soapy_sleep_ms(1);
+                ms++;
+            }
+            if (ATOMIC_LOAD(status.end_bursts)) {
+                fprintf(stderr, "Waited %u ms for the end of burst\n", ms);
+            }
+            else {
+                fprintf(stderr, "No end of burst reported, waited %u ms for TX to drain\n", ms);
+            }
+        }
+        else {
+            fprintf(stderr, "Waiting %u ms for TX to drain...\n", drain_ms);
+            soapy_sleep_ms(drain_ms);
+        }
+    }
+
     // TODO: restore previous gain
     if (tx->gain_str) {
         //verbose_gain_str_set(dev, saved_gain_str);
     }
-    soapy_gain_str_set(dev, "0");
-    soapy_set_frequency(dev, SOAPY_SDR_TX, 3e9);
+    // frequency-agile transmits keep the LO for the next one
+    for (size_t c = 0; c < nch; ++c) {
+        soapy_gain_str_set(dev, chans[c], "0");
+        if (tx->hop_span <= 0.0) {
+            soapy_set_frequency(dev, SOAPY_SDR_TX, chans[c], 3e9);
+        }
+    }
 
-    fprintf(stderr, "Waiting for TX to settle...\n");
-    sleep(1);
+    if (status_running) {
+        ATOMIC_STORE(status.stop, 1);
+        pthread_join(status_thread, NULL);
+    }
+    tx->samples_written = n_written;
+    tx->underflows      = (unsigned)ATOMIC_LOAD(status.underflows);
+    tx->late_packets    = (unsigned)ATOMIC_LOAD(status.late_packets);
+    fprintf(stderr, "%u underflows, %u late packets, %ld end of bursts\n",
+            tx->underflows, tx->late_packets, ATOMIC_LOAD(status.end_bursts));
 
     if (tx->flag_abort)
         fprintf(stderr, "\nUser cancel, exiting...\n");
@@ -648,6 +1289,10 @@ out:
     }
 
     free(txbuf);
+    free(buffs);
+    free(chbufs);
+    free(chans);
+    free(chs);
 
     return r >= 0 ? r : -r;
 }
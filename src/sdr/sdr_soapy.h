@@ -30,11 +30,12 @@ char * strsep(char **sp, char *sep);
  *
  * \param dev the device handle
  * \param direction RX/TX
+ * \param channel the channel index
  * \param frequency in Hz
  * \return 0 on success
  */
 
-int soapy_set_frequency(SoapySDRDevice *dev, const int direction, double frequency);
+int soapy_set_frequency(SoapySDRDevice *dev, const int direction, size_t channel, double frequency);
 
 /*!
  * Set device sample rate and report status on stderr
@@ -62,10 +63,11 @@ int soapy_set_bandwidth(SoapySDRDevice *dev, const int direction, double bandwid
  * Set tuner gain elements by a key/value string
  *
  * \param dev the device handle
+ * \param channel the channel index
  * \param gain_str string of gain element pairs (example LNA=40,VGA=20,AMP=0), or string of overall gain, in dB
  * \return 0 on success
  */
-int soapy_gain_str_set(SoapySDRDevice *dev, char const *gain_str);
+int soapy_gain_str_set(SoapySDRDevice *dev, size_t channel, char const *gain_str);
 
 /*!
  * Set the frequency correction value for the device and report status on stderr.
@@ -95,10 +97,12 @@ int soapy_device_search(char const *s, SoapySDRDevice **devOut, const int direct
  * \param streamOut stream output returned
  * \param direction RX/TX
  * \param format stream format (such as SOAPY_SDR_CS16)
+ * \param channels list of channel indices, NULL for just the first channel
+ * \param numChanns number of channels in the list
  * \return streamOut, 0 if successful
  */
 
-int soapy_setup_stream(SoapySDRDevice *dev, SoapySDRStream **streamOut, const int direction, const char *format);
+int soapy_setup_stream(SoapySDRDevice *dev, SoapySDRStream **streamOut, const int direction, const char *format, size_t const *channels, size_t numChanns);
 
 /*!
  * Parse a comma-separated list of key/value pairs into SoapySDRKwargs
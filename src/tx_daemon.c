@@ -0,0 +1,587 @@
+/** @file
+    tx_tools - tx_daemon, serve transmit jobs over a local socket.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tx_daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+#include "tx_sched.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // e.g. macOS, SIGPIPE is handled by the caller then
+#endif
+
+/// The listening daemon, each client is served on its own thread.
+typedef struct daemon_server {
+    tx_sched_t *sched;
+    tx_cmd_t const *defaults;
+    int *flag_abort;
+    pthread_mutex_t lock;
+    struct daemon_client *clients; ///< connected clients, guarded by lock
+} daemon_server_t;
+
+/// A connected client, jobs reply to it once done.
+typedef struct daemon_client {
+    struct daemon_client *next;
+    daemon_server_t *server;
+    pthread_t thread;
+    int fd;
+    int done; ///< served, ready to be joined, guarded by the server lock
+    unsigned pending; ///< jobs queued but not done
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} daemon_client_t;
+
+/// A queued job and the strings it owns until done.
+typedef struct daemon_job {
+    daemon_client_t *client;
+    struct timespec queued;
+    int priority;
+    unsigned deadline;
+    char *file;
+    char const *format;
+    char *codes;
+    char *pulses;
+    char *preset;
+    char *gain;
+    char *antenna;
+    tx_hop_t *hops;
+    size_t hops_len;
+} daemon_job_t;
+
+static void job_free(daemon_job_t *job)
+{
+    free(job->file);
+    free(job->codes);
+    free(job->pulses);
+    free(job->preset);
+    free(job->gain);
+    free(job->antenna);
+    free(job->hops);
+}
+
+// Like atod_metric() but reports errors instead of exiting.
+static int parse_metric(char const *str, double *out)
+{
+    char *endptr = NULL;
+    double val   = strtod(str, &endptr);
+    if (endptr == str) {
+        return -1;
+    }
+    switch (*endptr) {
+    case 'k':
+    case 'K':
+        val *= 1e3;
+        endptr++;
+        break;
+    case 'M':
+        val *= 1e6;
+        endptr++;
+        break;
+    case 'G':
+        val *= 1e9;
+        endptr++;
+        break;
+    }
+    if (*endptr) {
+        return -1;
+    }
+    *out = val;
+    return 0;
+}
+
+static char *append_line(char *text, char const *line)
+{
+    size_t len = text ? strlen(text) : 0;
+    char *p    = realloc(text, len + strlen(line) + 2);
+    if (!p) {
+        free(text);
+        return NULL;
+    }
+    if (len) {
+        p[len++] = '\n';
+    }
+    strcpy(&p[len], line);
+    return p;
+}
+
+static int job_set(daemon_job_t *job, tx_cmd_t *tx, char const *key, char const *val, char *err, size_t err_size)
+{
+    double num = 0.0;
+
+    if (!strcmp(key, "file")) {
+        free(job->file);
+        job->file = strdup(val);
+    }
+    else if (!strcmp(key, "format")) {
+        job->format = tx_parse_sample_format(val);
+        if (!tx_valid_input_format(job->format)) {
+            snprintf(err, err_size, "unsupported input format %s", val);
+            return -1;
+        }
+    }
+    else if (!strcmp(key, "codes")) {
+        job->codes = append_line(job->codes, val);
+    }
+    else if (!strcmp(key, "pulses")) {
+        job->pulses = append_line(job->pulses, val);
+    }
+    else if (!strcmp(key, "preset")) {
+        free(job->preset);
+        job->preset = strdup(val);
+    }
+    else if (!strcmp(key, "gain")) {
+        free(job->gain);
+        job->gain = strdup(val);
+    }
+    else if (!strcmp(key, "antenna")) {
+        free(job->antenna);
+        job->antenna = strdup(val);
+    }
+    else if (!strcmp(key, "hops")) {
+        free(job->hops);
+        job->hops = tx_parse_hops(val, &job->hops_len);
+        if (!job->hops) {
+            snprintf(err, err_size, "invalid hop list %s", val);
+            return -1;
+        }
+    }
+    else if (!strcmp(key, "priority")) {
+        char *endptr  = NULL;
+        job->priority = (int)strtol(val, &endptr, 10);
+        if (endptr == val || *endptr) {
+            snprintf(err, err_size, "invalid value for %s: %s", key, val);
+            return -1;
+        }
+    }
+    else if (!strcmp(key, "offset")) {
+        if (parse_metric(val, &num)) {
+            snprintf(err, err_size, "invalid value for %s: %s", key, val);
+            return -1;
+        }
+        tx->freq_offset = num;
+    }
+    else if (parse_metric(val, &num) || num < 0.0) {
+        snprintf(err, err_size, "invalid value for %s: %s", key, val);
+        return -1;
+    }
+    else if (!strcmp(key, "freq")) {
+        tx->center_frequency = num;
+    }
+    else if (!strcmp(key, "rate")) {
+        tx->sample_rate = num;
+    }
+    else if (!strcmp(key, "input_rate")) {
+        tx->input_rate = num;
+    }
+    else if (!strcmp(key, "hop_span")) {
+        tx->hop_span = num;
+    }
+    else if (!strcmp(key, "bandwidth")) {
+        tx->bandwidth = num;
+    }
+    else if (!strcmp(key, "channel")) {
+        tx->channel = (size_t)num;
+    }
+    else if (!strcmp(key, "block")) {
+        tx->block_size = (size_t)num;
+    }
+    else if (!strcmp(key, "samples")) {
+        tx->samples_to_write = (size_t)num;
+    }
+    else if (!strcmp(key, "loops")) {
+        tx->loops = (unsigned)num;
+    }
+    else if (!strcmp(key, "delay")) {
+        tx->initial_delay = (unsigned)num;
+    }
+    else if (!strcmp(key, "deadline")) {
+        job->deadline = (unsigned)num;
+    }
+    else {
+        snprintf(err, err_size, "unknown key %s", key);
+        return -1;
+    }
+    return 0;
+}
+
+// Set up a job from its keys, returns -1 with an error reply.
+static int job_prepare(tx_cmd_t *tx, daemon_job_t *job, char *reply, size_t reply_size)
+{
+    if (job->gain)
+        tx->gain_str = job->gain;
+    if (job->antenna)
+        tx->antenna = job->antenna;
+    if (job->hops) {
+        tx->hops     = job->hops;
+        tx->hops_len = job->hops_len;
+    }
+    tx->codes  = job->codes;
+    tx->pulses = job->pulses;
+    tx->preset = job->preset;
+    if (tx->preset && !tx->codes && !tx->pulses)
+        tx->codes = ""; // just the preset
+
+    if (!job->file && !tx->codes && !tx->pulses) {
+        snprintf(reply, reply_size, "error no input, use file, codes, pulses, or preset\n");
+        return -1;
+    }
+    if (tx->center_frequency == 0.0 && !tx->hops_len) {
+        snprintf(reply, reply_size, "error frequency not set\n");
+        return -1;
+    }
+    if (job->file) {
+        char const *ext = strrchr(job->file, '.');
+        tx->input_format = job->format ? job->format : tx_parse_sample_format(ext ? ext + 1 : "");
+        if (!tx_valid_input_format(tx->input_format)) {
+            tx->input_format = tx_parse_sample_format("CU8");
+        }
+        tx->stream_fd = open(job->file, O_RDONLY | O_NONBLOCK);
+        if (tx->stream_fd < 0) {
+            snprintf(reply, reply_size, "error failed to open %s (%s)\n", job->file, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void job_done(void *job_ctx, unsigned job_id, tx_cmd_t *tx, int result)
+{
+    daemon_job_t *job       = job_ctx;
+    daemon_client_t *client = job->client;
+
+    struct timespec stop;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double time_ms = (double)(stop.tv_sec - job->queued.tv_sec) * 1e3 + (double)(stop.tv_nsec - job->queued.tv_nsec) / 1e6;
+
+    if (job->file) {
+        close(tx->stream_fd);
+    }
+
+    char reply[512];
+    if (result) {
+        snprintf(reply, sizeof(reply), "error id=%u transmit failed (%d)\n", job_id, result);
+    }
+    else {
+        snprintf(reply, sizeof(reply), "ok id=%u samples_written=%zu underflows=%u late_packets=%u deadline_misses=%u time_ms=%.1f\n",
+                job_id, tx->samples_written, tx->underflows, tx->late_packets, tx->deadline_misses, time_ms);
+    }
+    fprintf(stderr, "Job done: %s", reply);
+    send(client->fd, reply, strlen(reply), MSG_NOSIGNAL);
+
+    job_free(job);
+    free(job);
+
+    pthread_mutex_lock(&client->lock);
+    client->pending--;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+}
+
+static void serve_client(daemon_client_t *client)
+{
+    tx_sched_t *sched        = client->server->sched;
+    tx_cmd_t const *defaults = client->server->defaults;
+    int *flag_abort          = client->server->flag_abort;
+    int fd                   = client->fd;
+
+    FILE *in = fdopen(dup(fd), "r");
+    if (!in) {
+        perror("fdopen");
+        return;
+    }
+
+    daemon_job_t *job = NULL;
+    tx_cmd_t tx       = *defaults;
+    char reply[512]   = {0};
+    char *line        = NULL;
+    size_t line_cap   = 0;
+    unsigned lines    = 0;
+    int failed        = 0;
+
+    while (!*flag_abort && getline(&line, &line_cap, in) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (!job) {
+            job = calloc(1, sizeof(*job));
+            if (!job) {
+                fprintf(stderr, "calloc() failed\n");
+                break;
+            }
+            job->client = client;
+        }
+
+        // collect key=value lines until an empty line
+        if (*line) {
+            lines++;
+            if (failed)
+                continue;
+            char *val = strchr(line, '=');
+            if (!val) {
+                snprintf(reply, sizeof(reply), "error missing value for %s\n", line);
+                failed = 1;
+                continue;
+            }
+            *val++ = '\0';
+            char err[256];
+            if (job_set(job, &tx, line, val, err, sizeof(err))) {
+                snprintf(reply, sizeof(reply), "error %s\n", err);
+                failed = 1;
+            }
+            continue;
+        }
+        if (!lines)
+            continue; // ignore empty lines between jobs
+
+        if (!failed && !job_prepare(&tx, job, reply, sizeof(reply))) {
+            clock_gettime(CLOCK_MONOTONIC, &job->queued);
+            pthread_mutex_lock(&client->lock);
+            client->pending++;
+            pthread_mutex_unlock(&client->lock);
+            if (tx_sched_submit(sched, &tx, job->priority, job->deadline, job)) {
+                job = NULL; // replies once done
+            }
+            else {
+                pthread_mutex_lock(&client->lock);
+                client->pending--;
+                pthread_mutex_unlock(&client->lock);
+                if (job->file)
+                    close(tx.stream_fd);
+                snprintf(reply, sizeof(reply), "error failed to queue job\n");
+            }
+        }
+        if (job) {
+            fprintf(stderr, "Job failed: %s", reply);
+            send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+            job_free(job);
+            memset(job, 0, sizeof(*job));
+            job->client = client;
+        }
+
+        tx     = *defaults;
+        lines  = 0;
+        failed = 0;
+    }
+
+    if (job) {
+        job_free(job);
+        free(job);
+    }
+    free(line);
+    fclose(in);
+
+    // the replies need the connection
+    pthread_mutex_lock(&client->lock);
+    while (client->pending) {
+        pthread_cond_wait(&client->cond, &client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+static void *client_thread(void *arg)
+{
+    daemon_client_t *client = arg;
+    daemon_server_t *server = client->server;
+
+    serve_client(client);
+
+    pthread_mutex_lock(&server->lock);
+    client->done = 1;
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+// Join and free the finished clients, or all clients once the scheduler is closed.
+static void clients_reap(daemon_server_t *server, int all)
+{
+    daemon_client_t *reaped = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    daemon_client_t **p = &server->clients;
+    while (*p) {
+        daemon_client_t *client = *p;
+        if (all || client->done) {
+            *p           = client->next;
+            client->next = reaped;
+            reaped       = client;
+        }
+        else {
+            p = &client->next;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    while (reaped) {
+        daemon_client_t *client = reaped;
+        reaped                  = client->next;
+        pthread_join(client->thread, NULL);
+        close(client->fd);
+        pthread_cond_destroy(&client->cond);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+    }
+}
+
+// Serve a new connection on its own thread, the scheduler takes jobs from all clients.
+static void client_start(daemon_server_t *server, int fd)
+{
+    daemon_client_t *client = calloc(1, sizeof(*client));
+    if (!client) {
+        fprintf(stderr, "calloc() failed\n");
+        close(fd);
+        return;
+    }
+    client->server = server;
+    client->fd     = fd;
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->cond, NULL);
+
+    pthread_mutex_lock(&server->lock);
+    if (pthread_create(&client->thread, NULL, client_thread, client)) {
+        pthread_mutex_unlock(&server->lock);
+        fprintf(stderr, "Failed to start client thread\n");
+        pthread_cond_destroy(&client->cond);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+        close(fd);
+        return;
+    }
+    client->next    = server->clients;
+    server->clients = client;
+    pthread_mutex_unlock(&server->lock);
+}
+
+typedef struct daemon_runner {
+    tx_sched_t *sched;
+    int *flag_abort;
+} daemon_runner_t;
+
+static void *run_jobs(void *arg)
+{
+    daemon_runner_t *runner = arg;
+    tx_sched_run(runner->sched, runner->flag_abort);
+    return NULL;
+}
+
+int tx_daemon_run(tx_ctx_t *tx_ctx, tx_cmd_t *tx, char const *socket_path)
+{
+    struct sockaddr_un addr = {0};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(socket_path); // stale socket from an earlier run
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 4)) {
+        fprintf(stderr, "Failed to listen on %s (%s)\n", socket_path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    fprintf(stderr, "Listening for jobs on %s\n", socket_path);
+
+    tx_sched_t *sched = tx_sched_create(tx_ctx, 2, job_done);
+    if (!sched) {
+        close(sock);
+        return -1;
+    }
+    daemon_runner_t runner = {sched, &tx->flag_abort};
+    pthread_t runner_thread;
+    if (pthread_create(&runner_thread, NULL, run_jobs, &runner)) {
+        fprintf(stderr, "Failed to start job runner\n");
+        tx_sched_free(sched);
+        close(sock);
+        return -1;
+    }
+
+    daemon_server_t server = {0};
+    server.sched           = sched;
+    server.defaults        = tx;
+    server.flag_abort      = &tx->flag_abort;
+    pthread_mutex_init(&server.lock, NULL);
+
+    // signals restart the accept, poll with a timeout to notice the abort
+    while (!tx->flag_abort) {
+        clients_reap(&server, 0);
+        struct pollfd pfd = {sock, POLLIN, 0};
+        int r = poll(&pfd, 1, 100);
+        if (r < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (r <= 0)
+            continue;
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        client_start(&server, fd);
+    }
+
+    // stop reading from the clients, they still get the replies of their queued jobs
+    pthread_mutex_lock(&server.lock);
+    for (daemon_client_t *client = server.clients; client; client = client->next) {
+        shutdown(client->fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    tx_sched_close(sched);
+    pthread_join(runner_thread, NULL);
+
+    // the clients exit once their queued jobs replied
+    clients_reap(&server, 1);
+    pthread_mutex_destroy(&server.lock);
+    tx_sched_free(sched);
+
+    close(sock);
+    unlink(socket_path);
+
+    return 0;
+}
+
+#else
+
+int tx_daemon_run(tx_ctx_t *tx_ctx, tx_cmd_t *tx, char const *socket_path)
+{
+    fprintf(stderr, "Daemon mode is not supported on this platform.\n");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,47 @@
+/** @file
+    tx_tools - tx_daemon, serve transmit jobs over a local socket.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_TXDAEMON_H_
+#define INCLUDE_TXDAEMON_H_
+
+#include "tx_lib.h"
+
+/*
+    A job is a block of "key=value" lines terminated by an empty line.
+    Repeating "codes" or "pulses" appends another line of text.
+
+    Keys: file, format, codes, pulses, preset, freq, offset, hop_span, hops,
+    rate, input_rate, gain, antenna, channel, bandwidth, block, samples,
+    loops, delay, priority, deadline. Hops are "frequency:dwell_ms[:gain]"
+    separated by ",".
+
+    Jobs are queued (see tx_sched.h), a client may send further jobs
+    without waiting. Clients are served concurrently, each on its own
+    thread. A higher priority runs first, deadline is in ms from
+    submission. Each job is answered once done with a single line, either
+    "ok id=N samples_written=N underflows=N late_packets=N deadline_misses=N
+    time_ms=N"
+    or "error [id=N] message". time_ms includes the time queued.
+*/
+
+/// Serve transmit jobs on a Unix domain socket until aborted.
+/// The devices stay open between jobs, @p tx holds the job defaults.
+int tx_daemon_run(tx_ctx_t *tx_ctx, tx_cmd_t *tx, char const *socket_path);
+
+#endif /* INCLUDE_TXDAEMON_H_ */
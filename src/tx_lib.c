@@ -22,6 +22,7 @@
 #include "pulse_text.h"
 #include "code_text.h"
 #include "iq_render.h"
+#include "read_text.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
 
 #include "sdr/sdr.h"
 
@@ -150,18 +158,251 @@ int tx_transmit(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
 {
     int r = sdr_tx_setup((sdr_ctx_t *)tx_ctx, (sdr_cmd_t *)tx);
     if (r) {
-        perror("sdr_tx_setup");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "sdr_tx_setup failed (%d)\n", r);
+        return r;
     }
     r = tx_input_init(tx_ctx, tx);
-    if (r) {
-        return r;
+    // extra channels stream in the format and at the rate of the main channel
+    size_t ready = 0;
+    for (; !r && ready < tx->channels_len; ++ready) {
+        tx_cmd_t *ch      = tx->channels[ready];
+        ch->output_format = tx->output_format;
+        ch->fullScale     = tx->fullScale;
+        ch->sample_shift  = tx->sample_shift;
+        ch->block_size    = tx->block_size;
+        ch->sample_rate   = tx->sample_rate;
+        r = tx_input_init(tx_ctx, ch);
     }
-    r = sdr_tx((sdr_ctx_t *)tx_ctx, (sdr_cmd_t *)tx);
-    sdr_tx_free((sdr_ctx_t *)tx_ctx, (sdr_cmd_t *)tx);
+    if (!r) {
+        r = sdr_tx((sdr_ctx_t *)tx_ctx, (sdr_cmd_t *)tx);
+        sdr_tx_free((sdr_ctx_t *)tx_ctx, (sdr_cmd_t *)tx);
+    }
+    for (size_t i = 0; i < ready; ++i) {
+        tx_input_free(tx->channels[i]);
+    }
+    tx_input_free(tx);
     return r;
 }
 
+int tx_thread_pin(tx_cmd_t const *tx, char const *role)
+{
+    return sdr_thread_pin((sdr_cmd_t const *)tx, role);
+}
+
+int tx_mem_lock(void)
+{
+    return sdr_mem_lock();
+}
+
+void tx_mem_unlock(void)
+{
+    sdr_mem_unlock();
+}
+
+// multi-device transmit
+
+typedef struct multi_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t waiting; ///< threads not yet ready to stream
+    size_t running; ///< threads not yet done
+    int aborted;
+} multi_group_t;
+
+typedef struct multi_thread {
+    multi_group_t *group;
+    tx_ctx_t *tx_ctx;
+    tx_cmd_t *tx;
+    pthread_t thread;
+    int arrived;
+    int result;
+} multi_thread_t;
+
+// Mark a thread as ready to stream, or as never going to be, with the lock held.
+static void multi_arrive(multi_thread_t *t)
+{
+    if (!t->arrived) {
+        t->arrived = 1;
+        t->group->waiting--;
+        pthread_cond_broadcast(&t->group->cond);
+    }
+}
+
+// Start callback, waits until all devices are ready to stream.
+static void multi_start(void *start_ctx)
+{
+    multi_thread_t *t  = start_ctx;
+    multi_group_t *grp = t->group;
+
+    pthread_mutex_lock(&grp->lock);
+    multi_arrive(t);
+    while (grp->waiting && !grp->aborted) {
+        pthread_cond_wait(&grp->cond, &grp->lock);
+    }
+    pthread_mutex_unlock(&grp->lock);
+}
+
+static void *multi_run(void *arg)
+{
+    multi_thread_t *t  = arg;
+    multi_group_t *grp = t->group;
+
+    t->result = tx_transmit(t->tx_ctx, t->tx);
+
+    pthread_mutex_lock(&grp->lock);
+    multi_arrive(t); // e.g. failed before streaming
+    grp->running--;
+    pthread_cond_broadcast(&grp->cond);
+    pthread_mutex_unlock(&grp->lock);
+
+    return NULL;
+}
+
+int tx_transmit_multi(tx_ctx_t *tx_ctx, tx_cmd_t *txs, size_t count, int *flag_abort)
+{
+    multi_thread_t *threads = calloc(count, sizeof(*threads));
+    if (!threads) {
+        fprintf(stderr, "calloc() failed\n");
+        return -1;
+    }
+
+    multi_group_t grp = {0};
+    pthread_mutex_init(&grp.lock, NULL);
+    pthread_cond_init(&grp.cond, NULL);
+    grp.waiting = count;
+    grp.running = count;
+
+    pthread_mutex_lock(&grp.lock);
+    for (size_t i = 0; i < count; ++i) {
+        multi_thread_t *t = &threads[i];
+        t->group          = &grp;
+        t->tx_ctx         = tx_ctx;
+        t->tx             = &txs[i];
+        t->tx->start_cb   = multi_start;
+        t->tx->start_ctx  = t;
+        if (pthread_create(&t->thread, NULL, multi_run, t)) {
+            fprintf(stderr, "Failed to start transmit thread for %s\n", t->tx->dev_query);
+            t->result = -1;
+            multi_arrive(t);
+            grp.running--;
+            t->tx = NULL;
+        }
+    }
+
+    // pass an abort on to all devices
+    while (grp.running) {
+        if (flag_abort && *flag_abort && !grp.aborted) {
+            grp.aborted = 1;
+            for (size_t i = 0; i < count; ++i) {
+                txs[i].flag_abort = 1;
+            }
+            pthread_cond_broadcast(&grp.cond);
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000; // 100 ms
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&grp.cond, &grp.lock, &ts);
+    }
+    pthread_mutex_unlock(&grp.lock);
+
+    int ret = 0;
+    for (size_t i = 0; i < count; ++i) {
+        multi_thread_t *t = &threads[i];
+        if (t->tx) {
+            pthread_join(t->thread, NULL);
+            t->tx->start_cb  = NULL;
+            t->tx->start_ctx = NULL;
+        }
+        if (t->result) {
+            fprintf(stderr, "Transmit on %s failed (%d)\n", txs[i].dev_query, t->result);
+            ret = t->result;
+        }
+    }
+
+    pthread_cond_destroy(&grp.cond);
+    pthread_mutex_destroy(&grp.lock);
+    free(threads);
+
+    return ret;
+}
+
+// Parse a frequency with an optional k/M/G suffix, like atodu_metric() but without exiting.
+static int parse_hop_metric(char const *str, char **endptr, double *out)
+{
+    double val = strtod(str, endptr);
+    if (*endptr == str) {
+        return -1;
+    }
+    switch (**endptr) {
+    case 'k':
+    case 'K':
+        val *= 1e3;
+        (*endptr)++;
+        break;
+    case 'M':
+        val *= 1e6;
+        (*endptr)++;
+        break;
+    case 'G':
+        val *= 1e9;
+        (*endptr)++;
+        break;
+    }
+    *out = val;
+    return 0;
+}
+
+tx_hop_t *tx_parse_hops(char const *text, size_t *out_len)
+{
+    size_t count = 1;
+    for (char const *p = text; *p; ++p) {
+        if (*p == ',')
+            count++;
+    }
+
+    // one allocation for the list and the gain strings
+    size_t text_len = strlen(text) + 1;
+    tx_hop_t *hops  = calloc(1, count * sizeof(*hops) + text_len);
+    if (!hops) {
+        fprintf(stderr, "calloc() failed\n");
+        return NULL;
+    }
+    char *copy = (char *)&hops[count];
+    memcpy(copy, text, text_len);
+
+    size_t len = 0;
+    for (char *entry = copy, *next; entry; entry = next) {
+        next = strchr(entry, ',');
+        if (next) {
+            *next++ = '\0';
+        }
+        tx_hop_t *hop = &hops[len];
+        char *p       = entry;
+        if (parse_hop_metric(p, &p, &hop->frequency) || hop->frequency <= 0.0 || *p != ':') {
+            fprintf(stderr, "Invalid hop \"%s\", use frequency:dwell_ms[:gain]\n", entry);
+            free(hops);
+            return NULL;
+        }
+        hop->dwell_ms = strtod(p + 1, &p);
+        if (hop->dwell_ms <= 0.0 || (*p && *p != ':')) {
+            fprintf(stderr, "Invalid dwell in hop \"%s\"\n", entry);
+            free(hops);
+            return NULL;
+        }
+        if (*p == ':') {
+            hop->gain_str = p + 1;
+        }
+        len++;
+    }
+
+    *out_len = len;
+    return hops;
+}
+
 void tx_print(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
 {
     printf("TX command:\n");
@@ -171,27 +412,48 @@ void tx_print(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
     printf("    gain_str=\"%s\"\n", tx->gain_str);
     printf("    antenna=\"%s\"\n", tx->antenna);
     printf("    channel=%zu\n", tx->channel);
+    printf("    channels_len=%zu\n", tx->channels_len);
+    printf("    cache_dir=\"%s\"\n", tx->cache_dir);
+    printf("    iq_cal_file=\"%s\"\n", tx->iq_cal_file);
     printf("  rf setup\n");
     printf("    ppm_error=%f\n", tx->ppm_error);
     printf("    center_frequency=%f\n", tx->center_frequency);
+    printf("    freq_offset=%f\n", tx->freq_offset);
+    printf("    hop_span=%f\n", tx->hop_span);
     printf("    sample_rate=%f\n", tx->sample_rate);
     printf("    bandwidth=%f\n", tx->bandwidth);
     printf("    master_clock_rate=%f\n", tx->master_clock_rate);
     printf("    output_format=\"%s\"\n", tx->output_format);
     printf("    block_size=%zu\n", tx->block_size);
+    printf("    fifo_size=%zu\n", tx->fifo_size);
+    printf("    latency_mode=%d\n", tx->latency_mode);
     printf("  transmit control\n");
     printf("    initial_delay=%u\n", tx->initial_delay);
+    printf("    time_source=\"%s\"\n", tx->time_source);
+    printf("    rt_priority=%d\n", tx->rt_priority);
+    printf("    cpu_affinity=\"%s\"\n", tx->cpu_affinity);
     printf("    repeats=%u\n", tx->repeats);
     printf("    repeat_delay=%u\n", tx->repeat_delay);
     printf("    loops=%u\n", tx->loops);
     printf("    loop_delay=%u\n", tx->loop_delay);
+    printf("    hops_len=%zu\n", tx->hops_len);
     printf("  input from file descriptor\n");
     printf("    input_format=\"%s\"\n", tx->input_format);
     printf("    stream_fd=%i\n", tx->stream_fd);
     printf("    samples_to_write=%zu\n", tx->samples_to_write);
+    printf("    elastic_ms=%u\n", tx->elastic_ms);
+    printf("    input_rate=%f\n", tx->input_rate);
     printf("  input from buffer\n");
     printf("    stream_buffer=%p\n", tx->stream_buffer);
     printf("    buffer_size=%zu\n", tx->buffer_size);
+    printf("  input from shared memory\n");
+    printf("    shm=%p\n", tx->shm);
+    printf("  transmit statistics\n");
+    printf("    samples_written=%zu\n", tx->samples_written);
+    printf("    underflows=%u\n", tx->underflows);
+    printf("    late_packets=%u\n", tx->late_packets);
+    printf("    deadline_misses=%u\n", tx->deadline_misses);
+    printf("    drift_ppm=%.1f\n", tx->drift_ppm);
     printf("  input from text\n");
     printf("    freq_mark=%i\n", tx->freq_mark);
     printf("    freq_space=%i\n", tx->freq_space);
@@ -200,6 +462,8 @@ void tx_print(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
     printf("    phase_mark=%i\n", tx->phase_mark);
     printf("    phase_space=%i\n", tx->phase_space);
     printf("    pulses=\"%s\"\n", tx->pulses);
+    printf("  input from a playlist\n");
+    printf("    playlist=\"%s\"\n", tx->playlist);
 }
 
 void tx_cmd_free(tx_cmd_t *tx)
@@ -217,40 +481,49 @@ void tx_cmd_free(tx_cmd_t *tx)
 
 // input processing
 
-int tx_input_init(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
+static void render_setup(iq_render_t *iq_render, tx_cmd_t *tx)
 {
-    // unpack codes if requested
-    if (tx->codes) {
-        iq_render_t iq_render = {0};
-        iq_render_defaults(&iq_render);
-        iq_render.sample_rate   = tx->sample_rate;
-        iq_render.sample_format = sample_format_for(tx->output_format);
+    iq_render_defaults(iq_render);
+    iq_render->sample_rate   = tx->sample_rate;
+    iq_render->sample_format = sample_format_for(tx->output_format);
+    iq_render->align_shift   = tx->sample_shift;
 
+    // render to the device full scale, e.g. 12-bit LSB or MSB aligned
+    if (tx->fullScale > 0.0 && iq_render->sample_format != FORMAT_CF32 && iq_render->sample_format != FORMAT_CF64) {
+        // keep the rounding inside the device range, e.g. 2047.4999 for 12-bit
+        iq_render->full_scale = tx->fullScale / (1 << tx->sample_shift) - 0.5001;
+    }
+    else {
+        iq_render->full_scale = tx->fullScale;
+    }
+}
+
+// Create a render stream for code text (with a preset) or pulse text, NULL if there is none.
+// The pulse setup comes from the command.
+static iq_render_stream_t *text_render_stream(tx_ctx_t *tx_ctx, tx_cmd_t *tx, char const *preset_name, char const *codes, char const *pulses, iq_render_t *iq_render)
+{
+    // unpack codes if requested
+    if (codes) {
         symbol_t *symbols = NULL;
         preset_t *preset  = NULL;
-        if (tx->preset) {
-            preset = tx_presets_get(tx_ctx, tx->preset);
+        if (preset_name) {
+            preset = tx_presets_get(tx_ctx, preset_name);
         }
         if (preset) {
             symbols = parse_code(preset->text, symbols);
         }
 
-        symbols = parse_code(tx->codes, symbols);
+        symbols = parse_code(codes, symbols);
         output_symbol(symbols); // debug
 
-        iq_render_buf(&iq_render, symbols->tone, &tx->stream_buffer, &tx->buffer_size);
+        iq_render_stream_t *stream = iq_render_stream_create(iq_render, symbols->tone);
         free(symbols);
 
-        return 0;
+        return stream;
     }
 
     // unpack pulses if requested
-    if (tx->pulses) {
-        iq_render_t iq_render = {0};
-        iq_render_defaults(&iq_render);
-        iq_render.sample_rate   = tx->sample_rate;
-        iq_render.sample_format = sample_format_for(tx->output_format);
-
+    if (pulses) {
         pulse_setup_t pulse_setup = {0};
         pulse_setup_defaults(&pulse_setup, "OOK");
         pulse_setup.freq_mark   = tx->freq_mark;
@@ -260,14 +533,869 @@ int tx_input_init(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
         pulse_setup.phase_mark  = tx->phase_mark;
         pulse_setup.phase_space = tx->phase_space;
 
-        tone_t *tones = parse_pulses(tx->pulses, &pulse_setup);
+        tone_t *tones = parse_pulses(pulses, &pulse_setup);
         output_pulses(tones); // debug
 
-        iq_render_buf(&iq_render, tones, &tx->stream_buffer, &tx->buffer_size);
+        iq_render_stream_t *stream = iq_render_stream_create(iq_render, tones);
         free(tones);
 
+        return stream;
+    }
+
+    return NULL;
+}
+
+// Create a render stream for code or pulse input, NULL if there is none.
+static iq_render_stream_t *input_render_stream(tx_ctx_t *tx_ctx, tx_cmd_t *tx, iq_render_t *iq_render)
+{
+    return text_render_stream(tx_ctx, tx, tx->preset, tx->codes, tx->pulses, iq_render);
+}
+
+float *tx_input_render(tx_ctx_t *tx_ctx, tx_cmd_t *tx, size_t *out_samps)
+{
+    iq_render_t iq_render = {0};
+    iq_render_defaults(&iq_render);
+    iq_render.sample_rate   = tx->sample_rate;
+    iq_render.sample_format = FORMAT_CF32;
+
+    iq_render_stream_t *stream = input_render_stream(tx_ctx, tx, &iq_render);
+    if (!stream) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    size_t cap = 0;
+    float *buf = NULL;
+    for (;;) {
+        if (cap - len < iq_render.frame_size) {
+            cap       = cap ? cap * 2 : iq_render.frame_size * 4;
+            float *nb = realloc(buf, cap * 2 * sizeof(float));
+            if (!nb) {
+                fprintf(stderr, "realloc() failed\n");
+                free(buf);
+                buf = NULL;
+                len = 0;
+                break;
+            }
+            buf = nb;
+        }
+        size_t n = iq_render_stream_read(stream, &buf[len * 2], cap - len);
+        if (!n) {
+            break;
+        }
+        len += n;
+    }
+    iq_render_stream_free(stream);
+
+    *out_samps = len;
+    return buf;
+}
+
+// Render ahead on a producer thread, the device thread only copies out finished blocks.
+
+#define RENDER_AHEAD_BLOCKS 4 ///< blocks rendered ahead of the device
+#define RENDER_WAIT_MS 100    ///< longest wait for a block before a retry
+#define PACKET_LINE_MAX 4096  ///< longest line of packet code text
+
+/// An item of a playlist, a sample file or rendered text.
+typedef struct playlist_item {
+    char *name;                 ///< source as given, for messages
+    char *path;                 ///< sample file, NULL for rendered text
+    char const *format;         ///< sample format of the file
+    iq_render_stream_t *stream; ///< rendered text, NULL for a file
+    unsigned repeats;           ///< times to send the item
+    size_t gap;                 ///< samples of silence after each repeat
+    float gain;                 ///< linear gain applied to the samples
+} playlist_item_t;
+
+typedef struct render_ahead {
+    tx_cmd_t *tx;
+    iq_render_stream_t *stream;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned loops;                      ///< repeats left, the device only sees the end
+    unsigned saved_loops;                ///< loops of the command, restored when done
+    char const *saved_format;            ///< input format of the command, restored when done
+    size_t block_size;                   ///< samples per block
+    size_t elem_size;                    ///< bytes per sample in blocks
+    int native;                          ///< blocks are in the output format at the device full scale, CF32 otherwise
+    uint8_t *blocks;                     ///< ring of blocks
+    size_t lens[RENDER_AHEAD_BLOCKS];    ///< samples in each block
+    size_t head;                         ///< blocks rendered, guarded by lock
+    size_t tail;                         ///< blocks read, guarded by lock
+    size_t offset;                       ///< samples read from the tail block
+    int done;                            ///< render ended, guarded by lock
+    int stop;                            ///< render should stop, guarded by lock
+    // line packets
+    symbol_t *symbols;                   ///< symbol table for packets, NULL unless reading packets
+    iq_render_t iq_render;               ///< render setup for packets
+    int busy;                            ///< a packet is rendering, silence otherwise, guarded by lock
+    char line[PACKET_LINE_MAX];          ///< partial line of packet text
+    size_t line_len;                     ///< bytes in line
+    code_template_t code_tpl;            ///< fields of the preset, lines then only give the field data
+    iq_render_template_t *tpl;           ///< the preset rendered once, NULL without fields
+    float *packet;                       ///< rendered packet from the template, CF32
+    size_t packet_len;                   ///< samples in packet
+    size_t packet_pos;                   ///< samples copied from packet
+    // playlist
+    playlist_item_t *items;              ///< items sent back to back, NULL unless playing a list
+    size_t items_len;                    ///< number of items
+    size_t item_index;                   ///< item playing
+    unsigned repeat;                     ///< repeats of the item sent
+    int item_started;                    ///< the item is open and rewound
+    int item_fd;                         ///< sample file of the item, -1 if none
+    uint8_t *raw;                        ///< samples read from the file, before conversion
+    size_t raw_len;                      ///< bytes of a partial sample in raw
+    size_t gap_left;                     ///< samples of silence still to send
+    size_t pass_samples;                 ///< samples sent in this pass over the list
+} render_ahead_t;
+
+// Read the next line from the input into ra->line, returns -1 at the end or on stop.
+static int packet_read_line(render_ahead_t *ra)
+{
+    int fd = ra->tx->stream_fd;
+    for (;;) {
+        char *eol = memchr(ra->line, '\n', ra->line_len);
+        if (eol) {
+            return (int)(eol - ra->line);
+        }
+        if (ra->line_len == sizeof(ra->line)) {
+            fprintf(stderr, "Packet line too long, dropped\n");
+            ra->line_len = 0;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        int stop = ra->stop;
+        pthread_mutex_unlock(&ra->lock);
+        if (stop) {
+            return -1;
+        }
+
+#ifndef _WIN32
+        // poll so a stop is noticed while the input is idle
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, RENDER_WAIT_MS) == 0) {
+            continue;
+        }
+#endif
+        ssize_t n = read(fd, &ra->line[ra->line_len], sizeof(ra->line) - ra->line_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+#ifdef _WIN32
+            usleep(RENDER_WAIT_MS * 1000);
+#endif
+            continue;
+        }
+        if (n <= 0) {
+            // a last line without newline is still a packet
+            if (!ra->line_len) {
+                return -1;
+            }
+            ra->line[ra->line_len++] = '\n';
+            continue;
+        }
+        ra->line_len += (size_t)n;
+    }
+}
+
+// Copy the next block of a template packet.
+static size_t packet_copy(render_ahead_t *ra, float *block)
+{
+    size_t left = ra->packet_len - ra->packet_pos;
+    size_t n    = left < ra->block_size ? left : ra->block_size;
+    memcpy(block, &ra->packet[ra->packet_pos * 2], n * 2 * sizeof(float));
+    ra->packet_pos += n;
+    return n;
+}
+
+// Render a packet from the template with the field data in a line, e.g. "f0001862d6".
+static size_t packet_render_template(render_ahead_t *ra, char *line)
+{
+    tone_t *fields[CODE_TEMPLATE_FIELDS] = {0};
+    size_t count = 0;
+    char *p      = line;
+    for (;;) {
+        p += strspn(p, " \t\r");
+        if (!*p) {
+            break;
+        }
+        char *tok = p;
+        p += strcspn(p, " \t\r");
+        if (*p) {
+            *p++ = '\0';
+        }
+        if (count < ra->code_tpl.fields) {
+            fields[count] = code_template_field(&ra->code_tpl, count, tok, ra->symbols);
+        }
+        count++;
+    }
+
+    size_t n = 0;
+    if (count && count != ra->code_tpl.fields) {
+        fprintf(stderr, "Packet needs %zu fields, got %zu\n", ra->code_tpl.fields, count);
+    }
+    else if (count) {
+        n = iq_render_template_packet(ra->tpl, fields, &ra->packet);
+    }
+    for (size_t i = 0; i < CODE_TEMPLATE_FIELDS; ++i) {
+        free(fields[i]);
+    }
+    ra->packet_len = n;
+    ra->packet_pos = 0;
+    return n;
+}
+
+// Wait for the next packet line and render its first block, 0 at the end of input.
+static size_t packet_render_next(render_ahead_t *ra, float *block)
+{
+    iq_render_stream_free(ra->stream);
+    ra->stream     = NULL;
+    ra->packet_len = 0;
+    ra->packet_pos = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->busy = 0;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    for (;;) {
+        int len = packet_read_line(ra);
+        if (len < 0) {
+            return 0;
+        }
+        ra->line[len] = '\0';
+
+        if (ra->tpl) {
+            // only the fields render, the fixed parts are spliced in
+            size_t n = packet_render_template(ra, ra->line);
+            ra->line_len -= (size_t)len + 1;
+            memmove(ra->line, &ra->line[len + 1], ra->line_len);
+            if (n) {
+                return packet_copy(ra, block);
+            }
+            continue;
+        }
+
+        // the output of a line replaces the last, definitions carry over
+        memset(&ra->symbols[0], 0, sizeof(ra->symbols[0]));
+        parse_code(ra->line, ra->symbols);
+
+        ra->line_len -= (size_t)len + 1;
+        memmove(ra->line, &ra->line[len + 1], ra->line_len);
+
+        ra->stream = iq_render_stream_create(&ra->iq_render, ra->symbols[0].tone);
+        if (!ra->stream) {
+            return 0;
+        }
+        size_t n = iq_render_stream_read(ra->stream, block, ra->block_size);
+        if (n) {
+            return n; // empty lines are skipped
+        }
+        iq_render_stream_free(ra->stream);
+        ra->stream = NULL;
+    }
+}
+
+// Open or rewind the current playlist item, -1 if it can not be read.
+static int playlist_item_start(render_ahead_t *ra, playlist_item_t *item)
+{
+    if (item->stream) {
+        iq_render_stream_reset(item->stream);
         return 0;
     }
+    ra->raw_len = 0;
+    if (ra->item_fd >= 0) {
+        return lseek(ra->item_fd, 0, SEEK_SET) < 0 ? -1 : 0;
+    }
+    ra->item_fd = open(item->path, O_RDONLY);
+    if (ra->item_fd < 0) {
+        fprintf(stderr, "Failed to open %s (%s), skipped\n", item->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Read the next samples of the current playlist item, 0 at its end.
+static size_t playlist_item_read(render_ahead_t *ra, playlist_item_t *item, float *block)
+{
+    if (item->stream) {
+        return iq_render_stream_read(item->stream, block, ra->block_size);
+    }
+    size_t elem_size = sample_format_length(sample_format_for(item->format));
+    for (;;) {
+        ssize_t r = read(ra->item_fd, &ra->raw[ra->raw_len], ra->block_size * elem_size - ra->raw_len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return 0; // a partial last sample is dropped
+        }
+        ra->raw_len += (size_t)r;
+        size_t n = ra->raw_len / elem_size;
+        if (!n) {
+            continue;
+        }
+        sdr_format_to_cf32(item->format, ra->raw, block, n);
+        ra->raw_len -= n * elem_size;
+        memmove(ra->raw, &ra->raw[n * elem_size], ra->raw_len);
+        return n;
+    }
+}
+
+static void playlist_item_end(render_ahead_t *ra)
+{
+    if (ra->item_fd >= 0) {
+        close(ra->item_fd);
+        ra->item_fd = -1;
+    }
+    ra->item_index++;
+    ra->repeat       = 0;
+    ra->item_started = 0;
+}
+
+// Fill a block from the playlist, items and their gaps back to back, 0 at the end.
+static size_t playlist_fill(render_ahead_t *ra, float *block)
+{
+    for (;;) {
+        if (ra->gap_left) {
+            size_t n = ra->gap_left < ra->block_size ? ra->gap_left : ra->block_size;
+            memset(block, 0, n * 2 * sizeof(float));
+            ra->gap_left -= n;
+            return n;
+        }
+        if (ra->item_index == ra->items_len) {
+            // start over for loops, unless nothing could be sent
+            if (!ra->loops || !ra->pass_samples) {
+                return 0;
+            }
+            ra->loops--;
+            ra->item_index   = 0;
+            ra->pass_samples = 0;
+        }
+
+        playlist_item_t *item = &ra->items[ra->item_index];
+        if (!ra->item_started) {
+            if (playlist_item_start(ra, item)) {
+                playlist_item_end(ra);
+                continue;
+            }
+            if (!ra->repeat) {
+                fprintf(stderr, "Playlist item %zu: %s\n", ra->item_index + 1, item->name);
+            }
+            ra->item_started = 1;
+        }
+
+        size_t n = playlist_item_read(ra, item, block);
+        if (n) {
+            if (item->gain != 1.0f) {
+                for (size_t i = 0; i < n * 2; ++i) {
+                    block[i] *= item->gain;
+                }
+            }
+            ra->pass_samples += n;
+            return n;
+        }
+
+        // end of a repeat, the gap follows
+        ra->gap_left     = item->gap;
+        ra->item_started = 0;
+        if (++ra->repeat >= item->repeats) {
+            playlist_item_end(ra);
+        }
+    }
+}
+
+static void *render_ahead_thread(void *arg)
+{
+    render_ahead_t *ra = arg;
+    tx_thread_pin(ra->tx, "render");
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        if (ra->head - ra->tail >= RENDER_AHEAD_BLOCKS) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        size_t slot = ra->head % RENDER_AHEAD_BLOCKS;
+        pthread_mutex_unlock(&ra->lock);
+
+        // only this thread writes to free slots
+        void *block  = &ra->blocks[slot * ra->block_size * ra->elem_size];
+        size_t n     = ra->items                         ? playlist_fill(ra, block)
+                       : ra->stream                      ? iq_render_stream_read(ra->stream, block, ra->block_size)
+                       : ra->packet_pos < ra->packet_len ? packet_copy(ra, block)
+                                                         : 0;
+        if (!n && ra->loops && ra->stream) {
+            iq_render_stream_reset(ra->stream);
+            ra->loops--;
+            n = iq_render_stream_read(ra->stream, block, ra->block_size);
+        }
+        if (!n && ra->symbols) {
+            n = packet_render_next(ra, block);
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if (!n) {
+            ra->done = 1;
+            pthread_cond_broadcast(&ra->cond);
+            break;
+        }
+        ra->lens[slot] = n;
+        ra->head++;
+        ra->busy = ra->symbols != NULL;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+// Read callback, copies rendered samples, 0 at the end, -1 if none are ready yet.
+// Between packets there is silence right away, a packet then starts within a block.
+static ssize_t render_ahead_read(void *read_ctx, void *buf, size_t n_samps)
+{
+    render_ahead_t *ra = read_ctx;
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += RENDER_WAIT_MS * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&ra->lock);
+    while (ra->head == ra->tail && !ra->done && !ra->tx->flag_abort) {
+        if (ra->symbols && !ra->busy) {
+            pthread_mutex_unlock(&ra->lock);
+            memset(buf, 0, n_samps * ra->elem_size);
+            return (ssize_t)n_samps;
+        }
+        if (pthread_cond_timedwait(&ra->cond, &ra->lock, &until)) {
+            break;
+        }
+    }
+    if (ra->head == ra->tail) {
+        int done = ra->done;
+        pthread_mutex_unlock(&ra->lock);
+        return done ? 0 : -1;
+    }
+    size_t slot = ra->tail % RENDER_AHEAD_BLOCKS;
+    pthread_mutex_unlock(&ra->lock);
+
+    // only this thread reads from filled slots
+    size_t left = ra->lens[slot] - ra->offset;
+    size_t n    = n_samps < left ? n_samps : left;
+    memcpy(buf, &ra->blocks[(slot * ra->block_size + ra->offset) * ra->elem_size], n * ra->elem_size);
+    ra->offset += n;
+
+    if (ra->offset == ra->lens[slot]) {
+        ra->offset = 0;
+        pthread_mutex_lock(&ra->lock);
+        ra->tail++;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+    }
+    return (ssize_t)n;
+}
+
+static void render_ahead_free(render_ahead_t *ra)
+{
+    iq_render_stream_free(ra->stream);
+    free_symbols(ra->symbols);
+    iq_render_template_free(ra->tpl);
+    free_code_template(&ra->code_tpl);
+    for (size_t i = 0; i < ra->items_len; ++i) {
+        free(ra->items[i].name);
+        free(ra->items[i].path);
+        iq_render_stream_free(ra->items[i].stream);
+    }
+    free(ra->items);
+    if (ra->item_fd >= 0) {
+        close(ra->item_fd);
+    }
+    free(ra->raw);
+    free(ra->blocks);
+    free(ra);
+}
+
+// Setup for rendering ahead, the caller then sets a stream, packet symbols, or playlist items.
+static render_ahead_t *render_ahead_new(tx_cmd_t *tx, iq_render_t const *iq_render)
+{
+    render_ahead_t *ra = calloc(1, sizeof(*ra));
+    if (!ra) {
+        fprintf(stderr, "calloc() failed\n");
+        return NULL;
+    }
+    ra->tx           = tx;
+    ra->iq_render    = *iq_render;
+    ra->item_fd      = -1;
+    ra->loops        = tx->loops;
+    ra->saved_loops  = tx->loops;
+    ra->saved_format = tx->input_format;
+    ra->block_size   = tx->block_size;
+    ra->elem_size    = sample_format_length(iq_render->sample_format);
+    ra->blocks       = malloc(RENDER_AHEAD_BLOCKS * tx->block_size * ra->elem_size);
+    if (!ra->blocks) {
+        fprintf(stderr, "malloc() failed\n");
+        render_ahead_free(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+// Start rendering on a producer thread, the render setup is taken over, also on error.
+// With a stream it is rendered and looped. With a symbol table instead, packets of code text
+// are read from stream_fd line by line, or with a code template just the field data.
+// With playlist items they are sent back to back.
+static int input_render_ahead(tx_cmd_t *tx, render_ahead_t *ra)
+{
+    if (ra->code_tpl.fields) {
+        ra->tpl = iq_render_template_create(&ra->iq_render, ra->code_tpl.parts, ra->code_tpl.fields);
+        if (!ra->tpl) {
+            render_ahead_free(ra);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if (pthread_create(&ra->thread, NULL, render_ahead_thread, ra)) {
+        fprintf(stderr, "Failed to start the render thread\n");
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->cond);
+        render_ahead_free(ra);
+        return -1;
+    }
+
+    // code and pulse input renders ready for the device, packets and playlists are normalized for the conversion
+    tx->render_ahead = ra;
+    tx->read_cb      = render_ahead_read;
+    tx->read_ctx     = ra;
+    tx->read_native  = ra->native;
+    tx->input_format = ra->native ? tx->output_format : "CF32";
+    tx->loops        = 0;
+    return 0;
+}
+
+static void input_render_ahead_stop(tx_cmd_t *tx)
+{
+    render_ahead_t *ra = tx->render_ahead;
+    if (!ra) {
+        return;
+    }
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond);
+    tx->render_ahead = NULL;
+    tx->read_cb      = NULL;
+    tx->read_ctx     = NULL;
+    tx->read_native  = 0;
+    tx->input_format = ra->saved_format;
+    tx->loops        = ra->saved_loops;
+    render_ahead_free(ra);
+}
+
+// Symbol table for line packets, from the preset if any, without output of its own.
+// A preset with variable fields, e.g. "{MC @}", is a template, see parse_code_template().
+static symbol_t *input_packet_symbols(tx_ctx_t *tx_ctx, tx_cmd_t *tx, code_template_t *code_tpl)
+{
+    if (tx->stream_fd < 0) {
+        fprintf(stderr, "Line packets need an input.\n");
+        return NULL;
+    }
+    preset_t *preset = NULL;
+    if (tx->preset) {
+        preset = tx_presets_get(tx_ctx, tx->preset);
+    }
+    symbol_t *symbols = parse_code_template(preset ? preset->text : "", NULL, code_tpl);
+    if (!symbols) {
+        fprintf(stderr, "Failed to parse the packet template\n");
+        return NULL;
+    }
+    if (code_tpl->fields) {
+        fprintf(stderr, "Packet template with %zu fields\n", code_tpl->fields);
+    }
+    else {
+        free_code_template(code_tpl); // the preset output is not sent
+    }
+    memset(&symbols[0], 0, sizeof(symbols[0]));
+    return symbols;
+}
+
+// Parse a playlist option, e.g. "gap=500", returns 1 if the token is an option, -1 if it is invalid.
+static int playlist_option(playlist_item_t *item, char const *tok, double sample_rate)
+{
+    char const *val;
+    char *end;
+    if (!strncmp(tok, "repeats=", 8)) {
+        val          = &tok[8];
+        long repeats = strtol(val, &end, 10);
+        if (repeats < 1) {
+            return -1;
+        }
+        item->repeats = (unsigned)repeats;
+    }
+    else if (!strncmp(tok, "gap=", 4)) {
+        val           = &tok[4];
+        double gap_ms = strtod(val, &end);
+        if (gap_ms < 0.0) {
+            return -1;
+        }
+        item->gap = (size_t)(gap_ms * sample_rate / 1000.0 + 0.5);
+    }
+    else if (!strncmp(tok, "gain=", 5)) {
+        val        = &tok[5];
+        item->gain = (float)pow(10.0, strtod(val, &end) / 20.0);
+    }
+    else {
+        return 0;
+    }
+    return end == val || *end ? -1 : 1;
+}
+
+// Parse a playlist source, a sample file relative to the playlist, or "preset:", "code:", "pulses:" text.
+static int playlist_source(tx_ctx_t *tx_ctx, tx_cmd_t *tx, render_ahead_t *ra, playlist_item_t *item, char const *src, size_t dir_len)
+{
+    if (!strncmp(src, "preset:", 7)) {
+        if (!tx_presets_get(tx_ctx, &src[7])) {
+            fprintf(stderr, "Unknown preset \"%s\"\n", &src[7]);
+            return -1;
+        }
+        item->stream = text_render_stream(tx_ctx, tx, &src[7], "", NULL, &ra->iq_render);
+        return item->stream ? 0 : -1;
+    }
+    if (!strncmp(src, "code:", 5)) {
+        item->stream = text_render_stream(tx_ctx, tx, tx->preset, &src[5], NULL, &ra->iq_render);
+        return item->stream ? 0 : -1;
+    }
+    if (!strncmp(src, "pulses:", 7)) {
+        item->stream = text_render_stream(tx_ctx, tx, NULL, NULL, &src[7], &ra->iq_render);
+        return item->stream ? 0 : -1;
+    }
+
+    // the format from a "FMT:" prefix or the file extension, like input files
+    char *spec = strdup(src);
+    if (!spec) {
+        fprintf(stderr, "strdup() failed\n");
+        return -1;
+    }
+    char *path   = spec;
+    item->format = sample_format_str(file_info(&path));
+    if (!tx_valid_input_format(item->format)) {
+        fprintf(stderr, "Unknown sample format of \"%s\"\n", src);
+        free(spec);
+        return -1;
+    }
+    if (*path == '/') {
+        dir_len = 0;
+    }
+    item->path = malloc(dir_len + strlen(path) + 1);
+    if (item->path) {
+        memcpy(item->path, tx->playlist, dir_len);
+        strcpy(&item->path[dir_len], path);
+    }
+    free(spec);
+    if (!item->path) {
+        fprintf(stderr, "malloc() failed\n");
+        return -1;
+    }
+    if (access(item->path, R_OK)) {
+        fprintf(stderr, "Can not read %s\n", item->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Load the playlist items, one per line of "[repeats=N] [gap=MS] [gain=DB] SOURCE".
+static int input_playlist(tx_ctx_t *tx_ctx, tx_cmd_t *tx, render_ahead_t *ra)
+{
+    char *text = access(tx->playlist, R_OK) ? NULL : read_text_file(tx->playlist);
+    if (!text) {
+        fprintf(stderr, "Failed to read playlist %s\n", tx->playlist);
+        return -1;
+    }
+    char const *slash = strrchr(tx->playlist, '/');
+    size_t dir_len    = slash ? (size_t)(slash - tx->playlist) + 1 : 0;
+
+    int ret    = 0;
+    size_t cap = 0;
+    int lineno = 0;
+    char *next = text;
+    while (next && !ret) {
+        char *line = next;
+        next       = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        lineno++;
+        line += strspn(line, " \t\r");
+        size_t len = strlen(line);
+        while (len && strchr(" \t\r", line[len - 1])) {
+            line[--len] = '\0';
+        }
+        if (!*line || *line == '#') {
+            continue;
+        }
+
+        if (ra->items_len == cap) {
+            cap                     = cap ? cap * 2 : 16;
+            playlist_item_t *items  = realloc(ra->items, cap * sizeof(*items));
+            if (!items) {
+                fprintf(stderr, "realloc() failed\n");
+                ret = -1;
+                break;
+            }
+            ra->items = items;
+        }
+        playlist_item_t *item = &ra->items[ra->items_len++];
+        *item                 = (playlist_item_t){.repeats = 1, .gain = 1.0f};
+
+        // options up to the source, the source is the rest of the line
+        for (;;) {
+            size_t tok_len = strcspn(line, " \t");
+            char save      = line[tok_len];
+            line[tok_len]  = '\0';
+            int opt        = playlist_option(item, line, tx->sample_rate);
+            line[tok_len]  = save;
+            if (opt < 0) {
+                fprintf(stderr, "Invalid option in playlist line %d\n", lineno);
+                ret = -1;
+                break;
+            }
+            if (!opt || !save) {
+                break;
+            }
+            line += tok_len;
+            line += strspn(line, " \t");
+        }
+        if (ret) {
+            break;
+        }
+        item->name = strdup(line);
+        if (!item->name || playlist_source(tx_ctx, tx, ra, item, line, dir_len)) {
+            fprintf(stderr, "Invalid source in playlist line %d\n", lineno);
+            ret = -1;
+        }
+    }
+    free(text);
+
+    if (!ret && !ra->items_len) {
+        fprintf(stderr, "Empty playlist %s\n", tx->playlist);
+        ret = -1;
+    }
+
+    // room to read a block of the widest sample file
+    size_t elem_size = 0;
+    for (size_t i = 0; i < ra->items_len; ++i) {
+        size_t size = ra->items[i].path ? sample_format_length(sample_format_for(ra->items[i].format)) : 0;
+        elem_size   = size > elem_size ? size : elem_size;
+    }
+    if (!ret && elem_size) {
+        ra->raw = malloc(ra->block_size * elem_size);
+        if (!ra->raw) {
+            fprintf(stderr, "malloc() failed\n");
+            ret = -1;
+        }
+    }
+    if (!ret) {
+        fprintf(stderr, "Playlist of %zu items\n", ra->items_len);
+    }
+    return ret;
+}
+
+// Render all of the render stream to memory, hops then never wait on the renderer.
+static int input_prerender(tx_cmd_t *tx)
+{
+    size_t elem_size = sample_format_length(sample_format_for(tx->output_format));
+    size_t len       = 0;
+    size_t cap       = 0;
+    uint8_t *buf     = NULL;
+    for (;;) {
+        if (cap - len < tx->block_size) {
+            cap         = cap ? cap * 2 : tx->block_size * 4;
+            uint8_t *nb = realloc(buf, cap * elem_size);
+            if (!nb) {
+                fprintf(stderr, "realloc() failed\n");
+                free(buf);
+                return -1;
+            }
+            buf = nb;
+        }
+        size_t n = iq_render_stream_read(tx->render_stream, &buf[len * elem_size], cap - len);
+        if (!n) {
+            break;
+        }
+        len += n;
+    }
+    iq_render_stream_free(tx->render_stream);
+    tx->render_stream = NULL;
+
+    tx->prerender     = buf;
+    tx->stream_buffer = buf;
+    tx->buffer_offset = 0;
+    tx->buffer_size   = len * elem_size;
+    return 0;
+}
+
+int tx_input_init(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
+{
+    // render codes or pulses if requested
+    if ((tx->codes || tx->pulses) && tx->hops_len) {
+        iq_render_t iq_render = {0};
+        render_setup(&iq_render, tx);
+
+        tx->render_stream = input_render_stream(tx_ctx, tx, &iq_render);
+        return tx->render_stream ? input_prerender(tx) : -1;
+    }
+    if ((tx->line_packets || tx->playlist) && tx->hops_len) {
+        fprintf(stderr, "Line packets and playlists can not hop.\n");
+        return -1;
+    }
+    if (tx->codes || tx->pulses || tx->line_packets || tx->playlist) {
+        // code and pulse input renders straight to the device format, packets and playlists mix sources in CF32
+        iq_render_t iq_render = {0};
+        if (tx->line_packets || tx->playlist) {
+            iq_render_defaults(&iq_render);
+            iq_render.sample_rate   = tx->sample_rate;
+            iq_render.sample_format = FORMAT_CF32;
+        }
+        else {
+            render_setup(&iq_render, tx);
+        }
+
+        render_ahead_t *ra = render_ahead_new(tx, &iq_render);
+        if (!ra) {
+            return -1;
+        }
+        ra->native = !tx->line_packets && !tx->playlist;
+        if (tx->playlist) {
+            if (input_playlist(tx_ctx, tx, ra)) {
+                render_ahead_free(ra);
+                return -1;
+            }
+        }
+        else if (tx->line_packets) {
+            ra->loops   = 0;
+            ra->symbols = input_packet_symbols(tx_ctx, tx, &ra->code_tpl);
+            if (!ra->symbols) {
+                render_ahead_free(ra);
+                return -1;
+            }
+        }
+        else {
+            ra->stream = input_render_stream(tx_ctx, tx, &ra->iq_render);
+            if (!ra->stream) {
+                render_ahead_free(ra);
+                return -1;
+            }
+        }
+        if (input_render_ahead(tx, ra)) {
+            return -1;
+        }
+        // fall through to the conversion setup, if any
+    }
 
     // otherwise: setup stream conversion
 
@@ -291,3 +1419,20 @@ int tx_input_init(tx_ctx_t *tx_ctx, tx_cmd_t *tx)
 
     return 0;
 }
+
+void tx_input_free(tx_cmd_t *tx)
+{
+    input_render_ahead_stop(tx);
+    iq_render_stream_free(tx->render_stream);
+    tx->render_stream = NULL;
+
+    if (tx->prerender) {
+        free(tx->prerender);
+        tx->prerender     = NULL;
+        tx->stream_buffer = NULL;
+        tx->buffer_size   = 0;
+    }
+
+    free(tx->conv_buf.u8);
+    tx->conv_buf.u8 = NULL;
+}
@@ -41,6 +41,8 @@ typedef struct tx_dev {
     char *driver_key;
     char *hardware_key;
     char *hardware_info;
+    void *priv; ///< private backend state
+    double lo_frequency; ///< private, LO frequency of the last transmit, 0 if unknown
 } tx_dev_t;
 
 typedef struct tx_ctx {
@@ -49,6 +51,13 @@ typedef struct tx_ctx {
     preset_t *presets;
 } tx_ctx_t;
 
+/// A dwell on one frequency in a hop list.
+typedef struct tx_hop {
+    double frequency;     ///< center frequency in Hz
+    double dwell_ms;      ///< time on this frequency in ms
+    char const *gain_str; ///< gain on this frequency, NULL to keep
+} tx_hop_t;
+
 typedef struct tx_cmd {
     // device selection
     char const *dev_query;
@@ -56,36 +65,79 @@ typedef struct tx_cmd {
     char const *gain_str;
     char const *antenna;
     size_t channel;
+    size_t channels_len; ///< number of extra channels streamed along, 0 for none
+    struct tx_cmd **channels; ///< extra channels, each with channel, gain, antenna, and input set
+    char const *cache_dir; ///< calibration cache directory, NULL for default, "" to disable
+    char const *iq_cal_file; ///< IQ imbalance and DC offset corrections by device, channel, and frequency, NULL for none
     // rf setup
     double ppm_error;
     double center_frequency;
+    double freq_offset; ///< digital frequency offset in Hz, mixed in software
+    double hop_span;    ///< frequency-agile: keep the LO while targets are within this span in Hz, 0 to always tune
     double sample_rate;
     double bandwidth;
     double master_clock_rate;
     char const *output_format; ///< force output format if set
     size_t block_size;         ///< force output block size if set
+    size_t fifo_size;          ///< device FIFO size in samples, 0 for default
+    int latency_mode;          ///< 0 balanced, 1 low latency, 2 throughput
     // transmit control
-    unsigned initial_delay;
+    unsigned initial_delay; ///< delay of the first sample in ms, 0 for untimed
+    char const *time_source; ///< set the device time to 0 on this event (e.g. "PPS") before a timed start, NULL for none
+    int rt_priority;          ///< real-time priority of the device thread (1-99), also locks memory, 0 for none
+    int rt_round_robin;       ///< use SCHED_RR instead of SCHED_FIFO
+    char const *cpu_affinity; ///< pin threads by role, e.g. "device=2,status=3,render=0-1", NULL for none
     unsigned repeats;
     unsigned repeat_delay;
     unsigned loops;
     unsigned loop_delay;
+    size_t hops_len; ///< number of hops, 0 for a fixed frequency
+    struct tx_hop const *hops; ///< frequency hops, cycled until the input ends
+    struct tx_hop const *retune; ///< retune before the next read, e.g. set by read_cb between jobs, cleared once done
     // input from file descriptor
     char const *input_format;
     int stream_fd;
     size_t samples_to_write;
+    unsigned elastic_ms; ///< keep this much input latency in ms and track the input clock, 0 for none
+    double input_rate;   ///< sample rate of the input, resampled to sample_rate, 0 if the same
     // input from buffer
     void *stream_buffer;
     size_t buffer_offset;
     size_t buffer_size;
+    // input from shared memory
+    void *shm; ///< tx_shm_t ring to read from in place, if set, see tx_shm.h
+    // input from renderer
+    void *render_stream; ///< iq_render_stream_t to render from, if set
+    // input from callback
+    ssize_t (*read_cb)(void *read_ctx, void *buf, size_t n_samps); ///< read n_samps in input_format, returns samples, 0 at end, -1 to retry
+    void *read_ctx; ///< context for read_cb
+    int read_native; ///< read_cb gives samples in output_format at the device full scale, no conversion
+    // shared start
+    void (*start_cb)(void *start_ctx); ///< called when ready to stream, e.g. to wait for other devices
+    void *start_ctx; ///< context for start_cb
+    // transmit statistics
+    size_t samples_written; ///< samples accepted by the device
+    unsigned underflows;    ///< underflows reported by the device
+    unsigned late_packets;  ///< late packets (time errors) reported by the device
+    unsigned deadline_misses; ///< input blocks that took longer to read than to transmit
+    double drift_ppm;         ///< input clock against the device clock, measured by the elastic buffer
     // private
     double fullScale;
+    unsigned sample_shift; ///< private, MSB alignment of device samples
+    double nco_phase; ///< private, phase of the frequency offset mixer in cycles
+    size_t hop_index; ///< private, the current hop
+    size_t hop_left;  ///< private, samples left in the current dwell
+    double worst_load; ///< private, worst ratio of input time to airtime of a block
+    void *elastic;     ///< private, elastic buffer state
+    void *resampler;   ///< private, sample rate converter state
+    void *iq_cal;      ///< private, IQ correction table and current coefficients
     int flag_abort; ///< private
     frame_t conv_buf;
 
     // input from code text
     char const *preset; ///< preset name to load, if any
     char const *codes; ///< code text
+    int line_packets; ///< read lines of code text from stream_fd, each sent as a packet on arrival, silence in between
     // input from pulse text (OOK, ASK, FSK, PSK)
     int freq_mark;   ///< frequency offset for mark
     int freq_space;  ///< frequency offset for space, 0 otherwise
@@ -94,6 +146,10 @@ typedef struct tx_cmd {
     int phase_mark;  ///< phase offset for mark, 0 otherwise
     int phase_space; ///< phase offset for space, 0 otherwise
     char const *pulses; ///< pulse text or code text
+    // input from a playlist
+    char const *playlist; ///< playlist file, items of sample files, presets, code, or pulses sent back to back
+    void *prerender; ///< private, pre-rendered input owned by tx_input_init()
+    void *render_ahead; ///< private, render thread feeding read_cb, owned by tx_input_init()
 } tx_cmd_t;
 
 /// Show all available backends.
@@ -126,6 +182,25 @@ int tx_free_devices(tx_ctx_t *tx_ctx);
 /// Transmit data.
 int tx_transmit(tx_ctx_t *tx_ctx, tx_cmd_t *tx);
 
+/// Transmit on several devices at once, each command on its own thread.
+/// Streaming starts when all devices are ready, set initial_delay (and time_source) for a timed start.
+/// An abort flag, if given, is passed on to all commands.
+int tx_transmit_multi(tx_ctx_t *tx_ctx, tx_cmd_t *txs, size_t count, int *flag_abort);
+
+/// Parse a hop list, e.g. "433.92M:20:30,434.1M:20" for frequency:dwell_ms[:gain] entries.
+/// Returns an allocated list to free(), NULL on error.
+tx_hop_t *tx_parse_hops(char const *text, size_t *out_len);
+
+/// Pin the calling thread to the CPUs set for a role ("device", "status", or "render") in cpu_affinity.
+int tx_thread_pin(tx_cmd_t const *tx, char const *role);
+
+/// Lock all current and future memory, counted, the last tx_mem_unlock() unlocks.
+/// Returns 0 if the lock is held, -1 on error.
+int tx_mem_lock(void);
+
+/// Release a memory lock from tx_mem_lock().
+void tx_mem_unlock(void);
+
 /// Print transmit data (debug).
 void tx_print(tx_ctx_t *tx_ctx, tx_cmd_t *tx);
 
@@ -148,4 +223,10 @@ preset_t *tx_presets_get(tx_ctx_t *tx_ctx, char const *name);
 /// Prepare input data.
 int tx_input_init(tx_ctx_t *tx_ctx, tx_cmd_t *tx);
 
+/// Release input data.
+void tx_input_free(tx_cmd_t *tx);
+
+/// Render code or pulse input to an allocated buffer of CF32 I/Q samples, NULL if there is none.
+float *tx_input_render(tx_ctx_t *tx_ctx, tx_cmd_t *tx, size_t *out_samps);
+
 #endif /* INCLUDE_TXLIB_H_ */
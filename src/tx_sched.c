@@ -0,0 +1,533 @@
+/** @file
+    tx_tools - tx_sched, a priority scheduler for transmit jobs.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tx_sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SCHED_MAX_READY 4 ///< pre-rendered jobs to keep ahead of the stream
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_RENDERING,
+    JOB_READY,
+    JOB_FAILED,
+};
+
+typedef struct sched_job {
+    struct sched_job *next;
+    tx_cmd_t cmd;
+    void *job_ctx;
+    unsigned id;
+    int priority;
+    uint64_t deadline; ///< ms since the epoch, 0 for none
+    enum job_state state;
+    float *samples; ///< pre-rendered CF32 I/Q
+    size_t n_samps;
+    size_t pos;
+    unsigned loops;
+    size_t written;
+} sched_job_t;
+
+struct tx_sched {
+    tx_ctx_t *tx_ctx;
+    tx_sched_done_fn done_cb;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sched_job_t *queue;   ///< jobs not transmitting yet, unordered
+    sched_job_t *active;  ///< job feeding the stream
+    tx_cmd_t *direct;     ///< job transmitting on its own
+    unsigned next_id;
+    int closed;
+    int quit;
+    int *flag_abort;
+    tx_cmd_t stream_req;  ///< setup requested for the current stream
+    tx_cmd_t stream;      ///< the current stream
+    tx_hop_t retune;      ///< frequency and gain of the next job, if the stream retunes for it
+    char *stream_gain;    ///< copy of the gain of the stream, the job's own ends with it
+    char *stream_antenna; ///< copy of the antenna of the stream
+    char *retune_gain;    ///< copy of the gain of the last retune
+    pthread_t *workers;
+    unsigned workers_len;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Wait for a change for at most ms, with the lock held.
+static void sched_wait(tx_sched_t *sched, unsigned ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&sched->cond, &sched->lock, &ts);
+}
+
+static int is_render_job(tx_cmd_t const *tx)
+{
+    return tx->codes || tx->pulses;
+}
+
+static int str_equal(char const *a, char const *b)
+{
+    if (!a || !b)
+        return a == b;
+    return !strcmp(a, b);
+}
+
+static int num_equal(double a, double b)
+{
+    return fabs(a - b) < 1e-6 * (fabs(a) + 1.0);
+}
+
+// Can job b be spliced onto a stream set up for a? Frequency and gain may differ, the stream retunes.
+static int is_compatible(tx_cmd_t const *a, tx_cmd_t const *b)
+{
+    return is_render_job(b)
+            && !a->hops_len && !b->hops_len
+            && str_equal(a->dev_query, b->dev_query)
+            && str_equal(a->antenna, b->antenna)
+            && str_equal(a->output_format, b->output_format)
+            && a->channel == b->channel
+            && num_equal(a->ppm_error, b->ppm_error)
+            && num_equal(a->hop_span, b->hop_span)
+            && num_equal(a->sample_rate, b->sample_rate)
+            && num_equal(a->bandwidth, b->bandwidth);
+}
+
+// Software frequency offset to reach job b on the stream, which is tuned to lo_frequency.
+static double job_offset(tx_cmd_t const *b, double lo_frequency)
+{
+    return b->center_frequency + b->freq_offset - lo_frequency;
+}
+
+// Can job b be reached on a stream set up for a, without retuning?
+static int is_reachable(tx_cmd_t const *a, tx_cmd_t const *b, double lo_frequency)
+{
+    if (num_equal(b->center_frequency, lo_frequency))
+        return 1; // an offset of the job is mixed in software
+    // frequency-agile: mix in software within the hop span
+    double span = a->hop_span < a->sample_rate ? a->hop_span : a->sample_rate;
+    return a->hop_span > 0.0 && fabs(job_offset(b, lo_frequency)) <= span / 2;
+}
+
+// Is job a before job b?
+static int job_before(sched_job_t const *a, sched_job_t const *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    if (a->deadline != b->deadline) {
+        if (!a->deadline)
+            return 0;
+        if (!b->deadline)
+            return 1;
+        return a->deadline < b->deadline;
+    }
+    return a->id < b->id;
+}
+
+// The next job to run, or the next one to pre-render.
+static sched_job_t *next_job(tx_sched_t *sched, int to_render)
+{
+    sched_job_t *best = NULL;
+    for (sched_job_t *job = sched->queue; job; job = job->next) {
+        if (to_render && (job->state != JOB_QUEUED || !is_render_job(&job->cmd)))
+            continue;
+        if (!best || job_before(job, best))
+            best = job;
+    }
+    return best;
+}
+
+static unsigned count_ready(tx_sched_t *sched)
+{
+    unsigned count = 0;
+    for (sched_job_t *job = sched->queue; job; job = job->next) {
+        if (job->state == JOB_READY)
+            count++;
+    }
+    return count;
+}
+
+static void unlink_job(tx_sched_t *sched, sched_job_t *job)
+{
+    for (sched_job_t **p = &sched->queue; *p; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            job->next = NULL;
+            return;
+        }
+    }
+}
+
+// Report and free a job, call without the lock held.
+static void job_done(tx_sched_t *sched, sched_job_t *job, int result)
+{
+    job->cmd.samples_written = job->written;
+    if (sched->done_cb) {
+        sched->done_cb(job->job_ctx, job->id, &job->cmd, result);
+    }
+    free(job->samples);
+    free(job);
+}
+
+// Replace a copy of a string, NULL stays NULL.
+static char *str_keep(char **copy, char const *str)
+{
+    free(*copy);
+    *copy = str ? strdup(str) : NULL;
+    return *copy;
+}
+
+static void job_start(tx_sched_t *sched, sched_job_t *job)
+{
+    if (job->deadline && now_ms() > job->deadline) {
+        fprintf(stderr, "Job %u started %u ms after its deadline\n", job->id, (unsigned)(now_ms() - job->deadline));
+    }
+    job->loops    = job->cmd.loops;
+    sched->active = job;
+}
+
+// Input callback of the stream, splices compatible jobs gaplessly.
+static ssize_t sched_read(void *read_ctx, void *buf, size_t n_samps)
+{
+    tx_sched_t *sched = read_ctx;
+    float *out        = buf;
+    size_t n          = 0;
+
+    pthread_mutex_lock(&sched->lock);
+    while (n < n_samps) {
+        if (*sched->flag_abort) {
+            sched->stream.flag_abort = 1;
+            break;
+        }
+
+        sched_job_t *job = sched->active;
+        if (!job) {
+            job = next_job(sched, 0);
+            // while transmitting, the stream's center frequency is the tuned LO
+            double lo_frequency = sched->stream.center_frequency;
+            if (!job || !is_compatible(&sched->stream_req, &job->cmd)) {
+                break; // ends the stream
+            }
+            if (job->state == JOB_QUEUED || job->state == JOB_RENDERING) {
+                if (n) {
+                    break; // send what we have
+                }
+                sched_wait(sched, 10);
+                continue;
+            }
+            // out of reach of the LO or at another gain, the device retunes before the job's first block
+            if (!sched->stream.retune
+                    && (!is_reachable(&sched->stream_req, &job->cmd, lo_frequency)
+                            || (job->cmd.gain_str && !str_equal(job->cmd.gain_str, sched->stream.gain_str)))) {
+                sched->retune.frequency        = job->cmd.center_frequency;
+                sched->retune.gain_str         = job->cmd.gain_str ? str_keep(&sched->retune_gain, job->cmd.gain_str) : NULL;
+                sched->stream.retune           = &sched->retune;
+                sched->stream.center_frequency = job->cmd.center_frequency;
+                if (sched->retune.gain_str) {
+                    sched->stream.gain_str = sched->retune.gain_str;
+                }
+            }
+            if (sched->stream.retune) {
+                break; // the block ends at the retune
+            }
+            double offset = job_offset(&job->cmd, lo_frequency);
+            if (!num_equal(offset, sched->stream.freq_offset)) {
+                if (n) {
+                    break; // a block is mixed with a single offset
+                }
+                sched->stream.freq_offset = offset;
+            }
+            unlink_job(sched, job);
+            if (job->state == JOB_FAILED) {
+                pthread_mutex_unlock(&sched->lock);
+                job_done(sched, job, -1);
+                pthread_mutex_lock(&sched->lock);
+                continue;
+            }
+            job_start(sched, job);
+        }
+
+        if (job->pos < job->n_samps) {
+            size_t len = job->n_samps - job->pos;
+            if (len > n_samps - n)
+                len = n_samps - n;
+            memcpy(&out[n * 2], &job->samples[job->pos * 2], len * 2 * sizeof(float));
+            job->pos += len;
+            job->written += len;
+            n += len;
+            continue;
+        }
+        if (job->loops) {
+            job->loops--;
+            job->pos = 0;
+            continue;
+        }
+
+        sched->active = NULL;
+        pthread_mutex_unlock(&sched->lock);
+        job_done(sched, job, 0);
+        pthread_mutex_lock(&sched->lock);
+    }
+    int retry = !n && sched->stream.retune && !sched->stream.flag_abort;
+    pthread_mutex_unlock(&sched->lock);
+
+    return retry ? -1 : (ssize_t)n;
+}
+
+static void *sched_worker(void *arg)
+{
+    tx_sched_t *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->quit) {
+        if (sched->direct && sched->flag_abort && *sched->flag_abort) {
+            sched->direct->flag_abort = 1; // pass an abort on
+        }
+
+        sched_job_t *job = NULL;
+        if (count_ready(sched) < SCHED_MAX_READY) {
+            job = next_job(sched, 1);
+        }
+        if (!job) {
+            sched_wait(sched, 100);
+            continue;
+        }
+        job->state = JOB_RENDERING;
+        pthread_mutex_unlock(&sched->lock);
+
+        tx_thread_pin(&job->cmd, "render");
+
+        size_t n_samps = 0;
+        float *samples = tx_input_render(sched->tx_ctx, &job->cmd, &n_samps);
+
+        pthread_mutex_lock(&sched->lock);
+        job->samples = samples;
+        job->n_samps = n_samps;
+        job->state   = samples ? JOB_READY : JOB_FAILED;
+        pthread_cond_broadcast(&sched->cond);
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return NULL;
+}
+
+tx_sched_t *tx_sched_create(tx_ctx_t *tx_ctx, unsigned workers, tx_sched_done_fn done_cb)
+{
+    tx_sched_t *sched = calloc(1, sizeof(*sched));
+    if (!sched) {
+        fprintf(stderr, "calloc() failed\n");
+        return NULL;
+    }
+    sched->tx_ctx   = tx_ctx;
+    sched->done_cb  = done_cb;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+
+    if (workers < 1)
+        workers = 1;
+    sched->workers = calloc(workers, sizeof(pthread_t));
+    for (unsigned i = 0; sched->workers && i < workers; ++i) {
+        if (pthread_create(&sched->workers[i], NULL, sched_worker, sched)) {
+            fprintf(stderr, "Failed to start render worker\n");
+            break;
+        }
+        sched->workers_len++;
+    }
+    if (!sched->workers_len) {
+        tx_sched_free(sched);
+        return NULL;
+    }
+
+    return sched;
+}
+
+unsigned tx_sched_submit(tx_sched_t *sched, tx_cmd_t const *job, int priority, unsigned deadline_ms, void *job_ctx)
+{
+    sched_job_t *entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        fprintf(stderr, "calloc() failed\n");
+        return 0;
+    }
+    entry->cmd      = *job;
+    entry->job_ctx  = job_ctx;
+    entry->priority = priority;
+    entry->deadline = deadline_ms ? now_ms() + deadline_ms : 0;
+
+    pthread_mutex_lock(&sched->lock);
+    if (sched->closed) {
+        pthread_mutex_unlock(&sched->lock);
+        free(entry);
+        return 0;
+    }
+    entry->id    = ++sched->next_id;
+    entry->next  = sched->queue;
+    sched->queue = entry;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    return entry->id;
+}
+
+void tx_sched_close(tx_sched_t *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched->closed = 1;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+int tx_sched_run(tx_sched_t *sched, int *flag_abort)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->flag_abort = flag_abort;
+    while (!*flag_abort) {
+        sched_job_t *job = next_job(sched, 0);
+        if (!job) {
+            if (sched->closed)
+                break;
+            sched_wait(sched, 100);
+            continue;
+        }
+        if (job->state == JOB_QUEUED && !is_render_job(&job->cmd)) {
+            // run other jobs as is
+            unlink_job(sched, job);
+            sched->direct = &job->cmd;
+            pthread_mutex_unlock(&sched->lock);
+            int r = tx_transmit(sched->tx_ctx, &job->cmd);
+            pthread_mutex_lock(&sched->lock);
+            sched->direct = NULL;
+            pthread_mutex_unlock(&sched->lock);
+            job->written = job->cmd.samples_written;
+            job_done(sched, job, r);
+            pthread_mutex_lock(&sched->lock);
+            continue;
+        }
+        if (job->state == JOB_QUEUED || job->state == JOB_RENDERING) {
+            sched_wait(sched, 10);
+            continue;
+        }
+        unlink_job(sched, job);
+        if (job->state == JOB_FAILED) {
+            pthread_mutex_unlock(&sched->lock);
+            job_done(sched, job, -1);
+            pthread_mutex_lock(&sched->lock);
+            continue;
+        }
+
+        // start a stream with this job, compatible jobs are spliced on
+        sched->stream_req          = job->cmd;
+        sched->stream_req.gain_str = str_keep(&sched->stream_gain, job->cmd.gain_str);
+        sched->stream_req.antenna  = str_keep(&sched->stream_antenna, job->cmd.antenna);
+        sched->stream              = sched->stream_req;
+        sched->stream.codes        = NULL;
+        sched->stream.pulses       = NULL;
+        sched->stream.preset       = NULL;
+        sched->stream.input_format = "CF32";
+        sched->stream.stream_fd    = -1;
+        sched->stream.read_cb      = sched_read;
+        sched->stream.read_ctx     = sched;
+        sched->stream.loops        = 0;
+        sched->stream.flag_abort   = 0;
+        job_start(sched, job);
+        pthread_mutex_unlock(&sched->lock);
+
+        int r = tx_transmit(sched->tx_ctx, &sched->stream);
+        if (r) {
+            ret = r;
+        }
+
+        pthread_mutex_lock(&sched->lock);
+        job = sched->active;
+        sched->active = NULL;
+        if (job) {
+            // aborted or failed mid-job
+            pthread_mutex_unlock(&sched->lock);
+            job_done(sched, job, r ? r : -1);
+            pthread_mutex_lock(&sched->lock);
+        }
+    }
+
+    if (*flag_abort) {
+        // aborted, report the remaining jobs as failed
+        sched->closed = 1;
+        while (sched->queue) {
+            sched_job_t *job = sched->queue;
+            while (job && job->state == JOB_RENDERING)
+                job = job->next;
+            if (!job) {
+                sched_wait(sched, 10); // let the workers finish
+                continue;
+            }
+            unlink_job(sched, job);
+            pthread_mutex_unlock(&sched->lock);
+            job_done(sched, job, -1);
+            pthread_mutex_lock(&sched->lock);
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return ret;
+}
+
+void tx_sched_free(tx_sched_t *sched)
+{
+    if (!sched)
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->quit = 1;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (unsigned i = 0; i < sched->workers_len; ++i) {
+        pthread_join(sched->workers[i], NULL);
+    }
+    free(sched->workers);
+
+    while (sched->queue) {
+        sched_job_t *job = sched->queue;
+        sched->queue     = job->next;
+        job_done(sched, job, -1);
+    }
+
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->stream_gain);
+    free(sched->stream_antenna);
+    free(sched->retune_gain);
+    free(sched);
+}
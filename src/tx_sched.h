@@ -0,0 +1,62 @@
+/** @file
+    tx_tools - tx_sched, a priority scheduler for transmit jobs.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_TXSCHED_H_
+#define INCLUDE_TXSCHED_H_
+
+#include "tx_lib.h"
+
+/*
+    Jobs run by priority (higher first), then deadline (earlier first),
+    then in order of submission.
+
+    Code and pulse jobs are pre-rendered on worker threads while earlier
+    jobs transmit. Consecutive rendered jobs on the same device, channel,
+    and antenna, with the same format and rate, are spliced into a single
+    stream without gaps. A change in frequency or gain retunes the stream
+    between the jobs. Any other change in setup ends the stream and the
+    next job starts a new one. Other jobs, e.g. file input, run on their own.
+
+    With a hop_span set, jobs on other frequencies within the span are
+    spliced on without retuning, the difference to the LO is mixed in software.
+*/
+
+typedef struct tx_sched tx_sched_t;
+
+/// Called when a job is done, result is 0 on success. samples_written in @p job is the job's share.
+typedef void (*tx_sched_done_fn)(void *job_ctx, unsigned job_id, tx_cmd_t *job, int result);
+
+/// Create a scheduler with a number of pre-render workers (at least one).
+tx_sched_t *tx_sched_create(tx_ctx_t *tx_ctx, unsigned workers, tx_sched_done_fn done_cb);
+
+/// Queue a copy of a job, its strings must stay valid until it is done.
+/// A deadline_ms of 0 means none. Returns the job id, 0 on error.
+unsigned tx_sched_submit(tx_sched_t *sched, tx_cmd_t const *job, int priority, unsigned deadline_ms, void *job_ctx);
+
+/// Accept no more jobs, tx_sched_run() returns once the queue is drained.
+void tx_sched_close(tx_sched_t *sched);
+
+/// Transmit queued jobs until closed and drained, or aborted.
+/// On abort the scheduler is closed and the remaining jobs are reported as failed.
+int tx_sched_run(tx_sched_t *sched, int *flag_abort);
+
+/// Stop the workers and free the scheduler, unfinished jobs are reported as failed.
+void tx_sched_free(tx_sched_t *sched);
+
+#endif /* INCLUDE_TXSCHED_H_ */
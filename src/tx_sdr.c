@@ -47,9 +47,14 @@
 #endif
 
 #include "optparse.h"
+#include "read_text.h"
 #include "tx_lib.h"
+#include "tx_daemon.h"
+#include "tx_shm.h"
 
 #define DEFAULT_SAMPLE_RATE 2048000
+#define MAX_DEVICES 8
+#define MAX_CHANNELS 3 ///< extra channels, besides the main one
 
 static void print_version(void)
 {
@@ -64,27 +69,261 @@ static void usage(int exit_code)
     fprintf(stderr,
             "\nUsage:\t -f frequency_to_tune_to [Hz]\n"
             "\t[-s samplerate (default: 2048000 Hz)]\n"
-            "\t[-d device key/value query (ex: 0, 1, driver=lime, driver=hackrf)]\n"
+            "\t[-r input sample rate, resampled to the device rate (default: same as -s)]\n"
+            "\t[-o frequency offset, mixed in software (ex: -250k)]\n"
+            "\t[-W hop span, keep the LO while the target is within and mix in software (ex: 1.5M)]\n"
+            "\t[-H hop list of frequency:dwell_ms[:gain], cycled until the input ends (ex: 433.92M:20,434.1M:20:30)]\n"
+            "\t[-d device key/value query (ex: 0, 1, driver=lime, driver=hackrf, null:pace, file:out.cs16)]\n"
+            "\t\trepeat to transmit on several devices at once, with one input file each\n"
             "\t[-g tuner gain(s) (ex: 20, 40, PAD=-10)]\n"
             "\t[-a antenna (ex: BAND2)]\n"
             "\t[-C channel]\n"
+            "\t[-M extra channel on the same device, repeatable (ex: channel=1,gain=30,antenna=BAND2,freq=868M,file=b.cs8)]\n"
+            "\t\tkeys are channel, gain, antenna, freq, format, and file (default: silence)\n"
             "\t[-K master clock rate (ex: 80M)]\n"
+            "\t[-c calibration cache directory, \"\" to disable (default: ~/.cache/tx_tools)]\n"
+            "\t[-I IQ calibration file, DC offset and IQ imbalance corrections by device, channel, and frequency]\n"
+            "\t\tlines of: device channel frequency dc_i dc_q gain phase_deg (ex: lime 0 433.92M 0.001 -0.002 1.01 0.5)\n"
             "\t[-B bandwidth (ex: 5M)]\n"
             "\t[-p ppm_error (default: 0)]\n"
             "\t[-b output_block_size (default: 16384)]\n"
             "\t[-n number of samples to write (default: 0, infinite)]\n"
             "\t[-l loops count of times to write (default: 0, use -1 for infinite)]\n"
             "\t[-F force input format, CU8|CS8|CS12|CS16|CF32 (default: use file extension)]\n"
+            "\t[-O force output format, CS8|CS12|CS16|CF32 (default: negotiated by the device)]\n"
+            "\t[-Q device FIFO size in samples (ex: 1M)]\n"
+            "\t[-L latency mode, balanced|low|throughput (default: balanced)]\n"
+            "\t[-D delay of the first sample in ms (default: 0, untimed)]\n"
+            "\t[-e time source to align the device time on for a timed start (ex: PPS, needs -D above 1000)]\n"
+            "\t[-E elastic buffer in ms for a live input, tracks the input clock by resampling (ex: 200)]\n"
+            "\t[-R real-time priority of the device thread, also locks memory, [fifo:|rr:]1-99 (ex: 50)]\n"
+            "\t[-A CPU affinity by thread role, device, status, and render (ex: device=2,status=3,render=0-1)]\n"
+            "\t[-t code text to render and transmit, @file to read it (ex: \"(10k 0 50ms)\")]\n"
+            "\t[-u pulse text to render and transmit, @file to read it]\n"
+            "\t[-P preset name to render, from the presets directory]\n"
+            "\t\tcodes and pulses render on a thread while transmitting, instead of an input file\n"
+            "\t[-N line packets, each line of the input is code text sent on arrival, silence in between]\n"
+            "\t\tsymbols come from the -P preset (ex: echo \"{0xcafe}\" | tx_sdr -N -P generic -f 433.92M)\n"
+            "\t[-X playlist file, items sent back to back in one session, loops with -l]\n"
+            "\t\tlines of: [repeats=N] [gap=ms] [gain=dB] file|preset:NAME|code:TEXT|pulses:TEXT\n"
+            "\t[-S socket path, run as daemon and serve transmit jobs (see tx_daemon.h)]\n"
+            "\t[-T presets directory for -P and jobs]\n"
             "\t[-V] Output the version string and exit\n"
             "\t[-v] Increase verbosity (can be used multiple times)\n"
             "\t\t-v : verbose, -vv : debug, -vvv : trace\n"
             "\t[-h] Output this usage help and exit\n"
-            "\tfilename (a '-' reads samples from stdin)\n\n");
+            "\tfilename(s) (a '-' reads samples from stdin, shm:NAME from a shared memory ring, see tx_shm.h)\n\n");
     exit(exit_code);
 }
 
 static int *do_exit;
 
+// Text from an option, or read from a file if it starts with "@".
+// Returns the text, @p text_buf holds the allocation to free, if any.
+static char const *option_text(char const *arg, char **text_buf)
+{
+    if (*arg != '@') {
+        return arg;
+    }
+    free(*text_buf);
+    *text_buf = read_text_file(&arg[1]);
+    if (!*text_buf) {
+        fprintf(stderr, "Failed to read %s\n", &arg[1]);
+        exit(1);
+    }
+    return *text_buf;
+}
+
+// Attach to a shared memory ring, waiting for the producer to create it.
+// The ring header gives the input format and rate, unless forced.
+static int open_shm(tx_cmd_t *tx, char const *name)
+{
+    tx_shm_t *shm;
+    int waiting = 0;
+    while (!(shm = tx_shm_open(name))) {
+        if ((errno != ENOENT && errno != EAGAIN) || *do_exit) {
+            fprintf(stderr, "Failed to open ring %s\n", name);
+            return -1;
+        }
+        if (!waiting++) {
+            fprintf(stderr, "Waiting for ring %s...\n", name);
+        }
+        usleep(100000);
+    }
+
+    char const *format = tx_parse_sample_format(shm->hdr->format);
+    if (!tx->input_format) {
+        tx->input_format = format;
+    }
+    else if (strcmp(tx->input_format, format)) {
+        fprintf(stderr, "Ring %s holds %s samples, not %s\n", name, format, tx->input_format);
+        tx_shm_close(shm);
+        return -1;
+    }
+    double rate = shm->hdr->sample_rate;
+    if (rate > 0.0 && rate != tx->sample_rate && tx->input_rate == 0.0) {
+        fprintf(stderr, "Resampling ring input from %.0f S/s\n", rate);
+        tx->input_rate = rate;
+    }
+    tx->shm = shm;
+    return 0;
+}
+
+// Open an input file and detect the input format if not forced.
+static int open_input(tx_cmd_t *tx, char const *filename)
+{
+    if (!strncmp(filename, "shm:", 4)) {
+        return open_shm(tx, &filename[4]);
+    }
+
+    const char *ext = strrchr(filename, '.');
+    if (ext) {
+        ext++;
+    }
+    else {
+        ext = "";
+    }
+    // detect input format if not forced
+    if (!tx->input_format) {
+        tx->input_format = tx_parse_sample_format(ext);
+    }
+    if (!tx_valid_input_format(tx->input_format)) {
+        fprintf(stderr, "Unknown input format \"%s\", falling back to CU8.\n", ext);
+        tx->input_format = tx_parse_sample_format("CU8");
+    }
+
+    if (strcmp(filename, "-") == 0) { /* Read samples from stdin */
+        tx->stream_fd = fileno(stdin);
+        fcntl(tx->stream_fd, F_SETFL, fcntl(tx->stream_fd, F_GETFL) | O_NONBLOCK);
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    }
+    else {
+        tx->stream_fd = open(filename, O_RDONLY | O_NONBLOCK);
+        if (tx->stream_fd < 0) {
+            fprintf(stderr, "Failed to open %s\n", filename);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_input(tx_cmd_t *tx)
+{
+    if (tx->shm) {
+        tx_shm_close(tx->shm); // the producer owns the name, a restart may reattach
+        tx->shm = NULL;
+    }
+    if (tx->stream_fd >= 0 && tx->stream_fd != fileno(stdin))
+        close(tx->stream_fd);
+    tx->stream_fd = -1;
+}
+
+// Parse an extra channel spec, e.g. "channel=1,gain=30,file=b.cs8", and open its input.
+// Values point into @p arg, which is modified.
+static int open_channel(tx_cmd_t *ch, char *arg)
+{
+    char *filename = NULL;
+    while (arg && *arg) {
+        char *key = arg;
+        arg       = strchr(arg, ',');
+        if (arg) {
+            *arg++ = '\0';
+        }
+        char *val = strchr(key, '=');
+        if (!val) {
+            fprintf(stderr, "Missing value in extra channel option \"%s\"\n", key);
+            return -1;
+        }
+        *val++ = '\0';
+        if (!strcmp(key, "channel")) {
+            ch->channel = atou_metric(val, "-M channel: ");
+        }
+        else if (!strcmp(key, "gain")) {
+            ch->gain_str = val;
+        }
+        else if (!strcmp(key, "antenna")) {
+            ch->antenna = val;
+        }
+        else if (!strcmp(key, "freq")) {
+            ch->center_frequency = atodu_metric(val, "-M freq: ");
+        }
+        else if (!strcmp(key, "format")) {
+            ch->input_format = tx_parse_sample_format(val);
+        }
+        else if (!strcmp(key, "file")) {
+            filename = val;
+        }
+        else {
+            fprintf(stderr, "Unknown extra channel option \"%s\"\n", key);
+            return -1;
+        }
+    }
+    if (!filename) {
+        ch->input_format = tx_parse_sample_format("CU8");
+        return 0; // silence
+    }
+    if (!strcmp(filename, "-")) {
+        fprintf(stderr, "Extra channels can not read from stdin\n");
+        return -1;
+    }
+    return open_input(ch, filename);
+}
+
+// Transmit on several devices at once, from one input each or one shared input file.
+static int transmit_multi(tx_cmd_t *tx, char const **dev_queries, size_t dev_count, char **filenames, size_t file_count)
+{
+    tx_cmd_t txs[MAX_DEVICES];
+    size_t dev_index[MAX_DEVICES];
+    tx_ctx_t ctx  = {0};
+    size_t opened = 0;
+    int r         = -1;
+
+    if (file_count != 1 && file_count != dev_count) {
+        fprintf(stderr, "Give one input file, or one for each of the %zu devices.\n", dev_count);
+        return -1;
+    }
+    if (file_count == 1 && !strcmp(filenames[0], "-")) {
+        fprintf(stderr, "Input from stdin can not be shared by several devices.\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < dev_count; ++i) {
+        dev_index[i] = ctx.devs_len;
+        tx_enum_devices(&ctx, dev_queries[i]);
+        if (ctx.devs_len == dev_index[i]) {
+            fprintf(stderr, "No device found for \"%s\"\n", dev_queries[i]);
+            goto out;
+        }
+    }
+
+    for (size_t i = 0; i < dev_count; ++i) {
+        txs[i]           = *tx;
+        txs[i].dev_query = ctx.devs[dev_index[i]].dev_kwargs;
+        for (size_t j = 0; j < i; ++j) {
+            if (dev_index[j] == dev_index[i] || !strcmp(txs[j].dev_query, txs[i].dev_query)) {
+                fprintf(stderr, "Device \"%s\" selected twice\n", txs[i].dev_query);
+                goto close;
+            }
+        }
+        if (open_input(&txs[i], filenames[file_count == 1 ? 0 : i])) {
+            goto close;
+        }
+        opened++;
+    }
+
+    r = tx_transmit_multi(&ctx, txs, dev_count, &tx->flag_abort);
+
+close:
+    for (size_t i = 0; i < opened; ++i) {
+        close_input(&txs[i]);
+    }
+out:
+    tx_free_devices(&ctx);
+    return r;
+}
+
 #ifdef _WIN32
 BOOL WINAPI
 sighandler(int signum)
@@ -112,6 +351,16 @@ int main(int argc, char **argv)
 #endif
     tx_cmd_t tx = {0};
     char *filename = NULL;
+    char const *dev_queries[MAX_DEVICES] = {0};
+    size_t dev_count = 0;
+    char *channel_args[MAX_CHANNELS] = {0};
+    tx_cmd_t channels[MAX_CHANNELS];
+    tx_cmd_t *channel_ptrs[MAX_CHANNELS];
+    size_t channel_count = 0;
+    char *socket_path = NULL;
+    char *presets_dir = NULL;
+    char *codes_buf = NULL;
+    char *pulses_buf = NULL;
     int verbose = 0;
     int r, opt;
 
@@ -122,7 +371,7 @@ int main(int argc, char **argv)
 #ifndef _WIN32
     sigact.sa_handler = sighandler;
     sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
+    sigact.sa_flags = SA_RESTART; // the daemon polls for the abort
     sigaction(SIGINT, &sigact, NULL);
     sigaction(SIGTERM, &sigact, NULL);
     sigaction(SIGQUIT, &sigact, NULL);
@@ -133,7 +382,7 @@ int main(int argc, char **argv)
 
     print_version();
 
-    while ((opt = getopt(argc, argv, "Vvhd:f:g:a:s:C:K:B:b:n:l:p:F:")) != -1) {
+    while ((opt = getopt(argc, argv, "Vvhd:f:r:o:W:H:g:a:s:c:I:C:M:K:B:b:n:l:p:F:O:Q:L:D:e:E:R:A:t:u:P:NX:S:T:")) != -1) {
         switch (opt) {
         case 'V':
             exit(0);
@@ -143,11 +392,32 @@ int main(int argc, char **argv)
         case 'h':
             usage(0);
         case 'd':
-            tx.dev_query = optarg;
+            if (dev_count >= MAX_DEVICES) {
+                fprintf(stderr, "Too many devices, at most %d\n", MAX_DEVICES);
+                usage(1);
+            }
+            dev_queries[dev_count++] = optarg;
+            tx.dev_query = dev_queries[0];
             break;
         case 'f':
             tx.center_frequency = atodu_metric(optarg, "-f: ");
             break;
+        case 'r':
+            tx.input_rate = atodu_metric(optarg, "-r: ");
+            break;
+        case 'o':
+            tx.freq_offset = atod_metric(optarg, "-o: ");
+            break;
+        case 'W':
+            tx.hop_span = atodu_metric(optarg, "-W: ");
+            break;
+        case 'H':
+            free((void *)tx.hops);
+            tx.hops = tx_parse_hops(optarg, &tx.hops_len);
+            if (!tx.hops) {
+                usage(1);
+            }
+            break;
         case 'g':
             tx.gain_str = optarg;
             break;
@@ -157,6 +427,22 @@ int main(int argc, char **argv)
         case 's':
             tx.sample_rate = atodu_metric(optarg, "-s: ");
             break;
+        case 'c':
+            tx.cache_dir = optarg;
+            break;
+        case 'I':
+            tx.iq_cal_file = optarg;
+            break;
+        case 'C':
+            tx.channel = atou_metric(optarg, "-C: ");
+            break;
+        case 'M':
+            if (channel_count >= MAX_CHANNELS) {
+                fprintf(stderr, "Too many extra channels, at most %d\n", MAX_CHANNELS);
+                usage(1);
+            }
+            channel_args[channel_count++] = optarg;
+            break;
         case 'K':
             tx.master_clock_rate = atodu_metric(optarg, "-K: ");
             break;
@@ -183,17 +469,145 @@ int main(int argc, char **argv)
                 exit(1);
             }
             break;
+        case 'O':
+            tx.output_format = tx_parse_sample_format(optarg);
+            if (!tx_valid_output_format(tx.output_format)) {
+                fprintf(stderr, "Unsupported output format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'Q':
+            tx.fifo_size = atou_metric(optarg, "-Q: ");
+            break;
+        case 'L':
+            if (!strcmp(optarg, "balanced"))
+                tx.latency_mode = 0;
+            else if (!strcmp(optarg, "low"))
+                tx.latency_mode = 1;
+            else if (!strcmp(optarg, "throughput"))
+                tx.latency_mode = 2;
+            else {
+                fprintf(stderr, "Unknown latency mode: %s\n", optarg);
+                usage(1);
+            }
+            break;
+        case 'D':
+            tx.initial_delay = atou_metric(optarg, "-D: ");
+            break;
+        case 'e':
+            tx.time_source = optarg;
+            break;
+        case 'E':
+            tx.elastic_ms = atou_metric(optarg, "-E: ");
+            break;
+        case 'R':
+            if (!strncmp(optarg, "rr:", 3)) {
+                tx.rt_round_robin = 1;
+                optarg += 3;
+            }
+            else if (!strncmp(optarg, "fifo:", 5)) {
+                optarg += 5;
+            }
+            tx.rt_priority = atoi(optarg);
+            if (tx.rt_priority < 1 || tx.rt_priority > 99) {
+                fprintf(stderr, "Real-time priority must be 1 to 99: %s\n", optarg);
+                usage(1);
+            }
+            break;
+        case 'A':
+            tx.cpu_affinity = optarg;
+            break;
+        case 't':
+            tx.codes = option_text(optarg, &codes_buf);
+            break;
+        case 'u':
+            tx.pulses = option_text(optarg, &pulses_buf);
+            break;
+        case 'P':
+            tx.preset = optarg;
+            break;
+        case 'N':
+            tx.line_packets = 1;
+            break;
+        case 'X':
+            tx.playlist = optarg;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'T':
+            presets_dir = optarg;
+            break;
         default:
             usage(1);
         }
     }
 
-    if (tx.center_frequency == 0.0) {
+    // memory locking is process wide, hold it across all device threads and daemon jobs
+    int mem_locked = tx.rt_priority && !tx_mem_lock();
+
+    if (socket_path) {
+        // jobs bring their own input and may set the frequency, keep the devices open between jobs
+        tx_ctx_t ctx = {0};
+        if (presets_dir) {
+            tx_presets_load(&ctx, presets_dir);
+        }
+        tx_enum_devices(&ctx, tx.dev_query);
+        tx.dev_query = ""; // use the first available device
+        r = tx_daemon_run(&ctx, &tx, socket_path);
+        tx_free_devices(&ctx);
+        tx_presets_free(&ctx);
+        if (mem_locked) {
+            tx_mem_unlock();
+        }
+        return r ? 1 : 0;
+    }
+
+    if (tx.center_frequency == 0.0 && !tx.hops_len) {
         fprintf(stderr, "Frequency not set!\n");
         usage(1);
     }
 
-    if (argc <= optind) {
+    (void)verbose; // not used currently
+
+    if (dev_count > 1 && channel_count) {
+        fprintf(stderr, "Extra channels need a single device\n");
+        usage(1);
+    }
+
+    // code, pulse, or preset input renders instead of a file
+    int has_text = tx.codes || tx.pulses || (tx.preset && !tx.line_packets && !tx.playlist);
+    if (tx.playlist && (tx.codes || tx.pulses || tx.line_packets || dev_count > 1 || argc > optind)) {
+        fprintf(stderr, "A playlist replaces input files and code input and needs a single device\n");
+        usage(1);
+    }
+    if (tx.line_packets && (tx.codes || tx.pulses || dev_count > 1)) {
+        fprintf(stderr, "Line packets replace code input and need a single device\n");
+        usage(1);
+    }
+    if (tx.line_packets || tx.playlist) {
+        tx.input_format = "CF32"; // packets and playlists render to CF32, skip format detection
+    }
+    if (tx.preset && !tx.codes && !tx.pulses && !tx.line_packets && !tx.playlist) {
+        tx.codes = ""; // the preset alone
+    }
+    if (has_text && (dev_count > 1 || argc > optind)) {
+        fprintf(stderr, "Code input replaces input files and needs a single device\n");
+        usage(1);
+    }
+
+    if (dev_count > 1) {
+        r = transmit_multi(&tx, dev_queries, dev_count, &argv[optind], (size_t)(argc - optind));
+        if (mem_locked) {
+            tx_mem_unlock();
+        }
+        return r ? 1 : 0;
+    }
+
+    if (has_text || tx.playlist) {
+        filename = NULL;
+    }
+    else if (argc <= optind) {
         fprintf(stderr, "Input from stdin.\n");
         filename = "-";
     }
@@ -205,47 +619,51 @@ int main(int argc, char **argv)
         usage(1);
     }
 
-    const char *ext = strrchr(filename, '.');
-    if (ext) {
-        ext++;
-    }
-    else {
-        ext = "";
-    }
-    // detect input format if not forced
-    if (!tx.input_format) {
-        tx.input_format = tx_parse_sample_format(ext);
-    }
-    if (!tx_valid_input_format(tx.input_format)) {
-        fprintf(stderr, "Unknown input format \"%s\", falling back to CU8.\n", ext);
-        tx.input_format = tx_parse_sample_format("CU8");
+    if (filename && open_input(&tx, filename)) {
+        return 1;
     }
 
-    (void)verbose; // not used currently
-
-    if (strcmp(filename, "-") == 0) { /* Read samples from stdin */
-        tx.stream_fd = fileno(stdin);
-        fcntl(tx.stream_fd, F_SETFL, fcntl(tx.stream_fd, F_GETFL) | O_NONBLOCK);
-#ifdef _WIN32
-        _setmode(_fileno(stdin), _O_BINARY);
-#endif
-    }
-    else {
-        tx.stream_fd = open(filename, O_RDONLY | O_NONBLOCK);
-        if (tx.stream_fd < 0) {
-            fprintf(stderr, "Failed to open %s\n", filename);
+    // extra channels stream along on the same device, silence unless a file is given
+    for (size_t i = 0; i < channel_count; ++i) {
+        channels[i]                  = (tx_cmd_t){0};
+        channels[i].stream_fd        = -1;
+        channels[i].samples_to_write = tx.samples_to_write;
+        channels[i].loops            = tx.loops;
+        channel_ptrs[i]              = &channels[i];
+        if (open_channel(&channels[i], channel_args[i])) {
+            for (size_t j = 0; j <= i; ++j) {
+                close_input(&channels[j]);
+            }
+            close_input(&tx);
             return 1;
         }
     }
+    tx.channels_len = channel_count;
+    tx.channels     = channel_count ? channel_ptrs : NULL;
 
     tx_ctx_t ctx = {0};
+    if (presets_dir) {
+        tx_presets_load(&ctx, presets_dir);
+    }
+    if (tx.preset && !tx_presets_get(&ctx, tx.preset)) {
+        fprintf(stderr, "Unknown preset \"%s\"\n", tx.preset);
+    }
     tx_enum_devices(&ctx, tx.dev_query);
     tx.dev_query = ""; // use the first available device
     r = tx_transmit(&ctx, &tx);
     tx_free_devices(&ctx);
+    tx_presets_free(&ctx);
 
-    if (tx.stream_fd >= 0 && tx.stream_fd != fileno(stdin))
-        close(tx.stream_fd);
+    for (size_t i = 0; i < channel_count; ++i) {
+        close_input(&channels[i]);
+    }
+    close_input(&tx);
+    free((void *)tx.hops);
+    free(codes_buf);
+    free(pulses_buf);
+    if (mem_locked) {
+        tx_mem_unlock();
+    }
 
     return r ? 1 : 0;
 }
@@ -0,0 +1,355 @@
+/** @file
+    tx_tools - tx_shm, a shared memory ring of I/Q samples between processes.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tx_shm.h"
+#include "sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_DATA_OFFSET 4096 ///< the ring starts on its own page
+
+#define LOAD_ACQ(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_REL(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+#ifndef _WIN32
+
+static char *shm_name_dup(char const *name)
+{
+    size_t len = strlen(name);
+    char *dup  = malloc(len + 2);
+    if (!dup) {
+        return NULL;
+    }
+    dup[0] = '/';
+    memcpy(&dup[*name == '/' ? 0 : 1], name, len + 1);
+    return dup;
+}
+
+// Wait while a futex word still holds seq, at most timeout_ms.
+static void shm_wait(uint32_t *word, uint32_t seq, int timeout_ms)
+{
+#ifdef __linux__
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, word, FUTEX_WAIT, seq, &ts, NULL, 0);
+#else
+    // poll where there is no process-shared futex
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000L};
+    for (int i = 0; i < timeout_ms && LOAD_ACQ(*word) == seq; ++i) {
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+static void shm_wake(uint32_t *word)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+static double elapsed_ms(struct timespec const *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e3 + (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+tx_shm_t *tx_shm_create(char const *name, char const *format, double sample_rate, size_t size)
+{
+    size_t sample_size = sample_format_length(sample_format_for(format));
+    if (!sample_size || strlen(format) >= sizeof(((tx_shm_header_t *)0)->format)) {
+        fprintf(stderr, "Unsupported ring format \"%s\"\n", format);
+        return NULL;
+    }
+    if (!size) {
+        size = TX_SHM_DEFAULT_SIZE;
+    }
+    size -= size % sample_size;
+
+    tx_shm_t *shm = calloc(1, sizeof(*shm));
+    if (!shm || !(shm->name = shm_name_dup(name))) {
+        fprintf(stderr, "calloc() failed\n");
+        free(shm);
+        return NULL;
+    }
+
+    shm_unlink(shm->name); // a stale ring
+    int fd = shm_open(shm->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create ring %s (%s)\n", shm->name, strerror(errno));
+        free(shm->name);
+        free(shm);
+        return NULL;
+    }
+    shm->map_size = SHM_DATA_OFFSET + size;
+    void *map     = MAP_FAILED;
+    if (ftruncate(fd, (off_t)shm->map_size) == 0) {
+        map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map ring %s (%s)\n", shm->name, strerror(errno));
+        shm_unlink(shm->name);
+        free(shm->name);
+        free(shm);
+        return NULL;
+    }
+
+    shm->hdr  = map;
+    shm->data = (uint8_t *)map + SHM_DATA_OFFSET;
+
+    tx_shm_header_t *hdr = shm->hdr;
+    hdr->version         = TX_SHM_VERSION;
+    memcpy(hdr->format, format, strlen(format) + 1);
+    hdr->sample_rate = sample_rate;
+    hdr->data_offset = SHM_DATA_OFFSET;
+    hdr->size        = size;
+    STORE_REL(hdr->magic, TX_SHM_MAGIC);
+
+    return shm;
+}
+
+tx_shm_t *tx_shm_open(char const *name)
+{
+    tx_shm_t *shm = calloc(1, sizeof(*shm));
+    if (!shm || !(shm->name = shm_name_dup(name))) {
+        fprintf(stderr, "calloc() failed\n");
+        free(shm);
+        return NULL;
+    }
+
+    int fd = shm_open(shm->name, O_RDWR, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(tx_shm_header_t)) {
+        int err = fd < 0 ? errno : EAGAIN;
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(shm->name);
+        free(shm);
+        errno = err;
+        return NULL;
+    }
+    shm->map_size = (size_t)st.st_size;
+    void *map     = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        int err = errno;
+        free(shm->name);
+        free(shm);
+        errno = err;
+        return NULL;
+    }
+    shm->hdr = map;
+
+    // the producer sets magic last
+    tx_shm_header_t *hdr = shm->hdr;
+    if (LOAD_ACQ(hdr->magic) != TX_SHM_MAGIC) {
+        tx_shm_close(shm);
+        errno = EAGAIN;
+        return NULL;
+    }
+    if (hdr->version != TX_SHM_VERSION || hdr->data_offset + hdr->size > shm->map_size || !hdr->size
+            || !memchr(hdr->format, '\0', sizeof(hdr->format))
+            || !sample_format_length(sample_format_for(hdr->format))) {
+        fprintf(stderr, "Invalid ring %s\n", shm->name);
+        tx_shm_close(shm);
+        errno = EINVAL;
+        return NULL;
+    }
+    shm->data = (uint8_t *)map + hdr->data_offset;
+
+    return shm;
+}
+
+void tx_shm_close(tx_shm_t *shm)
+{
+    if (!shm) {
+        return;
+    }
+    munmap(shm->hdr, shm->map_size);
+    free(shm->name);
+    free(shm);
+}
+
+void tx_shm_unlink(tx_shm_t *shm)
+{
+    shm_unlink(shm->name);
+}
+
+ssize_t tx_shm_read_span(tx_shm_t *shm, void **ptr, int timeout_ms)
+{
+    tx_shm_header_t *hdr = shm->hdr;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        uint32_t seq   = LOAD_ACQ(hdr->data_seq);
+        uint32_t flags = LOAD_ACQ(hdr->flags);
+        uint64_t wpos  = LOAD_ACQ(hdr->write_pos);
+        uint64_t rpos  = hdr->read_pos; // only the consumer moves it
+        if (wpos != rpos) {
+            size_t idx  = (size_t)(rpos % hdr->size);
+            size_t left = (size_t)(wpos - rpos);
+            *ptr        = &shm->data[idx];
+            return (ssize_t)(left < hdr->size - idx ? left : hdr->size - idx);
+        }
+        if (flags & TX_SHM_EOF) {
+            return 0;
+        }
+        int wait = timeout_ms - (int)elapsed_ms(&start);
+        if (wait <= 0) {
+            return -1;
+        }
+        shm_wait(&hdr->data_seq, seq, wait);
+    }
+}
+
+void tx_shm_read_done(tx_shm_t *shm, size_t len)
+{
+    tx_shm_header_t *hdr = shm->hdr;
+    STORE_REL(hdr->read_pos, hdr->read_pos + len);
+    shm_wake(&hdr->space_seq);
+}
+
+ssize_t tx_shm_write_span(tx_shm_t *shm, void **ptr, int timeout_ms)
+{
+    tx_shm_header_t *hdr = shm->hdr;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        uint32_t seq  = LOAD_ACQ(hdr->space_seq);
+        uint64_t rpos = LOAD_ACQ(hdr->read_pos);
+        uint64_t wpos = hdr->write_pos; // only the producer moves it
+        if (wpos - rpos < hdr->size) {
+            size_t idx  = (size_t)(wpos % hdr->size);
+            size_t room = (size_t)(hdr->size - (wpos - rpos));
+            *ptr        = &shm->data[idx];
+            return (ssize_t)(room < hdr->size - idx ? room : hdr->size - idx);
+        }
+        int wait = timeout_ms - (int)elapsed_ms(&start);
+        if (wait <= 0) {
+            return -1;
+        }
+        shm_wait(&hdr->space_seq, seq, wait);
+    }
+}
+
+void tx_shm_write_done(tx_shm_t *shm, size_t len)
+{
+    tx_shm_header_t *hdr = shm->hdr;
+    STORE_REL(hdr->write_pos, hdr->write_pos + len);
+    shm_wake(&hdr->data_seq);
+}
+
+void tx_shm_finish(tx_shm_t *shm)
+{
+    tx_shm_header_t *hdr = shm->hdr;
+    __atomic_or_fetch(&hdr->flags, TX_SHM_EOF, __ATOMIC_RELEASE);
+    shm_wake(&hdr->data_seq);
+}
+
+int tx_shm_drain(tx_shm_t *shm, int timeout_ms)
+{
+    tx_shm_header_t *hdr = shm->hdr;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        uint32_t seq  = LOAD_ACQ(hdr->space_seq);
+        uint64_t rpos = LOAD_ACQ(hdr->read_pos);
+        if (rpos == hdr->write_pos) {
+            return 0;
+        }
+        int wait = timeout_ms - (int)elapsed_ms(&start);
+        if (wait <= 0) {
+            return -1;
+        }
+        shm_wait(&hdr->space_seq, seq, wait);
+    }
+}
+
+#else
+
+tx_shm_t *tx_shm_create(char const *name, char const *format, double sample_rate, size_t size)
+{
+    fprintf(stderr, "Shared memory rings are not supported on this platform\n");
+    return NULL;
+}
+
+tx_shm_t *tx_shm_open(char const *name)
+{
+    fprintf(stderr, "Shared memory rings are not supported on this platform\n");
+    errno = EINVAL;
+    return NULL;
+}
+
+void tx_shm_close(tx_shm_t *shm)
+{
+}
+
+void tx_shm_unlink(tx_shm_t *shm)
+{
+}
+
+ssize_t tx_shm_read_span(tx_shm_t *shm, void **ptr, int timeout_ms)
+{
+    return 0;
+}
+
+void tx_shm_read_done(tx_shm_t *shm, size_t len)
+{
+}
+
+ssize_t tx_shm_write_span(tx_shm_t *shm, void **ptr, int timeout_ms)
+{
+    return -1;
+}
+
+void tx_shm_write_done(tx_shm_t *shm, size_t len)
+{
+}
+
+void tx_shm_finish(tx_shm_t *shm)
+{
+}
+
+int tx_shm_drain(tx_shm_t *shm, int timeout_ms)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/** @file
+    tx_tools - tx_shm, a shared memory ring of I/Q samples between processes.
+
+    Copyright (C) 2019 by Christian Zuckschwerdt <zany@triq.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_TXSHM_H_
+#define INCLUDE_TXSHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+    A POSIX shared memory object (e.g. /dev/shm/NAME) holds a header
+    followed by the ring at data_offset. One producer writes whole samples
+    at write_pos, one consumer reads them at read_pos, both positions are
+    byte counts since the start and only grow, the ring index is the
+    position modulo size.
+
+    The producer creates the ring, fills the header, and sets magic last.
+    After writing it advances write_pos, increments data_seq, and wakes
+    waiters on data_seq. The consumer does the same with read_pos and
+    space_seq. Both words are process-shared futexes on Linux; a producer
+    may also just poll. Positions are read and written atomically with
+    acquire and release order. The producer sets TX_SHM_EOF in flags when
+    done. The producer owns the name: it replaces a stale ring of the same
+    name on create and unlinks it once the consumer drained it. A consumer never unlinks,
+    so a restarted consumer can attach to the same ring again.
+
+    E.g. in Python, map /dev/shm/NAME, pack the header with struct format
+    "<II8sdQQQQIIII", and write samples at data_offset.
+*/
+
+#define TX_SHM_MAGIC 0x4d485354u ///< "TSHM"
+#define TX_SHM_VERSION 1
+#define TX_SHM_EOF 1u            ///< flag, the producer is done
+#define TX_SHM_DEFAULT_SIZE (1 << 20) ///< ring size in bytes, unless set
+
+/// Header at the start of the shared memory, 72 bytes, little endian on all supported hosts.
+typedef struct tx_shm_header {
+    uint32_t magic;       ///< TX_SHM_MAGIC once the header is valid
+    uint32_t version;     ///< TX_SHM_VERSION
+    char format[8];       ///< sample format, e.g. "CS16", NUL padded
+    double sample_rate;   ///< sample rate of the producer, 0 if not known
+    uint64_t data_offset; ///< offset of the ring from the start of the header in bytes
+    uint64_t size;        ///< ring size in bytes, a multiple of the sample size
+    uint64_t write_pos;   ///< bytes written in total, advanced by the producer
+    uint64_t read_pos;    ///< bytes read in total, advanced by the consumer
+    uint32_t flags;       ///< TX_SHM_EOF when the producer is done
+    uint32_t data_seq;    ///< incremented with each write_pos advance, a futex
+    uint32_t space_seq;   ///< incremented with each read_pos advance, a futex
+    uint32_t reserved;
+} tx_shm_header_t;
+
+/// A mapped ring.
+typedef struct tx_shm {
+    tx_shm_header_t *hdr;
+    uint8_t *data;   ///< the ring
+    size_t map_size; ///< bytes mapped
+    char *name;      ///< shared memory name, with leading "/"
+} tx_shm_t;
+
+/// Create a ring as producer, an old ring of the same name is replaced.
+/// A size of 0 uses TX_SHM_DEFAULT_SIZE, it is rounded down to whole samples.
+tx_shm_t *tx_shm_create(char const *name, char const *format, double sample_rate, size_t size);
+
+/// Open a ring as consumer. Returns NULL with errno ENOENT or EAGAIN if it is not ready yet.
+tx_shm_t *tx_shm_open(char const *name);
+
+/// Unmap a ring.
+void tx_shm_close(tx_shm_t *shm);
+
+/// Remove the name of a ring, mappings stay valid. Only the producer unlinks.
+void tx_shm_unlink(tx_shm_t *shm);
+
+/// Wait up to timeout_ms for samples to read, sets @p ptr to them in place.
+/// Returns the contiguous bytes available, 0 at the end, -1 on timeout.
+ssize_t tx_shm_read_span(tx_shm_t *shm, void **ptr, int timeout_ms);
+
+/// Release bytes read from a span.
+void tx_shm_read_done(tx_shm_t *shm, size_t len);
+
+/// Wait up to timeout_ms for space to write, sets @p ptr to it in place.
+/// Returns the contiguous bytes free, -1 on timeout.
+ssize_t tx_shm_write_span(tx_shm_t *shm, void **ptr, int timeout_ms);
+
+/// Publish bytes written to a span, whole samples only.
+void tx_shm_write_done(tx_shm_t *shm, size_t len);
+
+/// Mark the end of the samples.
+void tx_shm_finish(tx_shm_t *shm);
+
+/// Wait up to timeout_ms for the consumer to read all samples written.
+/// Returns 0 once drained, -1 on timeout.
+int tx_shm_drain(tx_shm_t *shm, int timeout_ms);
+
+#endif /* INCLUDE_TXSHM_H_ */
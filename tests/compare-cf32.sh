@@ -0,0 +1,45 @@
+#!/bin/sh
+
+# compare two CF32 files within a tolerance
+# usage: compare-cf32.sh [-s] TOLERANCE FILE1 FILE2 [DELAY]
+# without a delay leading and trailing silence is ignored, with -s all silence,
+# with a delay FILE2 lags FILE1 by DELAY samples and only the overlap is compared
+trim=1
+if [ "$1" = "-s" ] ; then
+    trim=2
+    shift
+fi
+delay=${4:-0}
+samples() {
+    od -An -v -tf4 "$1" | awk -v trim="$2" -v skip="$3" -v drop="$4" '
+        { for (f = 1; f <= NF; ++f) v[k++] = $f }
+        END {
+            s = 0; e = k
+            if (trim) {
+                e = 0
+                for (i = 0; i < k; i += 2) if (v[i] != 0 || v[i + 1] != 0) { if (!e) s = i; e = i + 2 }
+            }
+            s += 2 * skip; e -= 2 * drop
+            for (i = s; i < e; i += 2) if (trim < 2 || v[i] != 0 || v[i + 1] != 0) print v[i], v[i + 1]
+        }'
+}
+if [ "$delay" -eq 0 ] ; then
+    samples "$2" $trim 0 0 > "$2.cmp"
+    samples "$3" $trim 0 0 > "$3.cmp"
+else
+    samples "$2" 0 0 "$delay" > "$2.cmp"
+    samples "$3" 0 "$delay" 0 > "$3.cmp"
+fi
+paste -d ' ' "$2.cmp" "$3.cmp" | awk -v tol="$1" '
+    NF != 4 { bad = 1 }
+    {
+        n++
+        d = $1 - $3; if (d < 0) d = -d
+        e = $2 - $4; if (e < 0) e = -e
+        if (e > d) d = e
+        if (d > m) m = d
+    }
+    END {
+        printf "%d samples, max difference %g%s\n", n, m, bad ? ", lengths differ" : ""
+        exit (bad || !n || m > tol)
+    }'